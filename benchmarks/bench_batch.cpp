@@ -0,0 +1,102 @@
+/*
+  MIT License
+
+  Copyright (c) 2017 Alberto Taiuti
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <spv_batch.h>
+#include <spv_utils.h>
+#include <bench_common.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+// Usage: bench_batch [max threads], defaulting to one per hardware thread
+int main(int argc, char **argv) {
+  const std::vector<uint32_t> base = bench::LoadSampleModule();
+  // Shader caches are made of many small modules; make them a bit larger
+  // than the sample one so that the per-module work dominates the dispatch
+  const std::vector<uint32_t> module = bench::MakeLargeModule(base, 1U << 14U);
+  const size_t modules_count = 1024;
+  const size_t repetitions = 3;
+
+  std::vector<sut::BatchInput> inputs(
+      modules_count, sut::BatchInput::Words(module.data(), module.size()));
+
+  // Put a nop in front of every load, which touches the opcode index, the
+  // pending operations and the emission
+  const uint32_t nop =
+      sut::MergeSpvOpCode({1U, static_cast<uint16_t>(spv::Op::OpNop)});
+  const sut::BatchProcessor::Transform transform =
+      [nop](size_t, sut::OpcodeStream &stream) {
+        for (sut::OpcodeIterator &i : stream.Instructions(spv::Op::OpLoad)) {
+          i.InsertBefore(&nop, 1);
+        }
+      };
+
+  std::atomic<size_t> emitted_words(0);
+  const sut::BatchProcessor::Sink sink = [&](const sut::BatchResult &result) {
+    emitted_words.fetch_add(result.words_count, std::memory_order_relaxed);
+  };
+
+  const size_t max_threads =
+      (argc > 1) ? std::max(std::atoi(argv[1]), 1)
+                 : std::max(std::thread::hardware_concurrency(), 1U);
+  std::vector<size_t> threads_counts;
+  for (size_t t = 1; t < max_threads; t *= 2) {
+    threads_counts.push_back(t);
+  }
+  threads_counts.push_back(max_threads);
+
+  std::printf("%zu modules of %zu words\n", modules_count, module.size());
+  std::printf("%8s %14s %9s %14s %9s\n", "threads", "modules/s", "speedup",
+              "ordered/s", "speedup");
+
+  double serial_rate = 0.0;
+  double serial_ordered_rate = 0.0;
+  for (size_t t = 0; t < threads_counts.size(); ++t) {
+    sut::BatchProcessor processor(threads_counts[t]);
+
+    double time = bench::MeasureBest(repetitions, [&]() {
+      processor.Run(inputs, transform, sink);
+    });
+    double ordered_time = bench::MeasureBest(repetitions, [&]() {
+      processor.RunOrdered(inputs, transform, sink);
+    });
+
+    const double rate = modules_count / time;
+    const double ordered_rate = modules_count / ordered_time;
+    if (t == 0) {
+      serial_rate = rate;
+      serial_ordered_rate = ordered_rate;
+    }
+
+    std::printf("%8zu %14.0f %9.2f %14.0f %9.2f\n", threads_counts[t], rate,
+                rate / serial_rate, ordered_rate,
+                ordered_rate / serial_ordered_rate);
+  }
+
+  return emitted_words.load() > 0 ? 0 : 1;
+}
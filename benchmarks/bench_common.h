@@ -0,0 +1,105 @@
+/*
+  MIT License
+
+  Copyright (c) 2017 Alberto Taiuti
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef BENCH_COMMON_H_K3XQ9WZT
+#define BENCH_COMMON_H_K3XQ9WZT
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define STR_EXPAND(str) #str
+#define STR(str) STR_EXPAND(str)
+
+namespace bench {
+
+static const size_t kSpvIndexInstruction = 5;
+
+// Read a spv binary module from a file
+inline std::vector<uint32_t> LoadModule(const std::string &path) {
+  std::ifstream spv_file(path,
+                         std::ios::binary | std::ios::ate | std::ios::in);
+  if (!spv_file.is_open()) {
+    throw std::runtime_error("Could not open " + path);
+  }
+
+  std::streampos size = spv_file.tellg();
+  std::vector<uint32_t> words(static_cast<size_t>(size) / 4);
+
+  spv_file.seekg(0, std::ios::beg);
+  spv_file.read(reinterpret_cast<char *>(words.data()), words.size() * 4);
+
+  return words;
+}
+
+// Load the sample module which ships with the unit tests
+inline std::vector<uint32_t> LoadSampleModule() {
+  return LoadModule(STR(SPV_ASSETS_FOLDER) "/test.frag.spv");
+}
+
+// Build a structurally valid module of roughly words_count words by repeating
+// the instructions of base after its header
+//
+// The result is not a semantically valid module, but it has the same
+// instruction size distribution as the base one, which is what the parsing
+// and emission benchmarks care about
+inline std::vector<uint32_t> MakeLargeModule(const std::vector<uint32_t> &base,
+                                             size_t words_count) {
+  std::vector<uint32_t> module(base.begin(),
+                               base.begin() + kSpvIndexInstruction);
+  module.reserve(words_count + base.size());
+
+  while (module.size() < words_count) {
+    module.insert(module.end(), base.begin() + kSpvIndexInstruction,
+                  base.end());
+  }
+
+  return module;
+}
+
+// Run a function a number of times and return the best time in seconds
+template <typename Function>
+double MeasureBest(size_t repetitions, Function function) {
+  double best = 0.0;
+  for (size_t r = 0; r < repetitions; ++r) {
+    std::chrono::high_resolution_clock::time_point start =
+        std::chrono::high_resolution_clock::now();
+    function();
+    std::chrono::duration<double> elapsed =
+        std::chrono::high_resolution_clock::now() - start;
+
+    if ((r == 0) || (elapsed.count() < best)) {
+      best = elapsed.count();
+    }
+  }
+
+  return best;
+}
+
+}  // namespace bench
+
+#endif
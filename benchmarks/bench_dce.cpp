@@ -0,0 +1,119 @@
+/*
+  MIT License
+
+  Copyright (c) 2017 Alberto Taiuti
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <spv_utils.h>
+#include <bench_common.h>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace {
+
+// Append the words of the instructions of a section of a stream
+void AppendSection(const sut::OpcodeStream &stream,
+                   sut::ModuleSection section, std::vector<uint32_t> &words) {
+  for (const sut::OpcodeIterator &i : stream.Section(section)) {
+    words.insert(words.end(), i.data(), i.data() + i.GetWordCount());
+  }
+}
+
+// Build a module made of base followed by copies_count copies of its types
+// and functions under new ids, which nothing uses, like the declarations a
+// shader pulls in from shared headers
+std::vector<uint32_t> MakeDeadCodeModule(const std::vector<uint32_t> &base,
+                                         size_t copies_count) {
+  const sut::OpcodeStream base_stream(base);
+  const spv::Id bound = base_stream.GetIdBound();
+
+  std::vector<sut::OpcodeStream> copies;
+  for (size_t c = 1; c <= copies_count; ++c) {
+    std::vector<spv::Id> id_map(bound, 0);
+    for (spv::Id id = 1; id < bound; ++id) {
+      id_map[id] = id + static_cast<spv::Id>(c) * bound;
+    }
+
+    copies.emplace_back(base);
+    copies.back().RemapIds(id_map);
+  }
+
+  std::vector<uint32_t> module(base.begin(),
+                               base.begin() + bench::kSpvIndexInstruction);
+  module[3] = bound * static_cast<spv::Id>(copies_count + 1);
+  for (size_t s = 0; s < static_cast<size_t>(sut::ModuleSection::kTypes);
+       ++s) {
+    AppendSection(base_stream, static_cast<sut::ModuleSection>(s), module);
+  }
+  for (sut::ModuleSection section :
+       {sut::ModuleSection::kTypes, sut::ModuleSection::kFunctions}) {
+    AppendSection(base_stream, section, module);
+    for (const sut::OpcodeStream &copy : copies) {
+      AppendSection(copy, section, module);
+    }
+  }
+
+  return module;
+}
+
+}  // namespace
+
+int main() {
+  const std::vector<uint32_t> base = bench::LoadSampleModule();
+  const size_t repetitions = 20;
+
+  std::printf("%8s %10s %10s %8s %12s %12s %12s\n", "copies", "words",
+              "pruned", "saved", "dce us", "parse us", "pruned us");
+
+  for (size_t copies_count : {0, 4, 16, 64, 256}) {
+    const std::vector<uint32_t> module =
+        MakeDeadCodeModule(base, copies_count);
+    const sut::OpcodeStream stream(module);
+
+    size_t pruned_count = 0;
+    const double dce_time = bench::MeasureBest(repetitions, [&]() {
+      pruned_count = stream.EliminateDeadCode().words_count();
+    });
+    const std::vector<uint32_t> pruned =
+        stream.EliminateDeadCode().GetWordsStream();
+
+    // What a consumer of the module pays to parse it, before and after
+    size_t parsed_count = 0;
+    const double parse_time = bench::MeasureBest(repetitions, [&]() {
+      parsed_count += sut::OpcodeStream(module).size();
+    });
+    const double pruned_parse_time = bench::MeasureBest(repetitions, [&]() {
+      parsed_count += sut::OpcodeStream(pruned).size();
+    });
+
+    std::printf("%8zu %10zu %10zu %7.1f%% %12.1f %12.1f %12.1f\n",
+                copies_count, module.size(), pruned_count,
+                100.0 * (module.size() - pruned_count) / module.size(),
+                dce_time * 1e6, parse_time * 1e6, pruned_parse_time * 1e6);
+
+    if (parsed_count == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
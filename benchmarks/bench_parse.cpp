@@ -0,0 +1,139 @@
+/*
+  MIT License
+
+  Copyright (c) 2017 Alberto Taiuti
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <spv_utils.h>
+#include <bench_common.h>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Mirror of the per-instruction entry which OpcodeStream used to store before
+// the offsets table became a plain array of offsets; kept here so that the
+// benchmark can report the figures of the old layout side by side
+struct LegacyOpcodeEntry final {
+  LegacyOpcodeEntry(size_t offset, std::vector<uint32_t> &words)
+      : offset_(offset),
+        insert_before_offset_(0),
+        insert_before_count_(0),
+        insert_after_offset_(0),
+        insert_after_count_(0),
+        replace_offset_(0),
+        replace_count_(0),
+        remove_(false),
+        words_(words) {}
+
+  size_t offset_;
+  size_t insert_before_offset_;
+  size_t insert_before_count_;
+  size_t insert_after_offset_;
+  size_t insert_after_count_;
+  size_t replace_offset_;
+  size_t replace_count_;
+  bool remove_;
+  std::vector<uint32_t> &words_;
+};  // struct LegacyOpcodeEntry
+
+// Parse the module the way the old layout did: copy the module and reserve
+// one entry per word up front
+static size_t LegacyParse(const std::vector<uint32_t> &module,
+                          size_t *table_bytes) {
+  std::vector<uint32_t> words(module);
+  std::vector<LegacyOpcodeEntry> table;
+  table.reserve(words.size() + 1);
+
+  for (size_t i = 0; i < bench::kSpvIndexInstruction; ++i) {
+    table.push_back(LegacyOpcodeEntry(i, words));
+  }
+
+  size_t word_index = bench::kSpvIndexInstruction;
+  while (word_index < words.size()) {
+    table.push_back(LegacyOpcodeEntry(word_index, words));
+    word_index += sut::SplitSpvOpCode(words[word_index]).words_count;
+  }
+  table.push_back(LegacyOpcodeEntry(words.size(), words));
+  words.push_back(0U);
+
+  *table_bytes = table.capacity() * sizeof(LegacyOpcodeEntry);
+
+  return table.size();
+}
+
+int main() {
+  const std::vector<uint32_t> base = bench::LoadSampleModule();
+  const size_t sizes[] = {1U << 16U, 1U << 20U, 1U << 24U};
+  const size_t repetitions = 5;
+
+  std::printf("%12s %14s %12s %14s %12s\n", "words", "legacy B/inst",
+              "legacy ms", "current B/inst", "current ms");
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    const std::vector<uint32_t> module = bench::MakeLargeModule(base, sizes[s]);
+
+    size_t legacy_instructions = 0;
+    size_t legacy_table_bytes = 0;
+    double legacy_time = bench::MeasureBest(repetitions, [&]() {
+      legacy_instructions = LegacyParse(module, &legacy_table_bytes);
+    });
+
+    size_t current_instructions = 0;
+    double current_time = bench::MeasureBest(repetitions, [&]() {
+      sut::OpcodeStream stream(module);
+      current_instructions = stream.size();
+    });
+    // Bookkeeping is one 32 bits offset per instruction; pending edits are
+    // only allocated for the instructions which get operated on
+    size_t current_table_bytes = current_instructions * sizeof(uint32_t);
+
+    std::printf("%12zu %14.1f %12.3f %14.1f %12.3f\n", module.size(),
+                static_cast<double>(legacy_table_bytes) / legacy_instructions,
+                legacy_time * 1000.0,
+                static_cast<double>(current_table_bytes) /
+                    current_instructions,
+                current_time * 1000.0);
+  }
+
+  // Modules of the opposite endianness are swapped before being parsed; the
+  // swap should be a small fraction of the parse
+  std::printf("\n%12s %12s %12s\n", "words", "native ms", "swapped ms");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    const std::vector<uint32_t> module = bench::MakeLargeModule(base, sizes[s]);
+    std::vector<uint32_t> swapped(module);
+    for (uint32_t &word : swapped) {
+      word = ((word & 0x000000FFU) << 24U) | ((word & 0x0000FF00U) << 8U) |
+             ((word & 0x00FF0000U) >> 8U) | ((word & 0xFF000000U) >> 24U);
+    }
+
+    double native_time = bench::MeasureBest(repetitions, [&]() {
+      sut::OpcodeStream stream(module);
+    });
+    double swapped_time = bench::MeasureBest(repetitions, [&]() {
+      sut::OpcodeStream stream(swapped);
+    });
+
+    std::printf("%12zu %12.3f %12.3f\n", module.size(), native_time * 1000.0,
+                swapped_time * 1000.0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,140 @@
+/*
+  MIT License
+
+  Copyright (c) 2017 Alberto Taiuti
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef SPV_BATCH_H_R8WZ2M4C
+#define SPV_BATCH_H_R8WZ2M4C
+
+#include <spv_utils.h>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace sut {
+
+// Module to process in a batch, either read from a file or copied from words
+// owned by the caller, which must outlive the batch
+struct BatchInput final {
+  static BatchInput File(const std::string &path);
+  static BatchInput Words(const uint32_t *words, size_t words_count);
+
+  std::string path;
+  const uint32_t *words;
+  size_t words_count;
+};  // struct BatchInput
+
+// Outcome of processing one input of a batch
+struct BatchResult final {
+  // Index of the input in the batch
+  size_t index;
+
+  // Words emitted after the transform; they belong to the processor and are
+  // only valid during the call to the sink
+  const uint32_t *words;
+  size_t words_count;
+
+  // Exception thrown while loading or transforming the input, if any; the
+  // words are empty in that case
+  std::exception_ptr error;
+};  // struct BatchResult
+
+// Process many modules on a pool of threads
+//
+// Each worker owns an OpcodeStream and an output buffer which are reused from
+// one module to the next, so that once they have grown to the size of the
+// largest module no allocations happen per module, other than the ones made
+// by the transform itself
+class BatchProcessor final {
+ public:
+  // Apply the operations to a loaded module; the processor emits the words
+  // afterwards
+  typedef std::function<void(size_t index, OpcodeStream &stream)> Transform;
+  // Receive the outcome of an input
+  typedef std::function<void(const BatchResult &result)> Sink;
+
+  // Start threads_count threads, or one per hardware thread if zero
+  explicit BatchProcessor(size_t threads_count = 0);
+  ~BatchProcessor();
+
+  BatchProcessor(const BatchProcessor &) = delete;
+  BatchProcessor &operator=(const BatchProcessor &) = delete;
+
+  size_t threads_count() const { return threads_.size(); }
+
+  // Process all the inputs and return once all of them have been delivered
+  //
+  // Each worker starts with a contiguous share of the inputs and steals half
+  // of what is left of another share when it runs out; results are delivered
+  // as soon as they are ready, with the sink being called concurrently from
+  // the workers
+  //
+  // If the sink throws, no more inputs are started and the first exception is
+  // rethrown once the workers are idle
+  void Run(const std::vector<BatchInput> &inputs, const Transform &transform,
+           const Sink &sink);
+
+  // Same as Run(), but the sink is called by one thread at a time and in the
+  // order of the inputs; workers run at most a few modules ahead of the
+  // oldest undelivered one
+  void RunOrdered(const std::vector<BatchInput> &inputs,
+                  const Transform &transform, const Sink &sink);
+
+ private:
+  struct Worker;
+  typedef std::function<void(Worker &worker)> Job;
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+
+  // Job currently run by the workers; a new generation starts a new job
+  std::mutex mutex_;
+  std::condition_variable start_condition_;
+  std::condition_variable done_condition_;
+  const Job *job_;
+  uint64_t generation_;
+  size_t busy_workers_;
+  bool running_;
+  bool stopping_;
+
+  void WorkerLoop(Worker &worker);
+
+  // Run a job on every worker and wait for all of them to finish it; the
+  // workers are given their shares of the inputs after checking that no
+  // other job is running, and throws InvalidOperation otherwise
+  void Dispatch(const Job &job, size_t inputs_count);
+
+  // Load and transform an input with the stream and buffer of a worker
+  void Process(Worker &worker, const BatchInput &input, size_t index,
+               const Transform &transform, BatchResult &result);
+};  // class BatchProcessor
+
+}  // namespace sut
+
+#endif
@@ -0,0 +1,140 @@
+/*
+  MIT License
+
+  Copyright (c) 2017 Alberto Taiuti
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef SPV_CODEC_H_T4NQ7K2V
+#define SPV_CODEC_H_T4NQ7K2V
+
+#include <spv_utils.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sut {
+
+// Compact encoding of modules for storage, in the spirit of SMOL-V
+//
+// Instructions are walked with ForEachInstruction() and each word is stored
+// as a varint according to what the grammar says it holds: result ids as the
+// delta from the previous result, other ids as the distance back to the
+// previous result, and literal strings as raw words. Decoding gives back the
+// exact words which have been encoded, header and endianness included
+
+// Encode a module, replacing the content of encoded; throws like
+// ForEachInstruction() if its instructions don't exactly cover its words
+void EncodeModule(const uint32_t *words, size_t words_count,
+                  std::vector<uint8_t> &encoded);
+
+// Decoder of an encoded module, one instruction at a time
+//
+// The decoder keeps a buffer for the instruction it hands out, which is at
+// most as large as the longest instruction; decoding a whole module writes
+// the words straight to their destination instead
+class ModuleDecoder final {
+ public:
+  // Read the header of an encoded module, which must outlive the decoder;
+  // throws InvalidStream if the bytes don't start with one
+  ModuleDecoder(const void *encoded, size_t bytes_count);
+
+  // Number of words of the decoded module, header included
+  size_t words_count() const { return words_count_; }
+  const uint32_t *header() const { return header_.data(); }
+
+  // Decode the next instruction and return its words, valid until the next
+  // call, or nullptr once all of them have been decoded; the instructions of
+  // modules of the opposite endianness are returned as native words
+  //
+  // Throws InvalidStream if the encoded module is truncated, has trailing
+  // bytes, or holds an instruction running past the end of the module
+  const uint32_t *NextInstruction(size_t *words_count);
+
+  // Decode the whole module, header included, into dst, which must have
+  // room for words_count() words; these are the exact words encoded
+  void DecodeInto(uint32_t *dst);
+
+  // Load the decoded module into a stream, handing it the words along with
+  // the offsets of the instructions recorded as they are decoded, so that
+  // they aren't parsed again
+  //
+  // Both overloads throw InvalidOperation once an instruction has been
+  // decoded with NextInstruction()
+  void DecodeInto(OpcodeStream &stream);
+
+ private:
+  // Read a varint, or a word stored as it is
+  uint32_t ReadVarint();
+  uint32_t ReadRawWord();
+
+  // Decode the first word of the next instruction, checking that the
+  // instruction fits in what is left of the module
+  uint32_t DecodeFirstWord();
+
+  // Decode the words following the first word of an instruction
+  void DecodeOperands(uint32_t *words);
+
+  // Throw if some instructions have already been decoded
+  void CheckNotStarted() const;
+
+  // Throw if bytes are left once all the words have been decoded
+  void CheckEnd() const;
+
+  const uint8_t *cursor_;
+  const uint8_t *end_;
+
+  std::array<uint32_t, kSpvHeaderWordsCount> header_;
+  size_t words_count_;
+  // Number of words decoded so far, header included
+  size_t decoded_count_;
+  // Whether the module is of the opposite endianness
+  bool swapped_;
+
+  uint32_t last_result_;
+  std::vector<uint32_t> instruction_;
+
+};  // class ModuleDecoder
+
+// Decode a module into a new stream
+OpcodeStream DecodeModule(const void *encoded, size_t bytes_count);
+
+// Call visitor(opcode, words_count, operands) for each instruction of an
+// encoded module as it is decoded, like ForEachInstruction() does
+template <typename Visitor>
+bool ForEachEncodedInstruction(const void *encoded, size_t bytes_count,
+                               Visitor &&visitor) {
+  ModuleDecoder decoder(encoded, bytes_count);
+
+  size_t words_count = 0;
+  while (const uint32_t *words = decoder.NextInstruction(&words_count)) {
+    if (!visitor(static_cast<spv::Op>(words[0] & 0x0000FFFF), words_count,
+                 words + 1)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+}  // namespace sut
+
+#endif
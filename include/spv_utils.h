@@ -25,14 +25,32 @@
 #ifndef SPV_UTILS_H_DSEVTT7Q
 #define SPV_UTILS_H_DSEVTT7Q
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <functional>
+#include <iterator>
 #include <memory>
 #include <spirv/1.1/spirv.hpp11>
+#include <sstream>
 #include <stdexcept>
+#include <string>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
+// Mark a declaration as deprecated where the compiler supports it
+#if defined(_MSC_VER)
+#define SPV_UTILS_DEPRECATED(message) __declspec(deprecated(message))
+#elif defined(__GNUC__) || defined(__clang__)
+#define SPV_UTILS_DEPRECATED(message) __attribute__((deprecated(message)))
+#else
+#define SPV_UTILS_DEPRECATED(message)
+#endif
+
 namespace sut {
 
 struct OpcodeHeader final {
@@ -62,11 +80,313 @@ class InvalidOperation final : public std::logic_error {
   explicit InvalidOperation(const std::string &what_arg);
 };  // class InvalidOperation
 
+class FileError final : public std::runtime_error {
+ public:
+  explicit FileError(const std::string &what_arg);
+};  // class FileError
+
+// Number of words of the header of a module
+const size_t kSpvHeaderWordsCount = 5;
+
+// Throw an InvalidStream for the instruction starting at word_index, whose
+// word count is zero or makes it run past the end of the module
+[[noreturn]] void ThrowInvalidWordCount(size_t word_index, size_t words_count);
+
+// Call visitor(opcode, words_count, operands) for each instruction of a
+// module, in order, walking the words in place; words_count includes the
+// first word of the instruction and operands points to the word after it
+//
+// Nothing is allocated and no state is kept per instruction. The visitor
+// returns false to stop the walk early, in which case false is returned.
+// Throws InvalidStream if an instruction has a word count of zero or runs
+// past the end of the module
+template <typename Visitor>
+bool ForEachInstruction(const uint32_t *words, size_t words_count,
+                        Visitor &&visitor) {
+  if (!words || (words_count < kSpvHeaderWordsCount)) {
+    throw InvalidParameter("Invalid parameter in ForEachInstruction()!");
+  }
+
+  size_t word_index = kSpvHeaderWordsCount;
+  while (word_index < words_count) {
+    const uint32_t first_word = words[word_index];
+    const size_t inst_word_count = static_cast<size_t>(first_word >> 16U);
+
+    if ((inst_word_count == 0) ||
+        (inst_word_count > (words_count - word_index))) {
+      ThrowInvalidWordCount(word_index, inst_word_count);
+    }
+
+    if (!visitor(static_cast<spv::Op>(first_word & 0x0000FFFF),
+                 inst_word_count, words + word_index + 1)) {
+      return false;
+    }
+
+    word_index += inst_word_count;
+  }
+
+  return true;
+}
+
+// Parser which is fed a module in chunks of bytes, for example while it is
+// being read from a pipe or decompressed, and calls
+// visitor(opcode, words_count, operands) for each instruction as soon as it
+// is complete, like ForEachInstruction() does
+//
+// Instructions which are whole within a word-aligned chunk are visited in
+// place; only an instruction split across chunks is gathered in a buffer,
+// which is at most as large as the longest instruction
+template <typename Visitor>
+class ChunkedInstructionParser final {
+ public:
+  explicit ChunkedInstructionParser(Visitor visitor)
+      : visitor_(std::move(visitor)),
+        header_(),
+        header_count_(0),
+        pending_(),
+        partial_word_(0),
+        partial_bytes_count_(0),
+        words_offset_(0),
+        stopped_(false) {}
+
+  // Parse the next chunk of the module; return false once the visitor has
+  // stopped the walk, after which further chunks are ignored
+  bool Feed(const void *chunk, size_t bytes_count);
+
+  // Check that the module ended on an instruction boundary; throws
+  // InvalidStream otherwise
+  void Finish() const;
+
+  // Header of the module, available once its words have been fed
+  bool HasHeader() const { return header_count_ == kSpvHeaderWordsCount; }
+  const uint32_t *header() const { return header_.data(); }
+
+ private:
+  // Consume a word which is part of the header or of an instruction split
+  // across chunks
+  void PushWord(uint32_t word);
+
+  Visitor visitor_;
+
+  std::array<uint32_t, kSpvHeaderWordsCount> header_;
+  size_t header_count_;
+
+  // Words of an instruction split across chunks
+  std::vector<uint32_t> pending_;
+
+  // Bytes of a word split across chunks
+  uint32_t partial_word_;
+  size_t partial_bytes_count_;
+
+  // Number of words consumed so far
+  size_t words_offset_;
+  bool stopped_;
+
+};  // class ChunkedInstructionParser
+
+// Create a ChunkedInstructionParser deducing the type of the visitor
+template <typename Visitor>
+ChunkedInstructionParser<Visitor> MakeChunkedInstructionParser(
+    Visitor visitor) {
+  return ChunkedInstructionParser<Visitor>(std::move(visitor));
+}
+
+template <typename Visitor>
+bool ChunkedInstructionParser<Visitor>::Feed(const void *chunk,
+                                             size_t bytes_count) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(chunk);
+
+  while ((bytes_count > 0) && !stopped_) {
+    // Go word by word while completing a word, the header or an instruction
+    // split across chunks, or when the chunk isn't word-aligned
+    if ((partial_bytes_count_ > 0) || !pending_.empty() || !HasHeader() ||
+        ((reinterpret_cast<uintptr_t>(bytes) % alignof(uint32_t)) != 0) ||
+        (bytes_count < sizeof(uint32_t))) {
+      size_t taken_count =
+          std::min(sizeof(uint32_t) - partial_bytes_count_, bytes_count);
+      std::memcpy(reinterpret_cast<unsigned char *>(&partial_word_) +
+                      partial_bytes_count_,
+                  bytes, taken_count);
+      partial_bytes_count_ += taken_count;
+      bytes += taken_count;
+      bytes_count -= taken_count;
+
+      if (partial_bytes_count_ == sizeof(uint32_t)) {
+        partial_bytes_count_ = 0;
+        PushWord(partial_word_);
+      }
+      continue;
+    }
+
+    // Visit the instructions which are whole within the chunk in place
+    const uint32_t *words = reinterpret_cast<const uint32_t *>(bytes);
+    const size_t words_count = bytes_count / sizeof(uint32_t);
+    size_t word_index = 0;
+    while (word_index < words_count) {
+      const uint32_t first_word = words[word_index];
+      const size_t inst_word_count = static_cast<size_t>(first_word >> 16U);
+
+      if (inst_word_count == 0) {
+        ThrowInvalidWordCount(words_offset_ + word_index, inst_word_count);
+      }
+      if (inst_word_count > (words_count - word_index)) {
+        break;
+      }
+
+      const uint32_t *operands = words + word_index + 1;
+      word_index += inst_word_count;
+      if (!visitor_(static_cast<spv::Op>(first_word & 0x0000FFFF),
+                    inst_word_count, operands)) {
+        stopped_ = true;
+        break;
+      }
+    }
+
+    words_offset_ += word_index;
+    bytes += word_index * sizeof(uint32_t);
+    bytes_count -= word_index * sizeof(uint32_t);
+
+    // What is left of the whole words is the start of an instruction split
+    // across chunks
+    if (!stopped_) {
+      for (; word_index < words_count; ++word_index) {
+        PushWord(words[word_index]);
+      }
+      bytes = reinterpret_cast<const unsigned char *>(words + words_count);
+      bytes_count %= sizeof(uint32_t);
+    }
+  }
+
+  return !stopped_;
+}
+
+template <typename Visitor>
+void ChunkedInstructionParser<Visitor>::PushWord(uint32_t word) {
+  if (!HasHeader()) {
+    header_[header_count_++] = word;
+    ++words_offset_;
+    return;
+  }
+
+  if (pending_.empty() && ((word >> 16U) == 0)) {
+    ThrowInvalidWordCount(words_offset_, 0);
+  }
+
+  pending_.push_back(word);
+  ++words_offset_;
+
+  const size_t inst_word_count = static_cast<size_t>(pending_[0] >> 16U);
+  if (pending_.size() == inst_word_count) {
+    bool keep_going =
+        visitor_(static_cast<spv::Op>(pending_[0] & 0x0000FFFF),
+                 inst_word_count, pending_.data() + 1);
+    pending_.clear();
+    stopped_ = !keep_going;
+  }
+}
+
+template <typename Visitor>
+void ChunkedInstructionParser<Visitor>::Finish() const {
+  if (stopped_) {
+    return;
+  }
+
+  if (!HasHeader() || !pending_.empty() || (partial_bytes_count_ > 0)) {
+    std::stringstream msg_stream;
+    msg_stream << "Module ended in the middle of the word with index "
+               << words_offset_;
+    throw InvalidStream(msg_stream.str());
+  }
+}
+
+// Builds one instruction word by word, computing its header as it grows
+//
+// The words are kept in inline storage, so that building instructions doesn't
+// allocate; only instructions longer than kInlineWordsCount words, such as
+// long OpString or OpEntryPoint, spill to the heap. Builders can be reused
+// through Reset() to keep their spilled storage around
+class InstructionBuilder final {
+ public:
+  static const size_t kInlineWordsCount = 16;
+
+  explicit InstructionBuilder(spv::Op opcode)
+      : opcode_(static_cast<uint16_t>(opcode)), words_count_(0) {
+    PushWord(0);
+  }
+
+  // Start a new instruction, dropping the words of the current one
+  void Reset(spv::Op opcode) {
+    opcode_ = static_cast<uint16_t>(opcode);
+    words_count_ = 0;
+    spilled_words_.clear();
+    PushWord(0);
+  }
+
+  // Append an id, such as a result type, a result or an operand
+  InstructionBuilder &AddId(spv::Id id) {
+    PushWord(id);
+    return *this;
+  }
+
+  // Append a literal word, such as a literal number, an enumerant or a mask
+  InstructionBuilder &AddLiteral(uint32_t literal) {
+    PushWord(literal);
+    return *this;
+  }
+
+  // Append a nul terminated literal string, padded to a whole word
+  InstructionBuilder &AddString(const char *str);
+  InstructionBuilder &AddString(const std::string &str) {
+    return AddString(str.c_str());
+  }
+
+  // Words of the instruction, header included; valid until the builder is
+  // modified
+  const uint32_t *data() const {
+    return spilled_words_.empty() ? inline_words_.data()
+                                  : spilled_words_.data();
+  }
+  size_t size() const { return words_count_; }
+
+ private:
+  void PushWord(uint32_t word) {
+    if ((words_count_ < kInlineWordsCount) && spilled_words_.empty()) {
+      inline_words_[words_count_] = word;
+    } else {
+      Spill(word);
+    }
+    ++words_count_;
+
+    uint32_t *words =
+        spilled_words_.empty() ? inline_words_.data() : spilled_words_.data();
+    words[0] = MergeSpvOpCode({static_cast<uint16_t>(words_count_), opcode_});
+  }
+
+  // Move the words to the heap and append a word to them; throws if the
+  // instruction gets too long for its header
+  void Spill(uint32_t word);
+
+  std::array<uint32_t, kInlineWordsCount> inline_words_;
+  std::vector<uint32_t> spilled_words_;
+  uint16_t opcode_;
+  size_t words_count_;
+
+};  // class InstructionBuilder
+
+class OpcodeStream;
+
+// Lightweight handle to one instruction of an OpcodeStream
+//
+// Handles are created on the fly by the stream iterators and only hold the
+// index of the instruction and a pointer back to the stream; the stream itself
+// keeps no per-instruction objects around
 class OpcodeIterator final {
  public:
   // Ctor
-  // Construct an iterator given the offset of the instruction which this
-  // iterator refers to and the stream of words this instruction is contained in
+  // Handles used to be built over the words of a stream, which they no longer
+  // refer to; throws InvalidOperation, handles are obtained from the stream
+  // or its iterators instead
+  SPV_UTILS_DEPRECATED("Get handles from OpcodeStream or its iterators")
   explicit OpcodeIterator(size_t offset, std::vector<uint32_t> &words);
 
   // Get the opcode from the first word of the instruction
@@ -75,63 +395,445 @@ class OpcodeIterator final {
 
   // Get the offset in words for this instruction from the beginning of the
   // stream
-  size_t offset() const { return offset_; }
+  size_t offset() const;
+
+  // Get the index of this instruction in the stream
+  size_t index() const { return index_; }
 
   // Get the first word of this instruction
   uint32_t GetFirstWord() const;
 
-  // Get a reference to the words to the entire stream
-  std::vector<uint32_t>& GetWords() { return words_; }
+  // Get a word of this instruction, where index 0 is the first word
+  uint32_t GetWord(size_t word_index) const;
+
+  // Get a pointer to the words of this instruction
+  const uint32_t *data() const;
+
+  // Get a reference to the words to the entire stream; throws if the stream
+  // is a view
+  std::vector<uint32_t> &GetWords();
+
+  // Overwrite a word of this instruction in place, the definitions being kept
+  // up to date; the first word, with the opcode and the word count, can't be
+  // changed this way
+  //
+  // Throws if the stream is a view, within a function pass, or if the word
+  // isn't an operand of the instruction; mapped files get promoted first
+  void SetWord(size_t word_index, uint32_t word);
 
   // Insert instructions stream in LIFO order
   void InsertBefore(const uint32_t *instructions, size_t words_count);
+  void InsertBefore(const InstructionBuilder &instruction);
   // Insert instructions stream in LIFO order
   void InsertAfter(const uint32_t *instructions, size_t words_count);
+  void InsertAfter(const InstructionBuilder &instruction);
   void Remove();
+  // Replace the instruction; with in-place edits enabled on the stream, a
+  // single instruction with the same opcode and word count overwrites the
+  // words of this one, and can be replaced again
   void Replace(const uint32_t *instructions, size_t words_count);
+  void Replace(const InstructionBuilder &instruction);
 
  private:
-  bool is_removed() const { return remove_; }
-  size_t insert_before_offset() const { return insert_before_offset_; }
-  size_t insert_before_count() const { return insert_before_count_; }
-  size_t insert_after_offset() const { return insert_after_offset_; }
-  size_t insert_after_count() const { return insert_after_count_; }
-  size_t replace_offset() const { return replace_offset_; }
-  size_t replace_count() const { return replace_count_; }
-
-  // Make the class a friend so that it can access the accessor methods
+  // Make the classes friends so that they can create handles
   friend class OpcodeStream;
+  template <typename Value, bool kReverse>
+  friend class StreamIterator;
+
+  OpcodeIterator(OpcodeStream *stream, size_t index)
+      : stream_(stream), index_(index) {}
 
-  // Data relative to this instruction
-  size_t offset_;
+  OpcodeStream *stream_;
+  size_t index_;
 
-  // List of words to be used to otput the filtered stream
-  size_t insert_before_offset_;
-  size_t insert_before_count_;
-  size_t insert_after_offset_;
-  size_t insert_after_count_;
-  size_t replace_offset_;
-  size_t replace_count_;
-  bool remove_;
+};  // class OpcodeIterator
+
+// Iterator over the instructions of an OpcodeStream, either all of them in
+// order or the ones listed in an array of instruction indices
+//
+// Dereferencing yields an OpcodeIterator handle which is stored inside the
+// iterator itself, so references obtained from it are valid until the
+// iterator is moved or destroyed; subscripting returns a copy of the handle
+// instead. Positions index the offsets table, or the array of indices, so
+// iterators are random access
+template <typename Value, bool kReverse>
+class StreamIterator final {
+ public:
+  typedef std::random_access_iterator_tag iterator_category;
+  typedef OpcodeIterator value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef Value *pointer;
+  typedef Value &reference;
 
-  uint32_t *GetLatestMaker(size_t initial_offset, size_t initial_count) const;
+  StreamIterator() : current_(nullptr, 0), indices_(nullptr), position_(0) {}
+  StreamIterator(OpcodeStream *stream, size_t position,
+                 const uint32_t *indices = nullptr)
+      : current_(stream, position), indices_(indices), position_(position) {}
 
-  std::vector<uint32_t> &words_;
+  // Allow conversion from mutable to const iterators
+  template <typename Other>
+  StreamIterator(const StreamIterator<Other, kReverse> &other)
+      : current_(other.current_),
+        indices_(other.indices_),
+        position_(other.position_) {}
 
-};  // class Opcode
+  reference operator*() const {
+    current_.index_ = indices_ ? indices_[position_] : position_;
+    return current_;
+  }
+  pointer operator->() const { return &(**this); }
+
+  StreamIterator &operator++() {
+    Advance(kReverse ? -1 : 1);
+    return *this;
+  }
+  StreamIterator operator++(int) {
+    StreamIterator previous(*this);
+    ++(*this);
+    return previous;
+  }
+  StreamIterator &operator--() {
+    Advance(kReverse ? 1 : -1);
+    return *this;
+  }
+  StreamIterator operator--(int) {
+    StreamIterator previous(*this);
+    --(*this);
+    return previous;
+  }
+
+  Value operator[](difference_type offset) const { return *(*this + offset); }
+
+  StreamIterator &operator+=(difference_type offset) {
+    Advance(kReverse ? -offset : offset);
+    return *this;
+  }
+  StreamIterator &operator-=(difference_type offset) {
+    Advance(kReverse ? offset : -offset);
+    return *this;
+  }
+  StreamIterator operator+(difference_type offset) const {
+    StreamIterator moved(*this);
+    return moved += offset;
+  }
+  friend StreamIterator operator+(difference_type offset,
+                                  const StreamIterator &iterator) {
+    return iterator + offset;
+  }
+  StreamIterator operator-(difference_type offset) const {
+    StreamIterator moved(*this);
+    return moved -= offset;
+  }
+
+  // The positions are subtracted as unsigned values first, so that the
+  // reverse end gives the right distance too
+  template <typename Other>
+  difference_type operator-(const StreamIterator<Other, kReverse> &other)
+      const {
+    const difference_type distance =
+        static_cast<difference_type>(position_ - other.position_);
+    return kReverse ? -distance : distance;
+  }
+
+  template <typename Other>
+  bool operator==(const StreamIterator<Other, kReverse> &other) const {
+    return position_ == other.position_;
+  }
+  template <typename Other>
+  bool operator!=(const StreamIterator<Other, kReverse> &other) const {
+    return position_ != other.position_;
+  }
+  template <typename Other>
+  bool operator<(const StreamIterator<Other, kReverse> &other) const {
+    return (*this - other) < 0;
+  }
+  template <typename Other>
+  bool operator>(const StreamIterator<Other, kReverse> &other) const {
+    return (*this - other) > 0;
+  }
+  template <typename Other>
+  bool operator<=(const StreamIterator<Other, kReverse> &other) const {
+    return (*this - other) <= 0;
+  }
+  template <typename Other>
+  bool operator>=(const StreamIterator<Other, kReverse> &other) const {
+    return (*this - other) >= 0;
+  }
+
+ private:
+  template <typename OtherValue, bool kOtherReverse>
+  friend class StreamIterator;
+
+  // Unsigned arithmetic is used on purpose so that the reverse end, which
+  // sits one before the first instruction, wraps around consistently
+  void Advance(ptrdiff_t step) { position_ += static_cast<size_t>(step); }
+
+  mutable OpcodeIterator current_;
+
+  // Indices of the instructions to visit, or nullptr to visit all of them
+  const uint32_t *indices_;
+  size_t position_;
+
+};  // class StreamIterator
+
+// Sub-range of the instructions of an OpcodeStream, either contiguous or
+// listed in an array of instruction indices; valid as long as the stream is
+template <typename Value>
+class InstructionRange final {
+ public:
+  typedef StreamIterator<Value, false> iterator;
+  typedef StreamIterator<Value, true> reverse_iterator;
+
+  InstructionRange()
+      : stream_(nullptr), indices_(nullptr), first_(0), end_(0) {}
+  InstructionRange(OpcodeStream *stream, size_t first, size_t end,
+                   const uint32_t *indices = nullptr)
+      : stream_(stream), indices_(indices), first_(first), end_(end) {}
+
+  iterator begin() const { return iterator(stream_, first_, indices_); }
+  iterator end() const { return iterator(stream_, end_, indices_); }
+  reverse_iterator rbegin() const {
+    return reverse_iterator(stream_, end_ - 1, indices_);
+  }
+  reverse_iterator rend() const {
+    return reverse_iterator(stream_, first_ - 1, indices_);
+  }
+
+  // Number of instructions in the range
+  size_t size() const { return end_ - first_; }
+  bool empty() const { return end_ == first_; }
+
+ private:
+  OpcodeStream *stream_;
+  const uint32_t *indices_;
+  size_t first_;
+  size_t end_;
+
+};  // class InstructionRange
+
+// Contiguous run of words of an emitted stream
+struct WordsSegment final {
+  const uint32_t *words;
+  size_t count;
+};  // struct WordsSegment
+
+// Filtered stream as a list of segments; words emitted in place of the ones
+// of the stream, such as a raised bound, are held by the list itself, so that
+// its segments stay valid when it is moved
+class SegmentList final {
+ public:
+  typedef std::vector<WordsSegment>::const_iterator const_iterator;
+
+  SegmentList() : segments_(), bound_(new uint32_t(0)) {}
+
+  const_iterator begin() const { return segments_.begin(); }
+  const_iterator end() const { return segments_.end(); }
+  const WordsSegment &operator[](size_t index) const {
+    return segments_[index];
+  }
+  size_t size() const { return segments_.size(); }
+  bool empty() const { return segments_.empty(); }
+
+ private:
+  friend class OpcodeStream;
+
+  std::vector<WordsSegment> segments_;
+  std::unique_ptr<uint32_t> bound_;
+
+};  // class SegmentList
+
+// Sections of the logical layout of a module, in the order they appear
+enum class ModuleSection {
+  kCapabilities,
+  kExtensions,
+  kExtInstImports,
+  kMemoryModel,
+  kEntryPoints,
+  kExecutionModes,
+  // Debug instructions: strings, sources, names and processes
+  kDebug,
+  kAnnotations,
+  // Types, constants and global variables
+  kTypes,
+  // Function declarations and definitions
+  kFunctions,
+  kCount
+};  // enum class ModuleSection
+
+// Operand word holding an id
+struct IdUse final {
+  // Index of the instruction using the id; uses by words inserted by an
+  // operation refer to the instruction the words have been inserted around
+  uint32_t instruction;
+  // Index of the operand word within the instruction using the id
+  uint32_t word_index;
+  // Offset of the operand word; offsets past the original module refer to
+  // the words inserted by the operations
+  uint64_t offset;
+};  // struct IdUse
+
+// Contiguous list of the uses of an id
+struct IdUseRange final {
+  const IdUse *first;
+  const IdUse *last;
+
+  const IdUse *begin() const { return first; }
+  const IdUse *end() const { return last; }
+  size_t size() const { return static_cast<size_t>(last - first); }
+  bool empty() const { return first == last; }
+};  // struct IdUseRange
+
+// Block of consecutive ids reserved from an OpcodeStream, which can be handed
+// out without going back to the stream
+class IdBlock final {
+ public:
+  IdBlock() : next_(0), end_(0) {}
+  IdBlock(spv::Id first, size_t count)
+      : next_(first), end_(first + static_cast<spv::Id>(count)) {}
+
+  // Return the next id of the block, or 0 once the block is used up
+  spv::Id Allocate() { return (next_ < end_) ? next_++ : 0; }
+
+  // Number of ids left in the block
+  size_t size() const { return end_ - next_; }
+  bool empty() const { return next_ == end_; }
+
+ private:
+  spv::Id next_;
+  spv::Id end_;
+};  // class IdBlock
+
+// Parts of a module left out of its fingerprint
+struct FingerprintOptions final {
+  FingerprintOptions()
+      : ignore_debug(false), ignore_generator(false), canonical_ids(false) {}
+
+  // Skip the debug instructions: strings, sources, names, processes and
+  // line information
+  bool ignore_debug;
+  // Skip the generator word of the header
+  bool ignore_generator;
+  // Renumber the ids in order of first appearance and skip the bound, so
+  // that modules differing only by their id numbering match; the operands
+  // of extended instructions of sets other than GLSL.std.450 and the
+  // non-semantic ones are hashed as they are
+  bool canonical_ids;
+};  // struct FingerprintOptions
+
+// 128 bits hash of a module
+struct ModuleFingerprint final {
+  uint64_t low;
+  uint64_t high;
+
+  bool operator==(const ModuleFingerprint &other) const {
+    return (low == other.low) && (high == other.high);
+  }
+  bool operator!=(const ModuleFingerprint &other) const {
+    return !(*this == other);
+  }
+};  // struct ModuleFingerprint
+
+// How the ids of a module are renumbered when compacting it
+struct CompactIdsOptions final {
+  CompactIdsOptions() : canonical_order(false) {}
+
+  // Sort the runs of names and of decorations by the ids they target, then
+  // by their words, so that modules differing only by the order of these
+  // compact to the same words
+  bool canonical_order;
+};  // struct CompactIdsOptions
+
+// Pending operations of an OpcodeStream at some point in time, which the
+// stream can be rolled back to
+class EditCheckpoint final {
+ public:
+  EditCheckpoint()
+      : stream_(nullptr),
+        edits_count_(0),
+        patches_count_(0),
+        patch_words_count_(0),
+        removals_count_(0),
+        emitted_words_count_(0),
+        id_bound_(0),
+        epoch_(0) {}
+
+ private:
+  friend class OpcodeStream;
+
+  const OpcodeStream *stream_;
+  size_t edits_count_;
+  size_t patches_count_;
+  size_t patch_words_count_;
+  size_t removals_count_;
+  size_t emitted_words_count_;
+  uint32_t id_bound_;
+  uint64_t epoch_;
+
+};  // class EditCheckpoint
 
 class OpcodeStream final {
  public:
-  typedef std::vector<OpcodeIterator>::iterator iterator;
-  typedef std::vector<OpcodeIterator>::const_iterator const_iterator;
-  typedef std::vector<OpcodeIterator>::reverse_iterator reverse_iterator;
-  typedef std::vector<OpcodeIterator>::const_reverse_iterator const_reverse_iterator;
-  
+  typedef StreamIterator<OpcodeIterator, false> iterator;
+  typedef StreamIterator<const OpcodeIterator, false> const_iterator;
+  typedef StreamIterator<OpcodeIterator, true> reverse_iterator;
+  typedef StreamIterator<const OpcodeIterator, true> const_reverse_iterator;
+  typedef InstructionRange<OpcodeIterator> range;
+  typedef InstructionRange<const OpcodeIterator> const_range;
+
  public:
+  // Create a stream holding an empty module, made of a header only, which
+  // another module can be loaded into
+  OpcodeStream();
+
+  // Parse a module, checking its magic number and that its instructions
+  // exactly cover its words; throws InvalidStream otherwise
+  //
+  // Modules of the opposite endianness are byte swapped once while loading,
+  // so the stream only ever holds and emits native words
   explicit OpcodeStream(const void *module_stream, size_t binary_size);
   explicit OpcodeStream(const std::vector<uint32_t> &module_stream);
   explicit OpcodeStream(std::vector<uint32_t> &&module_stream);
 
+  // Create a read-only stream which parses the words owned by the caller
+  // without copying them; the words must outlive the stream
+  //
+  // Operations on the instructions of a view throw until Promote() is called.
+  // Views of modules of the opposite endianness hold a swapped copy instead
+  static OpcodeStream View(const uint32_t *words, size_t words_count);
+  static OpcodeStream View(const void *module_stream, size_t binary_size);
+
+  // Create a stream over a memory-mapped .spv file
+  //
+  // The stream owns the mapping, so unlike a view it can be operated on
+  // straight away; the words are only copied if GetWords() is called
+  static OpcodeStream FromFile(const std::string &path);
+
+  // Load another module into this stream, copying its words or reading them
+  // from a file; the pending operations and the indices of the previous
+  // module are dropped, but the memory they used is kept and reused
+  //
+  // If loading throws, the stream holds no valid module until another one
+  // is loaded
+  void Load(const uint32_t *words, size_t words_count);
+  void LoadFile(const std::string &path);
+
+  // Load a module whose instructions have already been split, such as one
+  // being decoded, taking its words and the offset of each instruction, one
+  // per header word first; the offsets are checked against the word count of
+  // each instruction in one pass over them, without walking the operands.
+  // Modules of the opposite endianness are parsed from scratch
+  //
+  // Throws InvalidParameter if the offsets don't split the words exactly as
+  // parsing them would, and InvalidStream like the other loads otherwise
+  void Load(std::vector<uint32_t> &&words, std::vector<uint32_t> &&offsets);
+
+  // Whether the stream is a read-only view over words owned by the caller
+  bool IsView() const { return borrowed_words_ && !mapping_; }
+
+  // Copy the words of a view or of a mapped file into the stream so that it
+  // can be operated on; does nothing if the stream already owns its words
+  void Promote();
+
   // Standard iterators which can be used to access the instructions
   iterator begin();
   iterator end();
@@ -146,9 +848,170 @@ class OpcodeStream final {
   const_reverse_iterator rend() const;
   const_reverse_iterator crend() const;
 
+  // Return a fresh id, or the first of count consecutive fresh ids; the
+  // bound in the header of the emitted stream is raised past them, unless
+  // the bound word has been operated on directly
+  //
+  // Allocating is lock-free and thread-safe, so that concurrent passes can
+  // allocate ids from the same stream; the other operations aren't. Throws
+  // if the bound would overflow
+  spv::Id AllocateId();
+  spv::Id AllocateIds(size_t count);
+
+  // Reserve a block of ids in one allocation, so that a worker can hand them
+  // out without contending for the stream
+  IdBlock ReserveIds(size_t count);
+
+  // One past the largest id allocated so far, or the bound in the header if
+  // none has been
+  spv::Id GetIdBound() const;
+
   // Number of instructions in the stream
   size_t size() const;
 
+  // Instructions with a given opcode, in module order; the header words and
+  // the terminator are never part of them
+  //
+  // The first call builds an index of all the instructions bucketed by
+  // opcode in one pass, so that each query only visits its hits. Building
+  // the index is not thread-safe
+  range Instructions(spv::Op opcode);
+  const_range Instructions(spv::Op opcode) const;
+
+  // Instructions of a section of the logical layout, in module order
+  //
+  // The first call records the bounds of all the sections and functions in
+  // one pass over the opcodes; instructions which can appear in more than
+  // one section, such as OpLine, belong to the section they are found in,
+  // and OpExtInst at global scope belongs to the types. Recording the bounds
+  // is not thread-safe
+  range Section(ModuleSection section);
+  const_range Section(ModuleSection section) const;
+
+  // Instructions of each function, from its OpFunction to its OpFunctionEnd
+  // included, in module order
+  std::vector<range> Functions();
+  std::vector<const_range> Functions() const;
+
+  // Instruction defining a result id, or end() if the id isn't defined
+  //
+  // The first call builds a table of the definitions indexed by id, sized
+  // after the bound of the header, in one pass. Ids defined by the words
+  // inserted afterwards are added to the table as the operations are applied,
+  // and map to the instruction the words have been inserted around. Building
+  // the table is not thread-safe, and it doesn't track changes made through
+  // GetWords()
+  iterator FindDefinition(spv::Id id);
+  const_iterator FindDefinition(spv::Id id) const;
+
+  // Words of the instruction defining a result id, either original or
+  // inserted by an operation, or nullptr if the id isn't defined; valid until
+  // this OpcodeStream is operated on again
+  const uint32_t *GetDefinitionWords(spv::Id id) const;
+
+  // Result type id of the instruction defining a result id, or 0 if the id
+  // isn't defined or its instruction has no result type
+  spv::Id GetResultType(spv::Id id) const;
+
+  // Uses of an id by the operands of the instructions, the result types
+  // included; uses by the original instructions come first, in module order,
+  // followed by the uses by the inserted words. Removed instructions don't
+  // use anything, and neither do the operands of the extended instructions
+  // of sets other than GLSL.std.450 and the non-semantic ones
+  //
+  // The first call builds the def-use chains of all the ids in two passes,
+  // as one flat array of uses bucketed by id. Operating on the stream drops
+  // them, so that they get built again on the next call. Building the chains
+  // is not thread-safe, and the range is valid until they are dropped
+  IdUseRange GetUses(spv::Id id) const;
+
+  // Rewrite every use of old_id into new_id, leaving the definition of
+  // old_id alone
+  //
+  // The words are rewritten where they are, the original ones included, as
+  // it happens for GetWords(), so Rollback() doesn't undo it; mapped files
+  // get promoted first
+  //
+  // Throws InvalidStream if the module has extended instructions of a set
+  // other than GLSL.std.450 and the non-semantic ones, whose operands can't
+  // be told apart from their literals
+  void ReplaceAllUsesWith(spv::Id old_id, spv::Id new_id);
+
+  // Rename ids, both where they are defined and where they are used, in one
+  // pass over the def-use chains; id_map[id] is the new id of id, ids mapped
+  // to 0 or past the end of id_map are kept as they are
+  //
+  // The bound in the header is not updated, and like ReplaceAllUsesWith()
+  // the words are rewritten where they are. Throws InvalidStream for the
+  // same extended instructions as ReplaceAllUsesWith()
+  void RemapIds(const std::vector<spv::Id> &id_map);
+
+  // Pass over the instructions of one function, from its OpFunction to its
+  // OpFunctionEnd included
+  typedef std::function<void(size_t function_index, range function)>
+      FunctionPass;
+
+  // Run a pass over every function, on threads_count threads or one per
+  // hardware thread if zero; each function is visited once, by one thread
+  //
+  // The pass can read the whole stream, allocate ids and operate on the
+  // instructions of the function it is given. Each thread records its
+  // operations in a log of its own, and the logs are merged in module order
+  // once all the functions are done, so that the filtered stream is the same
+  // as if the functions had been visited one after the other
+  //
+  // Within the pass, the ids defined by the inserted words aren't found yet,
+  // and the def-use chains, GetWords() and the emission can't be used. Ids
+  // allocated within the pass depend on the order the threads ask for them;
+  // passes which need the same ids on every run can reserve them beforehand
+  //
+  // If the pass throws, none of its operations are kept and the exception
+  // thrown for the first function, in module order, is rethrown
+  void RunFunctionPass(const FunctionPass &pass, size_t threads_count = 0);
+
+  // Record the pending operations and the ids allocated so far, so that the
+  // stream can be rolled back to them; checkpoints can be nested
+  EditCheckpoint Checkpoint() const;
+
+  // Drop the operations recorded and the ids allocated since a checkpoint,
+  // in time proportional to the instructions operated on; the memory used by
+  // the inserted words is kept for the next operations, so that a parsed
+  // module can produce many variants without growing
+  //
+  // Edits applied in place, ids rewritten by ReplaceAllUsesWith() and
+  // RemapIds() and changes made through GetWords() aren't pending operations
+  // and are kept. Throws if the checkpoint doesn't belong to this stream,
+  // doesn't match its operations or has been rolled back past, or within a
+  // function pass
+  void Rollback(const EditCheckpoint &checkpoint);
+
+  // Drop all the pending operations and the ids allocated, as if the module
+  // had just been parsed; the checkpoints taken so far are rolled back past
+  void ClearEdits();
+
+  // Apply replacements of an instruction by one of the same opcode and word
+  // count straight to the words of the stream, rather than recording them as
+  // pending operations; disabled by default, including for the streams
+  // emitted from this one
+  //
+  // The stream stays usable as it is, with the definitions kept up to date,
+  // and only needs to be emitted for the operations which change its layout.
+  // Within a function pass, replacements are always recorded
+  void SetInPlaceEdits(bool enabled) { in_place_edits_ = enabled; }
+  bool GetInPlaceEdits() const { return in_place_edits_; }
+
+  // Whether the filtered stream differs from the words of the stream, either
+  // because of pending operations or because ids have been allocated
+  bool NeedsEmission() const;
+
+  // Hash the filtered stream in a single pass over the runs it is emitted
+  // from, without emitting it; streams with the same filtered stream have
+  // the same fingerprint whatever their pending operations
+  //
+  // Not suited to untrusted inputs: the hash is fast, not cryptographic
+  ModuleFingerprint Fingerprint(
+      const FingerprintOptions &options = FingerprintOptions()) const;
+
   // Apply pending operations and emit filtered stream into a new object
   //
   // This OpcodeStream does not get modified but it still retains the
@@ -156,39 +1019,464 @@ class OpcodeStream final {
   // will produce the same filtered stream
   OpcodeStream EmitFilteredStream() const;
 
-  // Get the raw words stream, unfiltered and non-modified
+  // Emit the filtered stream without its debug instructions: sources,
+  // strings, names, line information and processes, along with the
+  // instructions of the non-semantic extended instruction sets other than
+  // NonSemantic.DebugPrintf. Strings still used by the extended instructions
+  // kept are kept too
+  //
+  // The instructions are dropped while the stream is emitted, without
+  // recording an operation for each of them; a first walk only looks at the
+  // extended instructions. Throws InvalidStream if inserted words don't
+  // split in whole instructions
+  OpcodeStream StripDebugInfo() const;
+
+  // Emit the filtered stream without the types, constants, global variables
+  // and functions which can't be reached from the entry points, along with
+  // their names and decorations
+  //
+  // Ids are marked live in a bitset over the bound, starting from the entry
+  // points, their execution modes and the extended instructions outside of
+  // functions, and group decorations lose their dead targets; the
+  // definitions are gathered in a single walk, so the time is linear in the
+  // size of the module. Throws InvalidStream if inserted words don't split in
+  // whole instructions
+  OpcodeStream EliminateDeadCode() const;
+
+  // Emit a module holding a single entry point, found by name and execution
+  // model, along with its execution modes and what it can reach: the
+  // functions it calls, its interface variables, and the types, constants,
+  // names and decorations they use. Throws InvalidParameter if the module
+  // has no such entry point, and InvalidStream as EliminateDeadCode() does
+  //
+  // The definitions and function bodies are gathered on the first call and
+  // kept until the stream is operated on, so that slicing many entry points
+  // out of a module only walks what each of them reaches before emitting it
+  OpcodeStream ExtractEntryPoint(const std::string &name,
+                                 spv::ExecutionModel model) const;
+
+  // Emit the filtered stream with its ids renumbered densely from 1, in the
+  // order they are defined, and the bound in the header lowered to one past
+  // the last of them; ids which are used but never defined are numbered
+  // after the defined ones, in the order they are first used
+  //
+  // The new ids are assigned in one walk over the emitted words and written
+  // in a second one, through a flat array indexed by the old ids
+  //
+  // Throws InvalidStream for the same extended instructions as
+  // ReplaceAllUsesWith()
+  OpcodeStream CompactIds(
+      const CompactIdsOptions &options = CompactIdsOptions()) const;
+
+  // Number of words of the filtered stream, computed from the pending
+  // operations without emitting it
+  size_t GetEmittedWordsCount() const;
+
+  // Apply pending operations and emit the words of the filtered stream only,
+  // replacing the content of words; the vector is allocated at most once
+  void EmitWords(std::vector<uint32_t> &words) const;
+
+  // Apply pending operations and emit the words of the filtered stream into a
+  // buffer of capacity words; return the number of words written
+  //
+  // Throws InvalidParameter if the capacity is smaller than
+  // GetEmittedWordsCount(), and std::length_error without writing past the
+  // buffer if the words emitted turn out not to fit
+  size_t EmitInto(uint32_t *dst, size_t capacity) const;
+
+  // Apply pending operations and return the filtered stream as a list of
+  // segments pointing into the original words and into the inserted words,
+  // without concatenating them; runs of untouched instructions are merged
+  // into single segments
+  //
+  // The segments are valid until this OpcodeStream is operated on again or
+  // destroyed
+  SegmentList EmitSegments() const;
+
+  // Apply pending operations and write the filtered stream straight to a file
+  // descriptor or to a file, without building it in memory first
+  //
+  // The file must not be the one this stream has been mapped from
+  void EmitTo(int fd) const;
+  void EmitToFile(const std::string &path) const;
+
+  // Get the raw words stream, unfiltered: the in-place edits are part of it
+  // but the pending operations aren't
   std::vector<uint32_t> GetWordsStream() const;
 
+  // Get a pointer to the raw words stream and its size in words, without
+  // copying it
+  const uint32_t *data() const;
+  size_t words_count() const { return original_module_size_; }
+
  private:
   typedef std::vector<uint32_t> WordsStream;
-  typedef std::vector<OpcodeIterator> OffsetsList;
+  typedef std::vector<uint32_t> OffsetsList;
+
+  // A chunk of words inserted by an operation; chunks inserted at the same
+  // place are chained from the most recent to the oldest one
+  struct Patch final {
+    uint64_t offset;
+    uint32_t count;
+    uint32_t next;
+  };  // struct Patch
+
+  // Pending operations for a single instruction; only instructions which have
+  // been operated on get one of these
+  struct InstructionEdits final {
+    explicit InstructionEdits(uint32_t instruction_index);
+
+    uint32_t instruction;
+    // Heads of the chains of patches for each type of operation
+    uint32_t insert_before;
+    uint32_t insert_after;
+    uint32_t replace;
+    bool remove;
+  };  // struct InstructionEdits
+
+  typedef std::vector<Patch> PatchesList;
+  typedef std::vector<InstructionEdits> EditsList;
+  typedef std::unordered_map<uint32_t, uint32_t> EditsIndex;
+
+  // Sparse table of pending operations, indexed by instruction index, along
+  // with the words inserted by the operations and the chunks they are split
+  // in; the stream records its operations in its own log, while the workers
+  // of a function pass record them in logs of their own
+  struct EditLog final {
+    EditLog();
+
+    EditsList edits;
+    EditsIndex edits_index;
+    WordsStream patch_words;
+    PatchesList patches;
+
+    // Instructions removed, in order, so that removals can be rolled back
+    OffsetsList removals;
+
+    // Change to the size of the filtered stream, for the logs of the workers
+    ptrdiff_t emitted_words_delta;
+  };  // struct EditLog
+
+  // Worker of a function pass running on a thread, with the log it records
+  // in and the instructions of the function it is visiting
+  struct PassWorker final {
+    const OpcodeStream *stream;
+    EditLog *log;
+    size_t first_instruction;
+    size_t end_instruction;
+  };  // struct PassWorker
 
-  // Stream of words representing the module as it has been modified
+  static thread_local PassWorker pass_worker_;
+
+  // Make the class a friend so that it can record its operations
+  friend class OpcodeIterator;
+
+  // Tag used to select the ctor which borrows the words
+  struct BorrowWords final {};
+  // Tag used to select the ctor which takes already parsed words
+  struct ParsedWords final {};
+
+  OpcodeStream(const uint32_t *words, size_t words_count, BorrowWords);
+  // Takes the offsets of all the instructions, without the terminator
+  OpcodeStream(WordsStream &&module_stream, OffsetsList &&offsets,
+               ParsedWords);
+
+  // Stream of words representing the module as it has been modified; empty
+  // when the stream is a view
   WordsStream module_stream_;
 
+  // Words owned by the caller when the stream is a view, or words of the
+  // mapped file; nullptr when the stream owns its words
+  const uint32_t *borrowed_words_;
+
+  // Keeps the mapped file alive, if any
+  std::shared_ptr<const void> mapping_;
+
   size_t original_module_size_;
 
-  // One entry per instruction, with entries coming only from the original
+  // Size in words of the filtered stream, kept up to date by the operations
+  size_t emitted_words_count_;
+
+  // Counter of the next id to allocate, which copies of the stream take a
+  // snapshot of
+  struct IdCounter final {
+    IdCounter() : next(0) {}
+    IdCounter(const IdCounter &other) : next(other.next.load()) {}
+    IdCounter &operator=(const IdCounter &other) {
+      next.store(other.next.load());
+      return *this;
+    }
+
+    std::atomic<uint32_t> next;
+  };  // struct IdCounter
+
+  IdCounter id_counter_;
+
+  // Whether replacements of the same size are applied to the words in place
+  bool in_place_edits_;
+
+  // One offset per instruction, with entries coming only from the original
   // module, i.e. without the filtering
   OffsetsList offsets_table_;
 
+  // Instruction indices bucketed by opcode, built on demand; the bucket of an
+  // opcode starts at opcode_index_offsets_[opcode] in opcode_index_
+  mutable OffsetsList opcode_index_offsets_;
+  mutable OffsetsList opcode_index_;
+
+  // Index of the first instruction of each section, followed by the index
+  // of the terminator; built on demand
+  mutable OffsetsList section_offsets_;
+  // Index of the OpFunction and one past the OpFunctionEnd of each function
+  mutable OffsetsList function_offsets_;
+
+  // Definition of a result id
+  struct IdDefinition final {
+    // Index of the defining instruction, or of the instruction the defining
+    // words have been inserted around
+    uint32_t instruction;
+    uint32_t type;
+    // Offset of the defining words; offsets past the original module refer to
+    // the words inserted by the operations
+    uint64_t offset;
+  };  // struct IdDefinition
+
+  typedef std::vector<IdDefinition> IdDefinitionsList;
+
+  // Definitions indexed by result id, built on demand
+  mutable IdDefinitionsList id_definitions_;
+
+  // Def-use chains, built on demand; the uses of an id start at
+  // id_use_offsets_[id] in id_uses_
+  mutable OffsetsList id_use_offsets_;
+  mutable std::vector<IdUse> id_uses_;
+
+  // Definitions of the ids of the filtered stream and instructions which
+  // keep ids alive, for dead code elimination and entry point extraction,
+  // built on demand; streams copied from this one share it
+  struct DependencyGraph;
+  mutable std::shared_ptr<const DependencyGraph> dependency_graph_;
+
+  // Pending operations of the stream
+  EditLog edit_log_;
+
+  // Epoch of the pending operations, bumped whenever some of them are
+  // dropped, so that checkpoints taken before can't be told apart from the
+  // ones taken after by their counts alone; for each earlier epoch which can
+  // still be rolled back to, the checkpoint its operations are kept up to,
+  // in epoch order
+  uint64_t edit_epoch_;
+  std::vector<EditCheckpoint> kept_epochs_;
+
   void InsertOffsetInTable(size_t offset);
-  void InsertWordHeaderInOriginalStream(const struct OpcodeHeader &header);
 
   // Parse the module stream into an offset table; called by the ctor
   void ParseModule();
 
+  // Drop the module and everything derived from it, keeping the memory
+  void ClearModule();
+
   // Return the word count of a given instruction starting at start_index
   size_t ParseInstructionWordCount(size_t start_index);
 
-  // Return the word at a given index in the module stream
+  // Return the word at a given index in the module stream; the index right
+  // after the last word returns the terminator
   uint32_t PeekAt(size_t index) const;
 
-  // Emit the words for a given type of operation; the different type
-  // depends only on where the words are read from, so passing the start offset
-  // and count is sufficient to distinguish
-  void EmitByType(WordsStream &new_stream, size_t start_offset,
-                  size_t count) const;
+  // Build the per-opcode index if it hasn't been built yet
+  void BuildOpcodeIndex() const;
+
+  // Return the range of opcode_index_ holding the instructions of an opcode
+  void GetOpcodeBucket(spv::Op opcode, size_t *first, size_t *end) const;
+
+  // Record the bounds of the sections and functions if they haven't been
+  // recorded yet
+  void BuildSectionIndex() const;
+
+  // Build the table of the definitions if it hasn't been built yet
+  void BuildIdDefinitions() const;
+
+  // Return the definition of a result id or nullptr if it isn't defined
+  const IdDefinition *FindIdDefinition(spv::Id id) const;
+
+  // Call visitor(instruction_index, patch) for each patch inserted around
+  // an instruction, in module order; the header and the terminator are
+  // skipped
+  template <typename Visitor>
+  void ForEachInsertedPatch(Visitor &&visitor) const;
+
+  // Record the ids defined by the words at offset, which either are original
+  // words of an instruction or have been inserted around it
+  void DefineIds(size_t instruction_index, const uint32_t *words,
+                 size_t words_count, uint64_t offset) const;
+
+  // Record the ids defined by the last patch pushed to a log, once the table
+  // is built; the ids of worker logs are recorded once they are merged
+  void DefineInsertedIds(const EditLog &log, size_t instruction_index);
+
+  // Drop the id defined by an original instruction, if any
+  void UndefineIds(size_t instruction_index) const;
+
+  // Whether a checkpoint of the same epoch as last was taken before it
+  static bool IsCheckpointWithin(const EditCheckpoint &checkpoint,
+                                 const EditCheckpoint &last);
+
+  // Drop the operations recorded and the ids allocated since a checkpoint
+  // known to be valid
+  void DropEdits(const EditCheckpoint &checkpoint);
+
+  // Throw InvalidStream if an extended instruction of the filtered stream
+  // belongs to a set whose operands aren't known to be all ids, as rewriting
+  // its ids would corrupt its literals
+  void CheckExtInstOperands(const char *operation) const;
+
+  // Build the def-use chains if they haven't been built yet
+  void BuildIdUses() const;
+
+  // Drop the def-use chains and the dependency graph after the stream has
+  // been operated on
+  void DropIdUses();
+
+  // Call visitor(id, use) for each id operand of the instructions which are
+  // emitted, original or inserted
+  template <typename Visitor>
+  void ForEachIdUse(Visitor &&visitor) const;
+
+  // Return a pointer to the word at an offset of an IdUse or IdDefinition
+  uint32_t *GetWordAt(uint64_t offset);
+
+  // Whether the instruction index refers to the terminator
+  bool IsTerminator(size_t instruction_index) const;
+
+  // Return the number of words of an instruction from the offsets table
+  size_t GetInstructionWordsCount(size_t instruction_index) const;
+
+  // Throw if the stream can't be operated on
+  void CheckEditable() const;
+
+  // Throw if called by a worker of a function pass running on this stream
+  void CheckOutsidePass() const;
+
+  // Return the log which operations on an instruction are recorded in; the
+  // one of the worker when called within a function pass, which throws if the
+  // instruction is outside of the function of the worker
+  EditLog &GetEditLog(size_t instruction_index);
+
+  bool IsWorkerLog(const EditLog &log) const { return &log != &edit_log_; }
+
+  // Update the size of the filtered stream after inserting words around an
+  // instruction or removing it
+  void AccountEmittedWords(EditLog &log, size_t instruction_index,
+                           ptrdiff_t words_count);
+
+  // Return the edits of an instruction, creating them if they don't exist
+  InstructionEdits &GetEdits(EditLog &log, size_t instruction_index);
+  // Return the edits of an instruction or nullptr if it has none
+  const InstructionEdits *FindEdits(const EditLog &log,
+                                    size_t instruction_index) const;
+
+  // Whether an instruction has been removed or replaced, either in a log or,
+  // for worker logs, by the stream before the function pass
+  bool IsRemoved(const EditLog &log, size_t instruction_index) const;
+  bool IsReplaced(const EditLog &log, size_t instruction_index) const;
+
+  // Whether a replacement can overwrite the words of an instruction in place
+  bool CanReplaceInPlace(const EditLog &log, size_t instruction_index,
+                         const uint32_t *instructions,
+                         size_t words_count) const;
+
+  // Overwrite words of an instruction, starting at one of its words, keeping
+  // the definitions up to date
+  void OverwriteWords(size_t instruction_index, size_t word_index,
+                      const uint32_t *words, size_t words_count);
+
+  // Store a chunk of words and push it at the head of a chain of patches
+  void PushPatch(EditLog &log, const uint32_t *instructions,
+                 size_t words_count, uint32_t *chain_head);
+
+  // Merge the logs of the workers of a function pass into the one of the
+  // stream, in module order
+  void MergeEditLogs(const std::vector<EditLog> &logs);
+
+  // Push the patches of a chain of a worker log on top of a chain of the
+  // stream, from the oldest to the most recent one
+  void MergeChain(const EditLog &log, uint32_t chain_head,
+                  size_t instruction_index, uint32_t *stream_chain_head);
+
+  // Return the edited instructions sorted in module order
+  std::vector<const InstructionEdits *> GetSortedEdits() const;
+
+  // Run of words of the filtered stream; runs of original words also carry
+  // the range of instructions they span, inserted words have an empty range
+  struct EmittedRun final {
+    const uint32_t *words;
+    size_t count;
+    size_t first_instruction;
+    size_t end_instruction;
+  };  // struct EmittedRun
+
+  // Call sink(run) for each run of words of the filtered stream, in order;
+  // untouched instructions are merged in runs of original words
+  //
+  // A raised bound is emitted from bound, which is owned by the caller, so
+  // that concurrent emissions don't share it and runs kept past the walk
+  // stay valid; the first overload keeps it for the duration of the walk
+  template <typename Sink>
+  void ForEachEmittedRun(Sink &&sink) const;
+  template <typename Sink>
+  void ForEachEmittedRun(uint32_t *bound, Sink &&sink) const;
+
+  // Call visitor(words, words_count) for each instruction of the filtered
+  // stream past the header, in order; the walk stops at inserted words
+  // which don't split in whole instructions, and returns false if it did
+  template <typename Visitor>
+  bool ForEachEmittedInstruction(Visitor &&visitor) const;
+
+  // Emit the filtered stream without the instructions for which
+  // keep(words, words_count) returns false; throws InvalidStream if inserted
+  // words don't split in whole instructions
+  template <typename Keep>
+  OpcodeStream EmitKeptInstructions(Keep &&keep) const;
+
+  // Return the dependency graph of the filtered stream, built on demand
+  const DependencyGraph &GetDependencyGraph() const;
+
+  // Convert between offsets and the words of the stream or the inserted
+  // words; offsets past the original module refer to the inserted words
+  const uint32_t *GetWordAt(uint64_t offset) const;
+  uint64_t GetWordOffset(const uint32_t *word) const;
+
+  // Mark the ids used by the roots, given by offset, as live, then the ids
+  // used by the definitions of the live ids, up to the bodies of the live
+  // functions; decoration groups are live when one of their targets is
+  void MarkLiveIds(const DependencyGraph &graph,
+                   const std::vector<uint64_t> &roots,
+                   std::vector<bool> &live) const;
+
+  // Mark the ids used by the definitions of the pending ids, and of the ids
+  // they mark in turn, until none are left
+  template <typename Mark, typename MarkOperands>
+  void MarkLiveDefinitions(const DependencyGraph &graph,
+                           std::vector<spv::Id> &pending, Mark &&mark,
+                           MarkOperands &&mark_operands) const;
+
+  // Emit the filtered stream without the definitions of the ids which aren't
+  // live, and without their names and decorations; group decorations keep
+  // their live targets only, and are left out when none is left. If
+  // entry_point is set, the other entry points and their execution modes are
+  // left out too
+  OpcodeStream EmitLiveInstructions(const std::vector<bool> &live,
+                                    const uint32_t *entry_point) const;
+
+  // Append the offsets of the instructions contained in words, which will be
+  // at a given offset in a stream; return false if the words don't split in
+  // whole instructions
+  static bool ScanInstructions(const uint32_t *words, size_t count,
+                               size_t offset, OffsetsList &offsets);
+
+  // Emit the words of a chain of patches, from its head to its tail
+  template <typename Sink>
+  void EmitPatches(Sink &sink, uint32_t chain_head) const;
 
 };  // class OpcodeStream
 
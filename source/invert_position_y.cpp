@@ -24,7 +24,7 @@
 */
 #include <spv_utils.h>
 #include <cstdint>
-#include <fstream>
+#include <cstdlib>
 #include <iostream>
 #include <assert.h>
 
@@ -45,171 +45,142 @@ int main( int argc, char *argv[] )
     }
 
 
-    // Read spv binary module from a file
-    std::ifstream spvFile( argv[ 1 ], std::ios::binary | std::ios::ate | std::ios::in );
-    if ( !spvFile.is_open() )
+    // Map the spv binary module from a file and parse it
+    sut::OpcodeStream stream = [ & ]() -> sut::OpcodeStream
     {
-        printf( "Error opening input SPIR-V: %s\n", argv[ 1 ] );
-        return 1;
+        try
+        {
+            return sut::OpcodeStream::FromFile( argv[ 1 ] );
+        }
+        catch ( const std::exception &e )
+        {
+            printf( "Error opening input SPIR-V: %s\n", e.what() );
+            exit( 1 );
+        }
+    }();
+
+    // First find the position output, float scalar type, and float vec4 type ids
+    spv::Id nPositionId = 0;
+    spv::Id nScalarFloatTypeId = 0;
+    spv::Id nFloat4TypeId = 0;
+    bool bFoundPosition = false;
+    bool bFoundTypeFloat = false;
+    bool bFoundTypeFloat4 = false;
+    {
+        // Decorations and types sit next to each other, so only the sections from the annotations to the
+        // types need to be visited
+        sut::OpcodeStream::iterator it = stream.Section( sut::ModuleSection::kAnnotations ).begin();
+        sut::OpcodeStream::iterator itEnd = stream.Section( sut::ModuleSection::kTypes ).end();
+        while( it != itEnd && ( !bFoundPosition || !bFoundTypeFloat || !bFoundTypeFloat4 ) )
+        {
+            // Looking for OpDecorate Position
+            if ( !bFoundPosition && ( it->GetOpcode() == spv::Op::OpDecorate ) )
+            {
+                spv::Id nId = ( spv::Id ) it->GetWord( 1 );
+                spv::Decoration nDecoration = ( spv::Decoration ) it->GetWord( 2 );
+                if ( nDecoration  == spv::Decoration::BuiltIn )
+                {
+                    for ( uint32_t nDecorationCount = 0; nDecorationCount < it->GetWordCount() - 3; nDecorationCount++ )
+                    {
+                        spv::BuiltIn nBuiltIn = ( spv::BuiltIn ) it->GetWord( 3 + nDecorationCount );
+                        if ( nBuiltIn == spv::BuiltIn::Position )
+                        {
+                            nPositionId = nId;
+                            bFoundPosition = true;
+                        }
+                    }
+                }
+            }
+            // OpTypeFloat 32
+            else if ( !bFoundTypeFloat && ( it->GetOpcode() == spv::Op::OpTypeFloat ) )
+            {
+                nScalarFloatTypeId = it->GetWord( 1 );
+                bFoundTypeFloat = true;
+            }
+            // OpTypeVector nScalartFloatTypeId 4
+            else if ( !bFoundTypeFloat4 && ( it->GetOpcode() == spv::Op::OpTypeVector ) )
+            {
+                assert( bFoundTypeFloat );
+                spv::Id nVectorTypeId = ( spv::Id ) it->GetWord( 2 );
+                if ( nVectorTypeId == nScalarFloatTypeId && ( it->GetWord( 3 ) == 4 ) )
+                {
+                    nFloat4TypeId = it->GetWord( 1 );
+                    bFoundTypeFloat4 = true;
+                }
+            }
+            it++;
+        }
     }
 
-    std::streampos size = spvFile.tellg();
-
-    spvFile.seekg( 0, std::ios::beg );
-    char *data = new char[ size ];
-    spvFile.read( data, size );
-    spvFile.close();
-
-    // Parse the module
-    sut::OpcodeStream stream( data, size );
-
-    // First find the position output, float scalar type, and float vec4 type ids
-    spv::Id nPositionId = 0;
-    spv::Id nScalarFloatTypeId = 0;
-    spv::Id nFloat4TypeId = 0;
-    bool bFoundPosition = false;
-    bool bFoundTypeFloat = false;
-    bool bFoundTypeFloat4 = false;
-    {
-        sut::OpcodeStream::iterator it = stream.begin();
-        while( it != stream.end() && ( !bFoundPosition || !bFoundTypeFloat || !bFoundTypeFloat4 ) )
-        {
-            // Looking for OpDecorate Position
-            if ( !bFoundPosition && ( it->GetOpcode() == spv::Op::OpDecorate ) )
-            {
-                std::vector< uint32_t > &words = it->GetWords();
-                spv::Id nId = ( spv::Id ) words[ it->offset() + 1 ];
-                spv::Decoration nDecoration = ( spv::Decoration ) words[ it->offset() + 2 ];
-                if ( nDecoration  == spv::Decoration::BuiltIn )
-                {
-                    for ( uint32_t nDecorationCount = 0; nDecorationCount < it->GetWordCount() - 3; nDecorationCount++ )
-                    {
-                        spv::BuiltIn nBuiltIn = ( spv::BuiltIn ) words[ it->offset() + 3 + nDecorationCount ];
-                        if ( nBuiltIn == spv::BuiltIn::Position )
-                        {
-                            nPositionId = nId;
-                            bFoundPosition = true;
-                        }
-                    }
-                }
-            }
-            // OpTypeFloat 32
-            else if ( !bFoundTypeFloat && ( it->GetOpcode() == spv::Op::OpTypeFloat ) )
-            {
-                std::vector< uint32_t > &words = it->GetWords();
-                nScalarFloatTypeId = words[ it->offset() + 1 ];
-                bFoundTypeFloat = true;
-            }
-            // OpTypeVector nScalartFloatTypeId 4
-            else if ( !bFoundTypeFloat4 && ( it->GetOpcode() == spv::Op::OpTypeVector ) )
-            {
-                assert( bFoundTypeFloat );
-                std::vector< uint32_t > &words = it->GetWords();
-                spv::Id nVectorTypeId = ( spv::Id ) words[ it->offset() + 2 ];
-                if ( nVectorTypeId == nScalarFloatTypeId && ( words[ it->offset() + 3 ] == 4 ) )
-                {
-                    nFloat4TypeId = words[ it->offset() + 1 ];
-                    bFoundTypeFloat4 = true;
-                }
-            }
-            it++;
-        }
-    }
-
-    // Now find the last write to position, and prepend y inversion
-    if ( bFoundTypeFloat && bFoundPosition && bFoundTypeFloat4 )
-    {
-        // The bound is stored at the 3rd word, we need to bump this to have room for three more IDs
-        uint32_t nBound = stream.GetWordsStream()[ 3 ];
-
-        // Start new IDs after the bound, the 
-        spv::Id nYScalarId = nBound;
-        spv::Id nYScalarNegId = nBound + 1;
-        spv::Id nNewObjectId = nBound + 2;
-        sut::OpcodeStream::reverse_iterator rit = stream.rbegin();
-        while ( rit != stream.rend() )
-        {
-            // Find OpCodeStore to the Position, searching backwards from the last instruction
-            if ( rit->GetOpcode() == spv::Op::OpStore )
-            {
-                std::vector< uint32_t > &words = rit->GetWords();
-                spv::Id nStoreId = ( spv::Id ) words[ rit->offset() + 1 ];
-                spv::Id nObjectId = ( spv::Id ) words[ rit->offset() + 2 ];
-
-                // Found a store to position
-                if ( nStoreId == nPositionId )
-                {
-                    sut::OpcodeHeader header;
-
-                    // Extract the y from position
-                    // nYScalarId = OpCompositeExtract %float %nObjectId 1
-                    header.opcode = ( uint16_t ) spv::Op::OpCompositeExtract;
-                    header.words_count = 5;
-                    std::vector< uint32_t > compositeExtract;
-                    compositeExtract.push_back( MergeSpvOpCode( header ) );
-                    compositeExtract.push_back( nScalarFloatTypeId );
-                    compositeExtract.push_back( nYScalarId );
-                    compositeExtract.push_back( nObjectId );
-                    compositeExtract.push_back( 1 );
-
-                    // Negate y
-                    // nYScalarNegId = OpFNegate %float nYScaleId
-                    header.opcode = ( uint16_t ) spv::Op::OpFNegate;
-                    header.words_count = 4;
-                    std::vector< uint32_t > negate;
-                    negate.clear();
-                    negate.push_back( MergeSpvOpCode( header ) );
-                    negate.push_back( nScalarFloatTypeId );
-                    negate.push_back( nYScalarNegId );
-                    negate.push_back( nYScalarId );
-
-                    // Create a new vec4 that has inverted y, copying the rest of the object as is
-                    // nNewObjectId = OpCompositeInsert %v4float %nYScalarNegId %nObjectId 1
-                    header.opcode = ( uint16_t ) spv::Op::OpCompositeInsert;
-                    header.words_count = 6;
-                    std::vector< uint32_t > compositeInsert;
-                    compositeInsert.push_back( MergeSpvOpCode( header ) );
-                    compositeInsert.push_back( nFloat4TypeId );
-                    compositeInsert.push_back( nNewObjectId );
-                    compositeInsert.push_back( nYScalarNegId );
-                    compositeInsert.push_back( nObjectId );
-                    compositeInsert.push_back( 1 );
-
-                    // Modify which id the OpStore is from
-                    words[ rit->offset() + 2 ] = nNewObjectId;
-
-                    // Also modify the bounds, which is always at the 3rd word in the SPIR-V.  We've added
-                    // two new IDs
-                    words[ 3 ] = nBound + 3;
-
-                    // Finally, insert the instructions before the store.  These get inserted in reverse order
-                    // because of how InsertBefore behaves
-                    rit->InsertBefore( &compositeInsert[ 0 ], compositeInsert.size() );
-                    rit->InsertBefore( &negate[ 0 ], negate.size() );
-                    rit->InsertBefore( &compositeExtract[ 0 ], compositeExtract.size() );
-                    break;
-                }
-            }
-            rit++;
-        }
-
-        sut::OpcodeStream patchedStream = stream.EmitFilteredStream();
-        std::vector< uint32_t > patchedStreamWords = patchedStream.GetWordsStream();
-
-        std::ofstream spvOutputFile( argv[ 2 ], std::ios::binary | std::ios::out );
-        if ( !spvOutputFile.is_open() )
+    // Now find the last write to position, and prepend y inversion
+    if ( bFoundTypeFloat && bFoundPosition && bFoundTypeFloat4 )
+    {
+        // Only the OpStore instructions need to be visited, searching backwards from the last one
+        sut::OpcodeStream::range stores = stream.Instructions( spv::Op::OpStore );
+        sut::OpcodeStream::range::reverse_iterator rit = stores.rbegin();
+        while ( rit != stores.rend() )
+        {
+            // Find OpCodeStore to the Position
+            spv::Id nStoreId = ( spv::Id ) rit->GetWord( 1 );
+            spv::Id nObjectId = ( spv::Id ) rit->GetWord( 2 );
+
+            // Found a store to position
+            if ( nStoreId == nPositionId )
+            {
+                // Allocate three new IDs; the bound of the written module is bumped past them
+                spv::Id nYScalarId = stream.AllocateIds( 3 );
+                spv::Id nYScalarNegId = nYScalarId + 1;
+                spv::Id nNewObjectId = nYScalarId + 2;
+
+                // Extract the y from position
+                // nYScalarId = OpCompositeExtract %float %nObjectId 1
+                sut::InstructionBuilder compositeExtract( spv::Op::OpCompositeExtract );
+                compositeExtract.AddId( nScalarFloatTypeId ).AddId( nYScalarId ).AddId( nObjectId ).AddLiteral( 1 );
+
+                // Negate y
+                // nYScalarNegId = OpFNegate %float nYScaleId
+                sut::InstructionBuilder negate( spv::Op::OpFNegate );
+                negate.AddId( nScalarFloatTypeId ).AddId( nYScalarNegId ).AddId( nYScalarId );
+
+                // Create a new vec4 that has inverted y, copying the rest of the object as is
+                // nNewObjectId = OpCompositeInsert %v4float %nYScalarNegId %nObjectId 1
+                sut::InstructionBuilder compositeInsert( spv::Op::OpCompositeInsert );
+                compositeInsert.AddId( nFloat4TypeId ).AddId( nNewObjectId ).AddId( nYScalarNegId ).AddId( nObjectId ).AddLiteral( 1 );
+
+                // Modify which id the OpStore is from, keeping its memory access operands
+                sut::InstructionBuilder store( spv::Op::OpStore );
+                store.AddId( nStoreId ).AddId( nNewObjectId );
+                for ( size_t nWord = 3; nWord < rit->GetWordCount(); nWord++ )
+                {
+                    store.AddLiteral( rit->GetWord( nWord ) );
+                }
+                rit->Replace( store );
+
+                // Finally, insert the instructions before the store.  These get inserted in reverse order
+                // because of how InsertBefore behaves
+                rit->InsertBefore( compositeInsert );
+                rit->InsertBefore( negate );
+                rit->InsertBefore( compositeExtract );
+                break;
+            }
+            rit++;
+        }
+
+        // Write the patched module straight from the mapped input and the inserted words
+        try
+        {
+            stream.EmitToFile( argv[ 2 ] );
+        }
+        catch ( const std::exception &e )
         {
-            printf( "Error opening output SPIR-V: %s\n", argv[ 2 ] );
+            printf( "Error writing output SPIR-V: %s\n", e.what() );
             return 1;
         }
-        spvOutputFile.write( ( const char * ) &patchedStreamWords[ 0 ], patchedStreamWords.size() * sizeof( uint32_t ) );
-        spvOutputFile.close();
     }
     else
     {
         printf( "Shader was determined not to require patching, no output written.\n" );
     }
 
-    delete[] data;
     return 0;
 }
@@ -1,22 +1,13 @@
 #include <spv_utils.h>
 #include <cstdint>
-#include <fstream>
 #include <iostream>
+#include <vector>
 
 int main() {
-  // Read spv binary module from a file
-  std::ifstream spv_file("../sample_spv_modules/test.frag.spv",
-                         std::ios::binary | std::ios::ate | std::ios::in);
-  if (spv_file.is_open()) {
-    std::streampos size = spv_file.tellg();
-
-    spv_file.seekg(0, std::ios::beg);
-    char *data = new char[size];
-    spv_file.read(data, size);
-    spv_file.close();
-
-    // Parse the module
-    sut::OpcodeStream stream(data, size);
+  try {
+    // Map the spv binary module from a file and parse it
+    sut::OpcodeStream stream =
+        sut::OpcodeStream::FromFile("../sample_spv_modules/test.frag.spv");
     for (auto &i : stream) {
       if (i.GetOpcode() == spv::Op::OpCapability) {
         uint32_t instruction = 0xDEADBEEF;
@@ -34,11 +25,13 @@ int main() {
       }
     }
 
-    sut::OpcodeStream filtered_stream = stream.EmitFilteredStream();
-    std::vector<uint32_t> filtered_stream_words = filtered_stream.GetWordsStream();
-
-    delete[] data;
-    data = nullptr;
+    // Emit the filtered module straight from the mapped file and the
+    // inserted words
+    std::vector<uint32_t> filtered_stream_words;
+    stream.EmitWords(filtered_stream_words);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
   }
 
   return 0;
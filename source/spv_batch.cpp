@@ -0,0 +1,339 @@
+/*
+  MIT License
+
+  Copyright (c) 2017 Alberto Taiuti
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <spv_batch.h>
+#include <algorithm>
+#include <atomic>
+
+namespace sut {
+
+// Number of results which ordered runs can hold per worker, waiting for the
+// ones before them to be delivered
+static const size_t kReorderSlotsPerWorker = 4;
+
+BatchInput BatchInput::File(const std::string &path) {
+  BatchInput input;
+  input.path = path;
+  input.words = nullptr;
+  input.words_count = 0;
+  return input;
+}
+
+BatchInput BatchInput::Words(const uint32_t *words, size_t words_count) {
+  BatchInput input;
+  input.words = words;
+  input.words_count = words_count;
+  return input;
+}
+
+struct BatchProcessor::Worker final {
+  explicit Worker(size_t worker_index)
+      : index(worker_index), stream(), output(), mutex(), next(0), end(0) {}
+
+  size_t index;
+
+  // Reused from one module to the next
+  OpcodeStream stream;
+  std::vector<uint32_t> output;
+
+  // Inputs left to the worker during unordered runs, which the other workers
+  // can steal from the back of
+  std::mutex mutex;
+  size_t next;
+  size_t end;
+};  // struct BatchProcessor::Worker
+
+BatchProcessor::BatchProcessor(size_t threads_count)
+    : workers_(),
+      threads_(),
+      mutex_(),
+      start_condition_(),
+      done_condition_(),
+      job_(nullptr),
+      generation_(0),
+      busy_workers_(0),
+      running_(false),
+      stopping_(false) {
+  if (threads_count == 0) {
+    threads_count = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+
+  workers_.reserve(threads_count);
+  for (size_t i = 0; i < threads_count; ++i) {
+    workers_.emplace_back(new Worker(i));
+  }
+
+  threads_.reserve(threads_count);
+  for (size_t i = 0; i < threads_count; ++i) {
+    threads_.emplace_back(&BatchProcessor::WorkerLoop, this,
+                          std::ref(*workers_[i]));
+  }
+}
+
+BatchProcessor::~BatchProcessor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  start_condition_.notify_all();
+
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+void BatchProcessor::WorkerLoop(Worker &worker) {
+  uint64_t seen_generation = 0;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    start_condition_.wait(lock, [this, seen_generation]() {
+      return stopping_ || (generation_ != seen_generation);
+    });
+    if (stopping_) {
+      return;
+    }
+
+    seen_generation = generation_;
+    const Job *job = job_;
+
+    lock.unlock();
+    (*job)(worker);
+    lock.lock();
+
+    if (--busy_workers_ == 0) {
+      done_condition_.notify_one();
+    }
+  }
+}
+
+void BatchProcessor::Dispatch(const Job &job, size_t inputs_count) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (running_) {
+    throw InvalidOperation("BatchProcessor is already running a batch!");
+  }
+
+  // Give each worker a contiguous share of the inputs, only once the batch
+  // in flight, if any, can't be disturbed anymore
+  const size_t workers_count = workers_.size();
+  for (size_t i = 0; i < workers_count; ++i) {
+    Worker &worker = *workers_[i];
+    std::lock_guard<std::mutex> worker_lock(worker.mutex);
+    worker.next = (inputs_count * i) / workers_count;
+    worker.end = (inputs_count * (i + 1)) / workers_count;
+  }
+
+  running_ = true;
+  job_ = &job;
+  busy_workers_ = workers_.size();
+  ++generation_;
+  start_condition_.notify_all();
+
+  done_condition_.wait(lock, [this]() { return busy_workers_ == 0; });
+  job_ = nullptr;
+  running_ = false;
+}
+
+void BatchProcessor::Process(Worker &worker, const BatchInput &input,
+                             size_t index, const Transform &transform,
+                             BatchResult &result) {
+  result.index = index;
+  result.words = nullptr;
+  result.words_count = 0;
+  result.error = nullptr;
+
+  try {
+    if (input.path.empty()) {
+      worker.stream.Load(input.words, input.words_count);
+    } else {
+      worker.stream.LoadFile(input.path);
+    }
+
+    transform(index, worker.stream);
+    worker.stream.EmitWords(worker.output);
+
+    result.words = worker.output.data();
+    result.words_count = worker.output.size();
+  } catch (...) {
+    result.error = std::current_exception();
+  }
+}
+
+void BatchProcessor::Run(const std::vector<BatchInput> &inputs,
+                         const Transform &transform, const Sink &sink) {
+  const size_t workers_count = workers_.size();
+
+  std::mutex error_mutex;
+  std::exception_ptr sink_error;
+  std::atomic<bool> stop(false);
+
+  Job job = [&](Worker &worker) {
+    BatchResult result;
+
+    while (!stop.load(std::memory_order_relaxed)) {
+      size_t index = inputs.size();
+      {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.next < worker.end) {
+          index = worker.next++;
+        }
+      }
+
+      // Steal the back half of the share of the first worker with some left;
+      // shares only ever shrink, so once none is left the batch is done
+      if (index == inputs.size()) {
+        size_t stolen_end = 0;
+        for (size_t i = 1; i < workers_count; ++i) {
+          Worker &victim = *workers_[(worker.index + i) % workers_count];
+          std::lock_guard<std::mutex> victim_lock(victim.mutex);
+          if (victim.next < victim.end) {
+            stolen_end = victim.end;
+            victim.end -= (victim.end - victim.next + 1) / 2;
+            index = victim.end;
+            break;
+          }
+        }
+
+        if (index == inputs.size()) {
+          return;
+        }
+
+        // The share of this worker is empty, so nobody else touches it; it
+        // is only locked after the victim's to never hold both locks
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.next = index + 1;
+        worker.end = stolen_end;
+      }
+
+      Process(worker, inputs[index], index, transform, result);
+
+      try {
+        sink(result);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!sink_error) {
+          sink_error = std::current_exception();
+        }
+        stop.store(true, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  Dispatch(job, inputs.size());
+
+  if (sink_error) {
+    std::rethrow_exception(sink_error);
+  }
+}
+
+void BatchProcessor::RunOrdered(const std::vector<BatchInput> &inputs,
+                                const Transform &transform, const Sink &sink) {
+  // Finished results wait in a ring of slots for the ones before them; the
+  // words of a slot are swapped with the output of the worker which filled
+  // it, so the buffers keep circulating instead of being reallocated
+  struct Slot final {
+    Slot() : words(), result(), ready(false) {}
+
+    std::vector<uint32_t> words;
+    BatchResult result;
+    bool ready;
+  };  // struct Slot
+
+  const size_t slots_count = workers_.size() * kReorderSlotsPerWorker;
+  std::vector<Slot> slots(slots_count);
+
+  std::mutex mutex;
+  std::condition_variable window_condition;
+  size_t next_claimed = 0;
+  size_t next_delivered = 0;
+  bool delivering = false;
+  std::exception_ptr sink_error;
+
+  Job job = [&](Worker &worker) {
+    BatchResult result;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      // Only claim an input whose slot has been freed
+      window_condition.wait(lock, [&]() {
+        return sink_error || (next_claimed == inputs.size()) ||
+               (next_claimed < next_delivered + slots_count);
+      });
+      if (sink_error || (next_claimed == inputs.size())) {
+        return;
+      }
+
+      const size_t index = next_claimed++;
+
+      lock.unlock();
+      Process(worker, inputs[index], index, transform, result);
+      lock.lock();
+
+      Slot &slot = slots[index % slots_count];
+      slot.words.swap(worker.output);
+      slot.result = result;
+      slot.result.words = slot.words.data();
+      slot.ready = true;
+
+      // Whoever finds the next result ready while nobody else is delivering
+      // delivers as many as are ready, with the lock released
+      if (delivering) {
+        continue;
+      }
+
+      delivering = true;
+      while (!sink_error && slots[next_delivered % slots_count].ready) {
+        Slot &next_slot = slots[next_delivered % slots_count];
+
+        lock.unlock();
+        try {
+          sink(next_slot.result);
+        } catch (...) {
+          lock.lock();
+          sink_error = std::current_exception();
+          break;
+        }
+        lock.lock();
+
+        next_slot.ready = false;
+        ++next_delivered;
+        window_condition.notify_all();
+      }
+      delivering = false;
+
+      if (sink_error) {
+        window_condition.notify_all();
+        return;
+      }
+    }
+  };
+
+  Dispatch(job, inputs.size());
+
+  if (sink_error) {
+    std::rethrow_exception(sink_error);
+  }
+}
+
+}  // namespace sut
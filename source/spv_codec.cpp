@@ -0,0 +1,447 @@
+/*
+  MIT License
+
+  Copyright (c) 2017 Alberto Taiuti
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <spv_codec.h>
+#include "spv_grammar_tables.h"
+#include "spv_internal.h"
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <utility>
+
+namespace sut {
+
+namespace {
+
+// Tag at the start of encoded modules, followed by the number of words of the
+// module; the last byte is the version of the encoding
+const uint32_t kEncodedMagicNumber = 0x31435653;  // "SVC1"
+
+// The first word of an instruction is encoded as its opcode followed by its
+// word count on kLengthBits bits; longer instructions store the rest of their
+// word count in a second varint
+const uint32_t kLengthBits = 4;
+const uint32_t kLengthEscape = (1U << kLengthBits) - 1;
+
+void PutVarint(std::vector<uint8_t> &encoded, uint32_t value) {
+  while (value >= 0x80) {
+    encoded.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  encoded.push_back(static_cast<uint8_t>(value));
+}
+
+// Words are stored in little endian order, whatever the host
+void PutRawWord(std::vector<uint8_t> &encoded, uint32_t word) {
+  for (unsigned shift = 0; shift < 32; shift += 8) {
+    encoded.push_back(static_cast<uint8_t>(word >> shift));
+  }
+}
+
+// Map signed deltas to unsigned values, small magnitudes to small values
+uint32_t ZigZag(uint32_t delta) {
+  return (delta << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+}
+
+uint32_t UnZigZag(uint32_t value) { return (value >> 1) ^ (0U - (value & 1)); }
+
+// What an operand word holds, as far as the encoding is concerned
+enum class WordKind { kResultType, kResult, kId, kLiteral, kString };
+
+// Work out the kind of each operand word of an instruction from the grammar,
+// one word at a time, so that the decoder can follow along from the words it
+// has decoded so far
+//
+// The literals of OpSwitch are taken to be one word wide, since the type of
+// the selector isn't known here; words are only ever encoded less compactly
+// when the guess is wrong
+class OperandClassifier final {
+ public:
+  explicit OperandClassifier(uint32_t opcode)
+      : kinds_(0), kind_(grammar::kEnd), position_(0) {
+    const uint32_t opcode_grammar = grammar::GetOpcodeGrammar(opcode);
+    pending_type_ = grammar::HasResultType(opcode_grammar);
+    pending_result_ = grammar::HasResult(opcode_grammar);
+    kinds_ = grammar::GetOperandKinds(opcode_grammar);
+    NextKind();
+  }
+
+  WordKind Peek() const {
+    if (pending_type_) {
+      return WordKind::kResultType;
+    }
+    if (pending_result_) {
+      return WordKind::kResult;
+    }
+
+    switch (kind_) {
+      case grammar::kId:
+      case grammar::kIds:
+        return WordKind::kId;
+      case grammar::kLiteralString:
+        return WordKind::kString;
+      case grammar::kImageOperands:
+        return (position_ == 0) ? WordKind::kLiteral : WordKind::kId;
+      case grammar::kIdLiteralPairs:
+        return ((position_ % 2) == 0) ? WordKind::kId : WordKind::kLiteral;
+      case grammar::kLiteralIdPairs:
+        return ((position_ % 2) == 0) ? WordKind::kLiteral : WordKind::kId;
+      default:
+        return WordKind::kLiteral;
+    }
+  }
+
+  void Consume(uint32_t word) {
+    if (pending_type_) {
+      pending_type_ = false;
+      return;
+    }
+    if (pending_result_) {
+      pending_result_ = false;
+      return;
+    }
+
+    switch (kind_) {
+      case grammar::kId:
+      case grammar::kLiteral:
+        NextKind();
+        break;
+      case grammar::kLiteralString:
+        if (HasNulByte(word)) {
+          NextKind();
+        }
+        break;
+      // The operands of the wrapped opcode follow it
+      case grammar::kSpecConstantOp:
+        kinds_ = grammar::GetOperandKinds(grammar::GetOpcodeGrammar(word));
+        NextKind();
+        break;
+      default:
+        ++position_;
+        break;
+    }
+  }
+
+ private:
+  void NextKind() {
+    kind_ = kinds_ & grammar::kOperandKindMask;
+    kinds_ >>= grammar::kOperandKindBits;
+    position_ = 0;
+  }
+
+  bool pending_type_;
+  bool pending_result_;
+  uint32_t kinds_;
+  uint32_t kind_;
+  // Index of the word within operands which repeat up to the end
+  size_t position_;
+};  // class OperandClassifier
+
+}  // namespace
+
+void EncodeModule(const uint32_t *words, size_t words_count,
+                  std::vector<uint8_t> &encoded) {
+  if (!words || (words_count < kSpvHeaderWordsCount)) {
+    throw InvalidParameter("Invalid parameter in EncodeModule()!");
+  }
+  if (words_count >= std::numeric_limits<uint32_t>::max()) {
+    std::stringstream msg_stream;
+    msg_stream << "Module with " << words_count << " words is too large";
+    throw InvalidStream(msg_stream.str());
+  }
+
+  // Most words take one or two bytes
+  encoded.clear();
+  encoded.reserve(words_count * 2);
+
+  PutRawWord(encoded, kEncodedMagicNumber);
+  PutVarint(encoded, static_cast<uint32_t>(words_count));
+
+  // The header is kept as it is, so that the endianness of the module
+  // round-trips; the instructions of modules of the opposite endianness are
+  // swapped to be walked, and swapped back when decoded
+  PutRawWord(encoded, words[0]);
+  for (size_t i = 1; i < kSpvHeaderWordsCount; ++i) {
+    PutVarint(encoded, words[i]);
+  }
+
+  std::vector<uint32_t> swapped_words;
+  if (words[0] == SwapBytes(spv::MagicNumber)) {
+    swapped_words.resize(words_count);
+    std::transform(words, words + words_count, swapped_words.begin(),
+                   SwapBytes);
+    words = swapped_words.data();
+  }
+
+  uint32_t last_result = 0;
+  ForEachInstruction(
+      words, words_count,
+      [&](spv::Op opcode, size_t inst_words_count, const uint32_t *operands) {
+        const uint32_t length_code = static_cast<uint32_t>(
+            std::min<size_t>(inst_words_count, kLengthEscape));
+        PutVarint(encoded,
+                  (static_cast<uint32_t>(opcode) << kLengthBits) | length_code);
+        if (length_code == kLengthEscape) {
+          PutVarint(encoded,
+                    static_cast<uint32_t>(inst_words_count - kLengthEscape));
+        }
+
+        OperandClassifier classifier(static_cast<uint32_t>(opcode));
+        for (size_t i = 0; (i + 1) < inst_words_count; ++i) {
+          const uint32_t word = operands[i];
+          switch (classifier.Peek()) {
+            case WordKind::kResult:
+              PutVarint(encoded, ZigZag(word - (last_result + 1)));
+              last_result = word;
+              break;
+            case WordKind::kId:
+              PutVarint(encoded, ZigZag(last_result - word));
+              break;
+            case WordKind::kString:
+              PutRawWord(encoded, word);
+              break;
+            default:
+              PutVarint(encoded, word);
+              break;
+          }
+          classifier.Consume(word);
+        }
+
+        return true;
+      });
+}
+
+ModuleDecoder::ModuleDecoder(const void *encoded, size_t bytes_count)
+    : cursor_(static_cast<const uint8_t *>(encoded)),
+      end_(static_cast<const uint8_t *>(encoded) + bytes_count),
+      header_(),
+      words_count_(0),
+      decoded_count_(0),
+      swapped_(false),
+      last_result_(0),
+      instruction_() {
+  if (!encoded) {
+    throw InvalidParameter("Invalid parameter in ctor of ModuleDecoder!");
+  }
+
+  if ((bytes_count < sizeof(uint32_t)) ||
+      (ReadRawWord() != kEncodedMagicNumber)) {
+    throw InvalidStream("Data doesn't hold an encoded module");
+  }
+
+  words_count_ = ReadVarint();
+  if (words_count_ < kSpvHeaderWordsCount) {
+    std::stringstream msg_stream;
+    msg_stream << "Encoded module with " << words_count_
+               << " words is too small";
+    throw InvalidStream(msg_stream.str());
+  }
+
+  header_[0] = ReadRawWord();
+  for (size_t i = 1; i < kSpvHeaderWordsCount; ++i) {
+    header_[i] = ReadVarint();
+  }
+  decoded_count_ = kSpvHeaderWordsCount;
+  swapped_ = (header_[0] == SwapBytes(spv::MagicNumber));
+
+  // Every word takes at least a byte, so that a corrupt count is caught
+  // before anything is allocated for it; offsets are stored as 32 bits words
+  if (((words_count_ - decoded_count_) >
+       static_cast<size_t>(end_ - cursor_)) ||
+      (words_count_ == std::numeric_limits<uint32_t>::max())) {
+    std::stringstream msg_stream;
+    msg_stream << "Encoded module with " << (end_ - cursor_)
+               << " bytes can't hold " << words_count_ << " words";
+    throw InvalidStream(msg_stream.str());
+  }
+}
+
+uint32_t ModuleDecoder::ReadVarint() {
+  if ((cursor_ < end_) && (*cursor_ < 0x80)) {
+    return *cursor_++;
+  }
+
+  uint32_t value = 0;
+  for (unsigned shift = 0; shift < 35; shift += 7) {
+    if (cursor_ == end_) {
+      throw InvalidStream("Encoded module ends in the middle of a word");
+    }
+
+    const uint32_t byte = *cursor_++;
+    if ((shift == 28) && (byte > 0x0F)) {
+      break;
+    }
+    value |= (byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      return value;
+    }
+  }
+
+  throw InvalidStream("Encoded module holds a word wider than 32 bits");
+}
+
+uint32_t ModuleDecoder::ReadRawWord() {
+  if ((end_ - cursor_) < static_cast<ptrdiff_t>(sizeof(uint32_t))) {
+    throw InvalidStream("Encoded module ends in the middle of a word");
+  }
+
+  const uint32_t word = static_cast<uint32_t>(cursor_[0]) |
+                        (static_cast<uint32_t>(cursor_[1]) << 8) |
+                        (static_cast<uint32_t>(cursor_[2]) << 16) |
+                        (static_cast<uint32_t>(cursor_[3]) << 24);
+  cursor_ += sizeof(uint32_t);
+  return word;
+}
+
+uint32_t ModuleDecoder::DecodeFirstWord() {
+  const uint32_t code = ReadVarint();
+  const uint32_t opcode = code >> kLengthBits;
+  size_t inst_words_count = code & kLengthEscape;
+  if (inst_words_count == kLengthEscape) {
+    inst_words_count += ReadVarint();
+  }
+
+  if ((opcode > 0xFFFF) || (inst_words_count == 0) ||
+      (inst_words_count > 0xFFFF) ||
+      (inst_words_count > (words_count_ - decoded_count_))) {
+    ThrowInvalidWordCount(decoded_count_, inst_words_count);
+  }
+
+  return MergeSpvOpCode({static_cast<uint16_t>(inst_words_count),
+                         static_cast<uint16_t>(opcode)});
+}
+
+void ModuleDecoder::DecodeOperands(uint32_t *words) {
+  const OpcodeHeader header = SplitSpvOpCode(words[0]);
+  OperandClassifier classifier(header.opcode);
+
+  for (size_t i = 1; i < header.words_count; ++i) {
+    uint32_t word = 0;
+    switch (classifier.Peek()) {
+      case WordKind::kResult:
+        word = last_result_ + 1 + UnZigZag(ReadVarint());
+        last_result_ = word;
+        break;
+      case WordKind::kId:
+        word = last_result_ - UnZigZag(ReadVarint());
+        break;
+      case WordKind::kString:
+        word = ReadRawWord();
+        break;
+      default:
+        word = ReadVarint();
+        break;
+    }
+    words[i] = word;
+    classifier.Consume(word);
+  }
+
+  decoded_count_ += header.words_count;
+}
+
+void ModuleDecoder::CheckNotStarted() const {
+  if (decoded_count_ != kSpvHeaderWordsCount) {
+    throw InvalidOperation(
+        "Can't decode a whole module once its instructions are being "
+        "decoded!");
+  }
+}
+
+void ModuleDecoder::CheckEnd() const {
+  if (cursor_ != end_) {
+    std::stringstream msg_stream;
+    msg_stream << "Encoded module has " << (end_ - cursor_)
+               << " bytes past its last word";
+    throw InvalidStream(msg_stream.str());
+  }
+}
+
+const uint32_t *ModuleDecoder::NextInstruction(size_t *words_count) {
+  if (decoded_count_ == words_count_) {
+    CheckEnd();
+    *words_count = 0;
+    return nullptr;
+  }
+
+  const uint32_t first_word = DecodeFirstWord();
+  *words_count = SplitSpvOpCode(first_word).words_count;
+  if (instruction_.size() < *words_count) {
+    instruction_.resize(*words_count);
+  }
+  instruction_[0] = first_word;
+  DecodeOperands(instruction_.data());
+
+  return instruction_.data();
+}
+
+void ModuleDecoder::DecodeInto(uint32_t *dst) {
+  CheckNotStarted();
+
+  std::copy(header_.begin(), header_.end(), dst);
+  while (decoded_count_ < words_count_) {
+    uint32_t *words = dst + decoded_count_;
+    words[0] = DecodeFirstWord();
+    DecodeOperands(words);
+  }
+  CheckEnd();
+
+  if (swapped_) {
+    std::transform(dst + kSpvHeaderWordsCount, dst + words_count_,
+                   dst + kSpvHeaderWordsCount, SwapBytes);
+  }
+}
+
+void ModuleDecoder::DecodeInto(OpcodeStream &stream) {
+  CheckNotStarted();
+
+  std::vector<uint32_t> words(words_count_);
+  std::vector<uint32_t> offsets;
+  offsets.reserve(kSpvHeaderWordsCount + (words_count_ / 3));
+
+  // Header words take one entry each; the stream only holds native words, so
+  // the instructions are left as they are decoded and only the header is
+  // swapped
+  for (size_t i = 0; i < kSpvHeaderWordsCount; ++i) {
+    words[i] = swapped_ ? SwapBytes(header_[i]) : header_[i];
+    offsets.push_back(static_cast<uint32_t>(i));
+  }
+
+  while (decoded_count_ < words_count_) {
+    uint32_t *instruction = words.data() + decoded_count_;
+    offsets.push_back(static_cast<uint32_t>(decoded_count_));
+    instruction[0] = DecodeFirstWord();
+    DecodeOperands(instruction);
+  }
+  CheckEnd();
+
+  stream.Load(std::move(words), std::move(offsets));
+}
+
+OpcodeStream DecodeModule(const void *encoded, size_t bytes_count) {
+  OpcodeStream stream;
+  ModuleDecoder(encoded, bytes_count).DecodeInto(stream);
+  return stream;
+}
+
+}  // namespace sut
@@ -0,0 +1,421 @@
+// Generated by tools/generate_grammar_tables.py from spirv.core.grammar.json
+// version 1.1 revision 6; do not edit
+
+#ifndef SPV_GRAMMAR_TABLES_H
+#define SPV_GRAMMAR_TABLES_H
+
+#include <cstdint>
+
+namespace sut {
+namespace grammar {
+
+// Kinds of the operands following the result type and the result
+enum OperandKind : uint32_t {
+  // No more operands holding ids, the rest are literals
+  kEnd = 0,
+  // Single id
+  kId = 1,
+  // Single literal word, enumerant or mask
+  kLiteral = 2,
+  // Nul terminated literal string
+  kLiteralString = 3,
+  // Ids up to the end of the instruction
+  kIds = 4,
+  // Image operands mask followed by ids up to the end
+  kImageOperands = 5,
+  // Pairs of an id and a literal word up to the end
+  kIdLiteralPairs = 6,
+  // Pairs of a literal as wide as the selector and an id up to the end
+  kLiteralIdPairs = 7,
+  // Opcode followed by the operands of that opcode
+  kSpecConstantOp = 8,
+};
+
+constexpr uint32_t kHasResult = 0x1;
+constexpr uint32_t kHasResultType = 0x2;
+constexpr uint32_t kOperandKindBits = 4;
+constexpr uint32_t kOperandKindMask = 0xF;
+constexpr uint32_t kFirstOperandShift = 4;
+
+// Grammar words of the opcodes from 0 to 330
+constexpr uint32_t kCoreOpcodesCount = 331;
+constexpr uint32_t kCoreOpcodes[kCoreOpcodesCount] = {
+    0x00000000,  // OpNop
+    0x00000003,  // OpUndef
+    0x00000000,  // OpSourceContinued
+    0x00001220,  // OpSource
+    0x00000000,  // OpSourceExtension
+    0x00000010,  // OpName
+    0x00000010,  // OpMemberName
+    0x00000001,  // OpString
+    0x00000010,  // OpLine
+    0x00000000,  // unused
+    0x00000000,  // OpExtension
+    0x00000001,  // OpExtInstImport
+    0x00004213,  // OpExtInst
+    0x00000000,  // unused
+    0x00000000,  // OpMemoryModel
+    0x00043120,  // OpEntryPoint
+    0x00000010,  // OpExecutionMode
+    0x00000000,  // OpCapability
+    0x00000000,  // unused
+    0x00000001,  // OpTypeVoid
+    0x00000001,  // OpTypeBool
+    0x00000001,  // OpTypeInt
+    0x00000001,  // OpTypeFloat
+    0x00000011,  // OpTypeVector
+    0x00000011,  // OpTypeMatrix
+    0x00000011,  // OpTypeImage
+    0x00000001,  // OpTypeSampler
+    0x00000041,  // OpTypeSampledImage
+    0x00000041,  // OpTypeArray
+    0x00000041,  // OpTypeRuntimeArray
+    0x00000041,  // OpTypeStruct
+    0x00000001,  // OpTypeOpaque
+    0x00000421,  // OpTypePointer
+    0x00000041,  // OpTypeFunction
+    0x00000001,  // OpTypeEvent
+    0x00000001,  // OpTypeDeviceEvent
+    0x00000001,  // OpTypeReserveId
+    0x00000001,  // OpTypeQueue
+    0x00000001,  // OpTypePipe
+    0x00000010,  // OpTypeForwardPointer
+    0x00000000,  // unused
+    0x00000003,  // OpConstantTrue
+    0x00000003,  // OpConstantFalse
+    0x00000003,  // OpConstant
+    0x00000043,  // OpConstantComposite
+    0x00000003,  // OpConstantSampler
+    0x00000003,  // OpConstantNull
+    0x00000000,  // unused
+    0x00000003,  // OpSpecConstantTrue
+    0x00000003,  // OpSpecConstantFalse
+    0x00000003,  // OpSpecConstant
+    0x00000043,  // OpSpecConstantComposite
+    0x00000083,  // OpSpecConstantOp
+    0x00000000,  // unused
+    0x00000423,  // OpFunction
+    0x00000003,  // OpFunctionParameter
+    0x00000000,  // OpFunctionEnd
+    0x00000043,  // OpFunctionCall
+    0x00000000,  // unused
+    0x00000423,  // OpVariable
+    0x00000043,  // OpImageTexelPointer
+    0x00000013,  // OpLoad
+    0x00000110,  // OpStore
+    0x00000110,  // OpCopyMemory
+    0x00001110,  // OpCopyMemorySized
+    0x00000043,  // OpAccessChain
+    0x00000043,  // OpInBoundsAccessChain
+    0x00000043,  // OpPtrAccessChain
+    0x00000013,  // OpArrayLength
+    0x00000043,  // OpGenericPtrMemSemantics
+    0x00000043,  // OpInBoundsPtrAccessChain
+    0x00000010,  // OpDecorate
+    0x00000010,  // OpMemberDecorate
+    0x00000001,  // OpDecorationGroup
+    0x00000040,  // OpGroupDecorate
+    0x00000610,  // OpGroupMemberDecorate
+    0x00000000,  // unused
+    0x00000043,  // OpVectorExtractDynamic
+    0x00000043,  // OpVectorInsertDynamic
+    0x00000113,  // OpVectorShuffle
+    0x00000043,  // OpCompositeConstruct
+    0x00000013,  // OpCompositeExtract
+    0x00000113,  // OpCompositeInsert
+    0x00000043,  // OpCopyObject
+    0x00000043,  // OpTranspose
+    0x00000000,  // unused
+    0x00000043,  // OpSampledImage
+    0x00005113,  // OpImageSampleImplicitLod
+    0x00005113,  // OpImageSampleExplicitLod
+    0x00051113,  // OpImageSampleDrefImplicitLod
+    0x00051113,  // OpImageSampleDrefExplicitLod
+    0x00005113,  // OpImageSampleProjImplicitLod
+    0x00005113,  // OpImageSampleProjExplicitLod
+    0x00051113,  // OpImageSampleProjDrefImplicitLod
+    0x00051113,  // OpImageSampleProjDrefExplicitLod
+    0x00005113,  // OpImageFetch
+    0x00051113,  // OpImageGather
+    0x00051113,  // OpImageDrefGather
+    0x00005113,  // OpImageRead
+    0x00051110,  // OpImageWrite
+    0x00000043,  // OpImage
+    0x00000043,  // OpImageQueryFormat
+    0x00000043,  // OpImageQueryOrder
+    0x00000043,  // OpImageQuerySizeLod
+    0x00000043,  // OpImageQuerySize
+    0x00000043,  // OpImageQueryLod
+    0x00000043,  // OpImageQueryLevels
+    0x00000043,  // OpImageQuerySamples
+    0x00000000,  // unused
+    0x00000043,  // OpConvertFToU
+    0x00000043,  // OpConvertFToS
+    0x00000043,  // OpConvertSToF
+    0x00000043,  // OpConvertUToF
+    0x00000043,  // OpUConvert
+    0x00000043,  // OpSConvert
+    0x00000043,  // OpFConvert
+    0x00000043,  // OpQuantizeToF16
+    0x00000043,  // OpConvertPtrToU
+    0x00000043,  // OpSatConvertSToU
+    0x00000043,  // OpSatConvertUToS
+    0x00000043,  // OpConvertUToPtr
+    0x00000043,  // OpPtrCastToGeneric
+    0x00000043,  // OpGenericCastToPtr
+    0x00000013,  // OpGenericCastToPtrExplicit
+    0x00000043,  // OpBitcast
+    0x00000000,  // unused
+    0x00000043,  // OpSNegate
+    0x00000043,  // OpFNegate
+    0x00000043,  // OpIAdd
+    0x00000043,  // OpFAdd
+    0x00000043,  // OpISub
+    0x00000043,  // OpFSub
+    0x00000043,  // OpIMul
+    0x00000043,  // OpFMul
+    0x00000043,  // OpUDiv
+    0x00000043,  // OpSDiv
+    0x00000043,  // OpFDiv
+    0x00000043,  // OpUMod
+    0x00000043,  // OpSRem
+    0x00000043,  // OpSMod
+    0x00000043,  // OpFRem
+    0x00000043,  // OpFMod
+    0x00000043,  // OpVectorTimesScalar
+    0x00000043,  // OpMatrixTimesScalar
+    0x00000043,  // OpVectorTimesMatrix
+    0x00000043,  // OpMatrixTimesVector
+    0x00000043,  // OpMatrixTimesMatrix
+    0x00000043,  // OpOuterProduct
+    0x00000043,  // OpDot
+    0x00000043,  // OpIAddCarry
+    0x00000043,  // OpISubBorrow
+    0x00000043,  // OpUMulExtended
+    0x00000043,  // OpSMulExtended
+    0x00000000,  // unused
+    0x00000043,  // OpAny
+    0x00000043,  // OpAll
+    0x00000043,  // OpIsNan
+    0x00000043,  // OpIsInf
+    0x00000043,  // OpIsFinite
+    0x00000043,  // OpIsNormal
+    0x00000043,  // OpSignBitSet
+    0x00000043,  // OpLessOrGreater
+    0x00000043,  // OpOrdered
+    0x00000043,  // OpUnordered
+    0x00000043,  // OpLogicalEqual
+    0x00000043,  // OpLogicalNotEqual
+    0x00000043,  // OpLogicalOr
+    0x00000043,  // OpLogicalAnd
+    0x00000043,  // OpLogicalNot
+    0x00000043,  // OpSelect
+    0x00000043,  // OpIEqual
+    0x00000043,  // OpINotEqual
+    0x00000043,  // OpUGreaterThan
+    0x00000043,  // OpSGreaterThan
+    0x00000043,  // OpUGreaterThanEqual
+    0x00000043,  // OpSGreaterThanEqual
+    0x00000043,  // OpULessThan
+    0x00000043,  // OpSLessThan
+    0x00000043,  // OpULessThanEqual
+    0x00000043,  // OpSLessThanEqual
+    0x00000043,  // OpFOrdEqual
+    0x00000043,  // OpFUnordEqual
+    0x00000043,  // OpFOrdNotEqual
+    0x00000043,  // OpFUnordNotEqual
+    0x00000043,  // OpFOrdLessThan
+    0x00000043,  // OpFUnordLessThan
+    0x00000043,  // OpFOrdGreaterThan
+    0x00000043,  // OpFUnordGreaterThan
+    0x00000043,  // OpFOrdLessThanEqual
+    0x00000043,  // OpFUnordLessThanEqual
+    0x00000043,  // OpFOrdGreaterThanEqual
+    0x00000043,  // OpFUnordGreaterThanEqual
+    0x00000000,  // unused
+    0x00000000,  // unused
+    0x00000043,  // OpShiftRightLogical
+    0x00000043,  // OpShiftRightArithmetic
+    0x00000043,  // OpShiftLeftLogical
+    0x00000043,  // OpBitwiseOr
+    0x00000043,  // OpBitwiseXor
+    0x00000043,  // OpBitwiseAnd
+    0x00000043,  // OpNot
+    0x00000043,  // OpBitFieldInsert
+    0x00000043,  // OpBitFieldSExtract
+    0x00000043,  // OpBitFieldUExtract
+    0x00000043,  // OpBitReverse
+    0x00000043,  // OpBitCount
+    0x00000000,  // unused
+    0x00000043,  // OpDPdx
+    0x00000043,  // OpDPdy
+    0x00000043,  // OpFwidth
+    0x00000043,  // OpDPdxFine
+    0x00000043,  // OpDPdyFine
+    0x00000043,  // OpFwidthFine
+    0x00000043,  // OpDPdxCoarse
+    0x00000043,  // OpDPdyCoarse
+    0x00000043,  // OpFwidthCoarse
+    0x00000000,  // unused
+    0x00000000,  // unused
+    0x00000000,  // OpEmitVertex
+    0x00000000,  // OpEndPrimitive
+    0x00000040,  // OpEmitStreamVertex
+    0x00000040,  // OpEndStreamPrimitive
+    0x00000000,  // unused
+    0x00000000,  // unused
+    0x00000040,  // OpControlBarrier
+    0x00000040,  // OpMemoryBarrier
+    0x00000000,  // unused
+    0x00000043,  // OpAtomicLoad
+    0x00000040,  // OpAtomicStore
+    0x00000043,  // OpAtomicExchange
+    0x00000043,  // OpAtomicCompareExchange
+    0x00000043,  // OpAtomicCompareExchangeWeak
+    0x00000043,  // OpAtomicIIncrement
+    0x00000043,  // OpAtomicIDecrement
+    0x00000043,  // OpAtomicIAdd
+    0x00000043,  // OpAtomicISub
+    0x00000043,  // OpAtomicSMin
+    0x00000043,  // OpAtomicUMin
+    0x00000043,  // OpAtomicSMax
+    0x00000043,  // OpAtomicUMax
+    0x00000043,  // OpAtomicAnd
+    0x00000043,  // OpAtomicOr
+    0x00000043,  // OpAtomicXor
+    0x00000000,  // unused
+    0x00000000,  // unused
+    0x00000043,  // OpPhi
+    0x00000110,  // OpLoopMerge
+    0x00000010,  // OpSelectionMerge
+    0x00000001,  // OpLabel
+    0x00000040,  // OpBranch
+    0x00001110,  // OpBranchConditional
+    0x00007110,  // OpSwitch
+    0x00000000,  // OpKill
+    0x00000000,  // OpReturn
+    0x00000040,  // OpReturnValue
+    0x00000000,  // OpUnreachable
+    0x00000010,  // OpLifetimeStart
+    0x00000010,  // OpLifetimeStop
+    0x00000000,  // unused
+    0x00000043,  // OpGroupAsyncCopy
+    0x00000040,  // OpGroupWaitEvents
+    0x00000043,  // OpGroupAll
+    0x00000043,  // OpGroupAny
+    0x00000043,  // OpGroupBroadcast
+    0x00004213,  // OpGroupIAdd
+    0x00004213,  // OpGroupFAdd
+    0x00004213,  // OpGroupFMin
+    0x00004213,  // OpGroupUMin
+    0x00004213,  // OpGroupSMin
+    0x00004213,  // OpGroupFMax
+    0x00004213,  // OpGroupUMax
+    0x00004213,  // OpGroupSMax
+    0x00000000,  // unused
+    0x00000000,  // unused
+    0x00000043,  // OpReadPipe
+    0x00000043,  // OpWritePipe
+    0x00000043,  // OpReservedReadPipe
+    0x00000043,  // OpReservedWritePipe
+    0x00000043,  // OpReserveReadPipePackets
+    0x00000043,  // OpReserveWritePipePackets
+    0x00000040,  // OpCommitReadPipe
+    0x00000040,  // OpCommitWritePipe
+    0x00000043,  // OpIsValidReserveId
+    0x00000043,  // OpGetNumPipePackets
+    0x00000043,  // OpGetMaxPipePackets
+    0x00000043,  // OpGroupReserveReadPipePackets
+    0x00000043,  // OpGroupReserveWritePipePackets
+    0x00000040,  // OpGroupCommitReadPipe
+    0x00000040,  // OpGroupCommitWritePipe
+    0x00000000,  // unused
+    0x00000000,  // unused
+    0x00000043,  // OpEnqueueMarker
+    0x00000043,  // OpEnqueueKernel
+    0x00000043,  // OpGetKernelNDrangeSubGroupCount
+    0x00000043,  // OpGetKernelNDrangeMaxSubGroupSize
+    0x00000043,  // OpGetKernelWorkGroupSize
+    0x00000043,  // OpGetKernelPreferredWorkGroupSizeMultiple
+    0x00000040,  // OpRetainEvent
+    0x00000040,  // OpReleaseEvent
+    0x00000003,  // OpCreateUserEvent
+    0x00000043,  // OpIsValidEvent
+    0x00000040,  // OpSetUserEventStatus
+    0x00000040,  // OpCaptureEventProfilingInfo
+    0x00000003,  // OpGetDefaultQueue
+    0x00000043,  // OpBuildNDRange
+    0x00005113,  // OpImageSparseSampleImplicitLod
+    0x00005113,  // OpImageSparseSampleExplicitLod
+    0x00051113,  // OpImageSparseSampleDrefImplicitLod
+    0x00051113,  // OpImageSparseSampleDrefExplicitLod
+    0x00005113,  // OpImageSparseSampleProjImplicitLod
+    0x00005113,  // OpImageSparseSampleProjExplicitLod
+    0x00051113,  // OpImageSparseSampleProjDrefImplicitLod
+    0x00051113,  // OpImageSparseSampleProjDrefExplicitLod
+    0x00005113,  // OpImageSparseFetch
+    0x00051113,  // OpImageSparseGather
+    0x00051113,  // OpImageSparseDrefGather
+    0x00000043,  // OpImageSparseTexelsResident
+    0x00000000,  // OpNoLine
+    0x00000043,  // OpAtomicFlagTestAndSet
+    0x00000040,  // OpAtomicFlagClear
+    0x00005113,  // OpImageSparseRead
+    0x00000043,  // OpSizeOf
+    0x00000001,  // OpTypePipeStorage
+    0x00000003,  // OpConstantPipeStorage
+    0x00000043,  // OpCreatePipeFromPipeStorage
+    0x00000043,  // OpGetKernelLocalSizeForSubgroupCount
+    0x00000043,  // OpGetKernelMaxNumSubgroups
+    0x00000001,  // OpTypeNamedBarrier
+    0x00000043,  // OpNamedBarrierInitialize
+    0x00000040,  // OpMemoryNamedBarrier
+    0x00000000,  // OpModuleProcessed
+};
+
+// Grammar words of the opcodes of the extensions, sorted by opcode
+struct ExtensionOpcode {
+  uint32_t opcode;
+  uint32_t grammar;
+};
+constexpr uint32_t kExtensionOpcodesCount = 6;
+constexpr ExtensionOpcode kExtensionOpcodes[kExtensionOpcodesCount] = {
+    {4421, 0x00000043},  // OpSubgroupBallotKHR
+    {4422, 0x00000043},  // OpSubgroupFirstInvocationKHR
+    {4428, 0x00000043},  // OpSubgroupAllKHR
+    {4429, 0x00000043},  // OpSubgroupAnyKHR
+    {4430, 0x00000043},  // OpSubgroupAllEqualKHR
+    {4432, 0x00000043},  // OpSubgroupReadInvocationKHR
+};
+
+constexpr uint32_t FindExtensionOpcode(uint32_t opcode, uint32_t index) {
+  return (index >= kExtensionOpcodesCount)
+             ? 0
+             : (kExtensionOpcodes[index].opcode == opcode)
+                   ? kExtensionOpcodes[index].grammar
+                   : FindExtensionOpcode(opcode, index + 1);
+}
+
+// Grammar word of an opcode; unknown opcodes have neither results nor ids
+constexpr uint32_t GetOpcodeGrammar(uint32_t opcode) {
+  return (opcode < kCoreOpcodesCount) ? kCoreOpcodes[opcode]
+                                      : FindExtensionOpcode(opcode, 0);
+}
+
+constexpr bool HasResult(uint32_t grammar) {
+  return (grammar & kHasResult) != 0;
+}
+
+constexpr bool HasResultType(uint32_t grammar) {
+  return (grammar & kHasResultType) != 0;
+}
+
+// Kinds of the operands, the first one in the lowest bits
+constexpr uint32_t GetOperandKinds(uint32_t grammar) {
+  return grammar >> kFirstOperandShift;
+}
+
+}  // namespace grammar
+}  // namespace sut
+
+#endif
@@ -0,0 +1,56 @@
+/*
+  MIT License
+
+  Copyright (c) 2017 Alberto Taiuti
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Helpers shared by the sources of the library, not part of its interface
+
+#ifndef SPV_INTERNAL_H_R8XK3M5P
+#define SPV_INTERNAL_H_R8XK3M5P
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sut {
+
+// Indices of the words of the header of a module
+const size_t kSpvIndexMagicNumber = 0;
+const size_t kSpvIndexVersionNumber = 1;
+const size_t kSpvIndexGeneratorNumber = 2;
+const size_t kSpvIndexBound = 3;
+const size_t kSpvIndexSchema = 4;
+const size_t kSpvIndexInstruction = 5;
+
+inline uint32_t SwapBytes(uint32_t word) {
+  return ((word & 0x000000FFU) << 24U) | ((word & 0x0000FF00U) << 8U) |
+         ((word & 0x00FF0000U) >> 8U) | ((word & 0xFF000000U) >> 24U);
+}
+
+// Whether a word of a literal string holds its nul terminator
+inline bool HasNulByte(uint32_t word) {
+  return ((word & 0x000000FFU) == 0) || ((word & 0x0000FF00U) == 0) ||
+         ((word & 0x00FF0000U) == 0) || ((word & 0xFF000000U) == 0);
+}
+
+}  // namespace sut
+
+#endif
@@ -23,19 +23,57 @@
 */
 
 #include <spv_utils.h>
+#include "spv_grammar_tables.h"
+#include "spv_internal.h"
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <limits>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// Byte swapping uses the widest vector instructions enabled for the target,
+// with a scalar loop for the remaining words
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SUT_SWAP_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define SUT_SWAP_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SUT_SWAP_NEON
+#endif
 
 namespace sut {
 
-static const size_t kSpvIndexMagicNumber = 0;
-static const size_t kSpvIndexVersionNumber = 1;
-static const size_t kSpvIndexGeneratorNumber = 2;
-static const size_t kSpvIndexBound = 3;
-static const size_t kSpvIndexSchema = 4;
-static const size_t kSpvIndexInstruction = 5;
-static const size_t kPendingOpsInitialReserve = 5;
-static const uint32_t kMarker = 0xFFFFFFFF;
+static const size_t kAverageInstructionWordCount = 3;
+// Number of opcodes of the core grammar, used to size the per-opcode index
+static const size_t kOpcodeIndexInitialBuckets = 512;
+static const uint32_t kNoPatch = 0xFFFFFFFF;
+static const uint32_t kNoDefinition = 0xFFFFFFFF;
+// Header of the terminator, an OpNop with a word count of zero
+static const uint32_t kTerminatorWord = 0U;
+
+thread_local OpcodeStream::PassWorker OpcodeStream::pass_worker_ = {
+    nullptr, nullptr, 0, 0};
 
 OpcodeHeader SplitSpvOpCode(uint32_t word) {
   return {static_cast<uint16_t>((0xFFFF0000 & word) >> 16U),
@@ -56,30 +94,777 @@ InvalidStream::InvalidStream(const std::string &what_arg)
 InvalidOperation::InvalidOperation(const std::string &what_arg)
     : std::logic_error(what_arg) {}
 
+FileError::FileError(const std::string &what_arg)
+    : std::runtime_error(what_arg) {}
+
+const size_t InstructionBuilder::kInlineWordsCount;
+
+InstructionBuilder &InstructionBuilder::AddString(const char *str) {
+  assert(str);
+
+  // Characters fill the words from their lowest byte; the nul terminator
+  // and the padding are the zero bytes of the last word
+  const size_t chars_count = std::strlen(str) + 1;
+  for (size_t c = 0; c < chars_count; c += 4) {
+    uint32_t word = 0;
+    for (size_t b = 0; (b < 4) && ((c + b) < chars_count); ++b) {
+      word |= static_cast<uint32_t>(static_cast<unsigned char>(str[c + b]))
+              << (8 * b);
+    }
+    PushWord(word);
+  }
+
+  return *this;
+}
+
+void InstructionBuilder::Spill(uint32_t word) {
+  if (words_count_ >= std::numeric_limits<uint16_t>::max()) {
+    throw InvalidOperation("Instruction built with too many words!");
+  }
+
+  if (spilled_words_.empty()) {
+    spilled_words_.reserve(2 * kInlineWordsCount);
+    spilled_words_.assign(inline_words_.begin(),
+                          inline_words_.begin() + words_count_);
+  }
+  spilled_words_.push_back(word);
+}
+
+namespace {
+
+// Byte swap count words from src into dst, which can be the same
+void SwapWords(const uint32_t *src, uint32_t *dst, size_t count) {
+  size_t i = 0;
+
+#if defined(SUT_SWAP_AVX2)
+  const __m256i shuffle =
+      _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                       3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  for (; (i + 8) <= count; i += 8) {
+    __m256i words =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                        _mm256_shuffle_epi8(words, shuffle));
+  }
+#elif defined(SUT_SWAP_SSE2)
+  for (; (i + 4) <= count; i += 4) {
+    __m128i words = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    // Swap the bytes of each half word, then the half words of each word
+    words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+    words = _mm_shufflelo_epi16(words, _MM_SHUFFLE(2, 3, 0, 1));
+    words = _mm_shufflehi_epi16(words, _MM_SHUFFLE(2, 3, 0, 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), words);
+  }
+#elif defined(SUT_SWAP_NEON)
+  for (; (i + 4) <= count; i += 4) {
+    uint8x16_t words = vld1q_u8(reinterpret_cast<const uint8_t *>(src + i));
+    vst1q_u8(reinterpret_cast<uint8_t *>(dst + i), vrev32q_u8(words));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    dst[i] = SwapBytes(src[i]);
+  }
+}
+
+}  // namespace
+
+void ThrowInvalidWordCount(size_t word_index, size_t words_count) {
+  std::stringstream msg_stream;
+  msg_stream << "Word with index " << word_index << " has word count of "
+             << words_count;
+  throw InvalidStream(msg_stream.str());
+}
+
+namespace {
+
+enum OpenMode { kOpenRead, kOpenWrite };
+
+#ifdef _WIN32
+// Size of the buffer used to coalesce small runs of words before writing
+// them to a file
+static const size_t kWriteBufferWords = 16384;
+#else
+// Number of segments written with a single writev(); within the IOV_MAX
+// guaranteed by POSIX platforms in practice
+static const size_t kWriteBatchSegments = 1024;
+#endif
+
+[[noreturn]] void ThrowFileError(const char *what, const std::string &path) {
+  std::stringstream msg_stream;
+  msg_stream << what << " file " << path << ": " << std::strerror(errno);
+  throw FileError(msg_stream.str());
+}
+
+int OpenFile(const std::string &path, OpenMode mode) {
+#ifdef _WIN32
+  int fd = (mode == kOpenRead)
+               ? _open(path.c_str(), _O_RDONLY | _O_BINARY)
+               : _open(path.c_str(),
+                       _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+                       _S_IREAD | _S_IWRITE);
+#else
+  int fd = (mode == kOpenRead)
+               ? open(path.c_str(), O_RDONLY)
+               : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+
+  if (fd < 0) {
+    ThrowFileError("Could not open", path);
+  }
+
+  return fd;
+}
+
+int CloseFile(int fd) {
+#ifdef _WIN32
+  return _close(fd);
+#else
+  return close(fd);
+#endif
+}
+
+// Read the whole file into words, reusing their memory
+void ReadFile(int fd, const std::string &path, std::vector<uint32_t> &words) {
+#ifdef _WIN32
+  long size = _lseek(fd, 0, SEEK_END);
+  if ((size < 0) || (_lseek(fd, 0, SEEK_SET) < 0)) {
+    ThrowFileError("Could not read", path);
+  }
+  const size_t binary_size = static_cast<size_t>(size);
+#else
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    ThrowFileError("Could not read", path);
+  }
+  const size_t binary_size = static_cast<size_t>(file_stat.st_size);
+#endif
+
+  if (((binary_size % 4) != 0) || ((binary_size / 4) < kSpvIndexInstruction)) {
+    throw InvalidStream("File " + path + " does not contain a valid module");
+  }
+
+  words.resize(binary_size / 4);
+  char *bytes = reinterpret_cast<char *>(words.data());
+  size_t read_bytes = 0;
+  while (read_bytes < binary_size) {
+#ifdef _WIN32
+    int result = _read(fd, bytes + read_bytes,
+                       static_cast<unsigned int>(binary_size - read_bytes));
+#else
+    ssize_t result = read(fd, bytes + read_bytes, binary_size - read_bytes);
+#endif
+    if (result <= 0) {
+      ThrowFileError("Could not read", path);
+    }
+    read_bytes += static_cast<size_t>(result);
+  }
+}
+
+// Map the whole file in memory; the mapping is released once the last
+// reference to it is gone
+//
+// Platforms without mmap read the file into a heap buffer instead
+std::shared_ptr<const void> MapFile(int fd, const std::string &path,
+                                    size_t *binary_size) {
+#ifdef _WIN32
+  std::shared_ptr<std::vector<uint32_t>> buffer =
+      std::make_shared<std::vector<uint32_t>>();
+  ReadFile(fd, path, *buffer);
+
+  *binary_size = buffer->size() * 4;
+  return std::shared_ptr<const void>(buffer, buffer->data());
+#else
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    ThrowFileError("Could not read", path);
+  }
+
+  *binary_size = static_cast<size_t>(file_stat.st_size);
+  if (*binary_size == 0) {
+    throw InvalidStream("File " + path + " does not contain a valid module");
+  }
+
+  void *address = mmap(nullptr, *binary_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (address == MAP_FAILED) {
+    ThrowFileError("Could not map", path);
+  }
+
+  // The module is read front to back
+  madvise(address, *binary_size, MADV_SEQUENTIAL);
+
+  size_t mapped_size = *binary_size;
+  return std::shared_ptr<const void>(
+      address, [mapped_size](const void *mapped_address) {
+        munmap(const_cast<void *>(mapped_address), mapped_size);
+      });
+#endif
+}
+
+#ifdef _WIN32
+// Write words to a file descriptor; small runs of words are coalesced in a
+// buffer, while large ones are written straight from where they are
+class FileWriter final {
+ public:
+  explicit FileWriter(int fd) : fd_(fd), buffer_(), buffered_count_(0) {}
+
+  void Write(const uint32_t *words, size_t count) {
+    if ((buffered_count_ + count) <= kWriteBufferWords) {
+      std::memcpy(buffer_.data() + buffered_count_, words,
+                  count * sizeof(uint32_t));
+      buffered_count_ += count;
+      return;
+    }
+
+    Flush();
+    if (count < kWriteBufferWords) {
+      Write(words, count);
+    } else {
+      WriteAll(words, count * sizeof(uint32_t));
+    }
+  }
+
+  void Flush() {
+    WriteAll(buffer_.data(), buffered_count_ * sizeof(uint32_t));
+    buffered_count_ = 0;
+  }
+
+ private:
+  void WriteAll(const void *data, size_t bytes_count) {
+    const char *bytes = static_cast<const char *>(data);
+    while (bytes_count > 0) {
+      int result = _write(fd_, bytes, static_cast<unsigned int>(std::min(
+                                          bytes_count, size_t(1U << 30U))));
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        ThrowFileError("Could not write", "descriptor");
+      }
+
+      bytes += result;
+      bytes_count -= static_cast<size_t>(result);
+    }
+  }
+
+  int fd_;
+  std::array<uint32_t, kWriteBufferWords> buffer_;
+  size_t buffered_count_;
+};  // class FileWriter
+#else
+// Write words to a file descriptor straight from where they are, gathering
+// the runs of words in batches which are written with a single writev()
+class FileWriter final {
+ public:
+  explicit FileWriter(int fd) : fd_(fd), batch_(), batch_count_(0) {}
+
+  void Write(const uint32_t *words, size_t count) {
+    if (batch_count_ == batch_.size()) {
+      Flush();
+    }
+
+    batch_[batch_count_].iov_base = const_cast<uint32_t *>(words);
+    batch_[batch_count_].iov_len = count * sizeof(uint32_t);
+    ++batch_count_;
+  }
+
+  void Flush() {
+    struct iovec *segment = batch_.data();
+    size_t remaining_count = batch_count_;
+
+    while (remaining_count > 0) {
+      ssize_t result =
+          writev(fd_, segment, static_cast<int>(remaining_count));
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        ThrowFileError("Could not write", "descriptor");
+      }
+
+      // Skip what has been written, which may end in the middle of a segment
+      size_t written = static_cast<size_t>(result);
+      while ((remaining_count > 0) && (written >= segment->iov_len)) {
+        written -= segment->iov_len;
+        ++segment;
+        --remaining_count;
+      }
+      if (remaining_count > 0) {
+        segment->iov_base = static_cast<char *>(segment->iov_base) + written;
+        segment->iov_len -= written;
+      }
+    }
+
+    batch_count_ = 0;
+  }
+
+ private:
+  int fd_;
+  std::array<struct iovec, kWriteBatchSegments> batch_;
+  size_t batch_count_;
+};  // class FileWriter
+#endif
+
+// Whether instructions of an opcode define a result id and have a result type
+// id
+void GetResultOperands(spv::Op opcode, bool *has_result, bool *has_type) {
+  const uint32_t opcode_grammar =
+      grammar::GetOpcodeGrammar(static_cast<uint32_t>(opcode));
+  *has_result = grammar::HasResult(opcode_grammar);
+  *has_type = grammar::HasResultType(opcode_grammar);
+}
+
+// Number of words of a literal string starting at words, nul terminator
+// included; the string is cut at max_words_count
+size_t GetLiteralStringWordsCount(const uint32_t *words,
+                                  size_t max_words_count) {
+  for (size_t i = 0; i < max_words_count; ++i) {
+    if (HasNulByte(words[i])) {
+      return i + 1;
+    }
+  }
+
+  return max_words_count;
+}
+
+// Whether the literal string held by words is str, or starts with it when
+// prefix_only is set
+bool MatchLiteralString(const uint32_t *words, size_t words_count,
+                        const char *str, bool prefix_only) {
+  const size_t bytes_count = words_count * sizeof(uint32_t);
+  for (size_t i = 0; i < bytes_count; ++i) {
+    const char c = static_cast<char>((words[i / 4] >> (8 * (i % 4))) & 0xFF);
+    if (str[i] == '\0') {
+      return prefix_only || (c == '\0');
+    }
+    if (c != str[i]) {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+// Whether the operands of an extended instruction, past its instruction
+// number, are all ids; this is only known for GLSL.std.450 and for the
+// non-semantic sets, whose operands must all be ids, while other sets such as
+// OpenCL.DebugInfo.100 mix ids and literals
+bool HasIdOperandsOnly(const uint32_t *words, size_t words_count,
+                       const OpcodeStream &stream) {
+  if (words_count < 4) {
+    return true;
+  }
+
+  const uint32_t *set_words = stream.GetDefinitionWords(words[3]);
+  if (!set_words || (SplitSpvOpCode(set_words[0]).opcode !=
+                     static_cast<uint16_t>(spv::Op::OpExtInstImport))) {
+    return false;
+  }
+
+  const size_t set_words_count = SplitSpvOpCode(set_words[0]).words_count;
+  if (set_words_count < 3) {
+    return false;
+  }
+  return MatchLiteralString(set_words + 2, set_words_count - 2,
+                            "GLSL.std.450", false) ||
+         MatchLiteralString(set_words + 2, set_words_count - 2,
+                            "NonSemantic.", true);
+}
+
+// Call visitor(word_index) for each word of an instruction holding an id
+// operand, the result type included and the result excluded, following the
+// operand kinds of the grammar tables
+//
+// The literals of OpSwitch are as wide as its selector, whose type is looked
+// up in the stream. Only the set of the extended instructions whose operands
+// aren't all ids is visited, the operands being left alone
+template <typename Visitor>
+void ForEachIdOperand(const uint32_t *words, size_t words_count,
+                      const OpcodeStream &stream, Visitor &&visitor) {
+  const uint16_t opcode = SplitSpvOpCode(words[0]).opcode;
+  const uint32_t opcode_grammar = grammar::GetOpcodeGrammar(opcode);
+  const bool has_type = grammar::HasResultType(opcode_grammar);
+
+  if (has_type && (words_count > 1)) {
+    visitor(static_cast<size_t>(1));
+  }
+
+  if ((opcode == static_cast<uint16_t>(spv::Op::OpExtInst)) &&
+      !HasIdOperandsOnly(words, words_count, stream)) {
+    if (words_count > 3) {
+      visitor(static_cast<size_t>(3));
+    }
+    return;
+  }
+
+  // Index of the first operand after the result type and the result
+  size_t operand =
+      1 + (has_type ? 1 : 0) + (grammar::HasResult(opcode_grammar) ? 1 : 0);
+
+  uint32_t kinds = grammar::GetOperandKinds(opcode_grammar);
+  while ((kinds != grammar::kEnd) && (operand < words_count)) {
+    const uint32_t kind = kinds & grammar::kOperandKindMask;
+    kinds >>= grammar::kOperandKindBits;
+
+    switch (kind) {
+      case grammar::kId:
+        visitor(operand);
+        ++operand;
+        break;
+
+      case grammar::kLiteral:
+        ++operand;
+        break;
+
+      case grammar::kLiteralString:
+        operand += GetLiteralStringWordsCount(words + operand,
+                                              words_count - operand);
+        break;
+
+      // The image operands mask is followed by ids only
+      case grammar::kImageOperands:
+        ++operand;
+        for (; operand < words_count; ++operand) {
+          visitor(operand);
+        }
+        break;
+
+      case grammar::kIds:
+        for (; operand < words_count; ++operand) {
+          visitor(operand);
+        }
+        break;
+
+      case grammar::kIdLiteralPairs:
+        for (; operand < words_count; operand += 2) {
+          visitor(operand);
+        }
+        break;
+
+      case grammar::kLiteralIdPairs: {
+        size_t literal_words_count = 1;
+        const uint32_t *type_words =
+            stream.GetDefinitionWords(stream.GetResultType(words[1]));
+        if (type_words &&
+            (SplitSpvOpCode(type_words[0]).opcode ==
+             static_cast<uint16_t>(spv::Op::OpTypeInt)) &&
+            (type_words[2] > 32)) {
+          literal_words_count = 2;
+        }
+
+        for (operand += literal_words_count; operand < words_count;
+             operand += literal_words_count + 1) {
+          visitor(operand);
+        }
+        break;
+      }
+
+      // The operands of the wrapped opcode follow it
+      case grammar::kSpecConstantOp:
+        kinds = grammar::GetOperandKinds(
+            grammar::GetOpcodeGrammar(words[operand]));
+        ++operand;
+        break;
+
+      default:
+        assert(false);
+        return;
+    }
+  }
+}
+
+// Earliest section of the logical layout an opcode can appear in; opcodes
+// which can appear anywhere map to the first section
+ModuleSection GetOpcodeSection(spv::Op opcode) {
+  switch (opcode) {
+    case spv::Op::OpNop:
+    case spv::Op::OpLine:
+    case spv::Op::OpNoLine:
+    case spv::Op::OpCapability:
+      return ModuleSection::kCapabilities;
+    case spv::Op::OpExtension:
+      return ModuleSection::kExtensions;
+    case spv::Op::OpExtInstImport:
+      return ModuleSection::kExtInstImports;
+    case spv::Op::OpMemoryModel:
+      return ModuleSection::kMemoryModel;
+    case spv::Op::OpEntryPoint:
+      return ModuleSection::kEntryPoints;
+    case spv::Op::OpExecutionMode:
+      return ModuleSection::kExecutionModes;
+    case spv::Op::OpString:
+    case spv::Op::OpSourceExtension:
+    case spv::Op::OpSource:
+    case spv::Op::OpSourceContinued:
+    case spv::Op::OpName:
+    case spv::Op::OpMemberName:
+    case spv::Op::OpModuleProcessed:
+      return ModuleSection::kDebug;
+    case spv::Op::OpDecorate:
+    case spv::Op::OpMemberDecorate:
+    case spv::Op::OpDecorationGroup:
+    case spv::Op::OpGroupDecorate:
+    case spv::Op::OpGroupMemberDecorate:
+      return ModuleSection::kAnnotations;
+    case spv::Op::OpTypeVoid:
+    case spv::Op::OpTypeBool:
+    case spv::Op::OpTypeInt:
+    case spv::Op::OpTypeFloat:
+    case spv::Op::OpTypeVector:
+    case spv::Op::OpTypeMatrix:
+    case spv::Op::OpTypeImage:
+    case spv::Op::OpTypeSampler:
+    case spv::Op::OpTypeSampledImage:
+    case spv::Op::OpTypeArray:
+    case spv::Op::OpTypeRuntimeArray:
+    case spv::Op::OpTypeStruct:
+    case spv::Op::OpTypeOpaque:
+    case spv::Op::OpTypePointer:
+    case spv::Op::OpTypeFunction:
+    case spv::Op::OpTypeEvent:
+    case spv::Op::OpTypeDeviceEvent:
+    case spv::Op::OpTypeReserveId:
+    case spv::Op::OpTypeQueue:
+    case spv::Op::OpTypePipe:
+    case spv::Op::OpTypeForwardPointer:
+    case spv::Op::OpTypePipeStorage:
+    case spv::Op::OpTypeNamedBarrier:
+    case spv::Op::OpConstantTrue:
+    case spv::Op::OpConstantFalse:
+    case spv::Op::OpConstant:
+    case spv::Op::OpConstantComposite:
+    case spv::Op::OpConstantSampler:
+    case spv::Op::OpConstantNull:
+    case spv::Op::OpConstantPipeStorage:
+    case spv::Op::OpSpecConstantTrue:
+    case spv::Op::OpSpecConstantFalse:
+    case spv::Op::OpSpecConstant:
+    case spv::Op::OpSpecConstantComposite:
+    case spv::Op::OpSpecConstantOp:
+    case spv::Op::OpVariable:
+    case spv::Op::OpUndef:
+      return ModuleSection::kTypes;
+    default:
+      return ModuleSection::kFunctions;
+  }
+}
+
+// Whether an opcode is a debug instruction, line information included
+bool IsDebugOpcode(spv::Op opcode) {
+  return (GetOpcodeSection(opcode) == ModuleSection::kDebug) ||
+         (opcode == spv::Op::OpLine) || (opcode == spv::Op::OpNoLine);
+}
+
+// Sort the instructions of a run in place, by the id they target and then
+// by their words; offsets holds the offset of each instruction of the run,
+// the first one included, and is updated to match
+void SortTargetingInstructions(uint32_t *words, uint32_t *offsets,
+                               size_t instructions_count,
+                               std::vector<uint32_t> &scratch) {
+  if (instructions_count < 2) {
+    return;
+  }
+
+  const uint32_t first_offset = offsets[0];
+  std::sort(offsets, offsets + instructions_count,
+            [words](uint32_t a_offset, uint32_t b_offset) {
+              const uint32_t *a = words + a_offset;
+              const uint32_t *b = words + b_offset;
+              if (a[1] != b[1]) {
+                return a[1] < b[1];
+              }
+              return std::lexicographical_compare(
+                  a, a + SplitSpvOpCode(a[0]).words_count, b,
+                  b + SplitSpvOpCode(b[0]).words_count);
+            });
+
+  scratch.clear();
+  for (size_t i = 0; i < instructions_count; ++i) {
+    const uint32_t *instruction = words + offsets[i];
+    offsets[i] = first_offset + static_cast<uint32_t>(scratch.size());
+    scratch.insert(scratch.end(), instruction,
+                   instruction + SplitSpvOpCode(instruction[0]).words_count);
+  }
+  std::copy(scratch.begin(), scratch.end(), words + first_offset);
+}
+
+uint64_t MixBits(uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xFF51AFD7ED558CCDull;
+  value ^= value >> 33;
+  value *= 0xC4CEB9FE1A85EC53ull;
+  value ^= value >> 33;
+  return value;
+}
+
+uint64_t RotateLeft(uint64_t value, unsigned bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// Streaming 128 bits hash of words
+//
+// Blocks of words are accumulated into independent lanes, by a loop without
+// dependencies between lanes which compilers turn into vector instructions,
+// and the lanes are scrambled every few blocks. Words are buffered up to a
+// whole block, so the hash only depends on the sequence of words and not on
+// how it is split between calls to Update()
+class WordsHasher final {
+ public:
+  WordsHasher()
+      : buffered_count_(0), words_count_(0), block_index_(0) {
+    for (size_t lane = 0; lane < kLanesCount; ++lane) {
+      accumulators_[lane] = kLaneKeys[lane];
+    }
+  }
+
+  void Update(const uint32_t *words, size_t count) {
+    words_count_ += count;
+
+    if (buffered_count_ > 0) {
+      const size_t copied_count =
+          std::min(count, kBlockWordsCount - buffered_count_);
+      std::memcpy(buffer_ + buffered_count_, words,
+                  copied_count * sizeof(uint32_t));
+      buffered_count_ += copied_count;
+      words += copied_count;
+      count -= copied_count;
+      if (buffered_count_ < kBlockWordsCount) {
+        return;
+      }
+      AccumulateBlock(buffer_);
+      buffered_count_ = 0;
+    }
+
+    for (; count >= kBlockWordsCount;
+         words += kBlockWordsCount, count -= kBlockWordsCount) {
+      AccumulateBlock(words);
+    }
+
+    std::memcpy(buffer_, words, count * sizeof(uint32_t));
+    buffered_count_ = count;
+  }
+
+  ModuleFingerprint Finish() {
+    // The last block is padded with zeros, the length tells it apart
+    if (buffered_count_ > 0) {
+      std::memset(buffer_ + buffered_count_, 0,
+                  (kBlockWordsCount - buffered_count_) * sizeof(uint32_t));
+      AccumulateBlock(buffer_);
+      buffered_count_ = 0;
+    }
+
+    const uint64_t first =
+        MixBits(accumulators_[0] ^ RotateLeft(accumulators_[2], 29));
+    const uint64_t second =
+        MixBits(accumulators_[1] ^ RotateLeft(accumulators_[3], 31));
+
+    ModuleFingerprint fingerprint;
+    fingerprint.low = MixBits(first + second + words_count_);
+    fingerprint.high =
+        MixBits(first ^ (second * kPrime) ^ RotateLeft(words_count_, 17));
+    return fingerprint;
+  }
+
+ private:
+  static const size_t kLanesCount = 4;
+  static const size_t kBlockWordsCount = 2 * kLanesCount;
+  static const size_t kBlocksPerScramble = 16;
+  static const uint64_t kPrime = 0x9E3779B185EBCA87ull;
+  static const uint64_t kLaneKeys[kLanesCount];
+
+  // Each lane takes two words, keyed by the position of the block since the
+  // last scramble so that blocks can't be swapped within it
+  void AccumulateBlock(const uint32_t *words) {
+    const uint64_t block_key = block_index_ * kPrime;
+
+    for (size_t lane = 0; lane < kLanesCount; ++lane) {
+      const uint64_t data =
+          static_cast<uint64_t>(words[2 * lane]) |
+          (static_cast<uint64_t>(words[2 * lane + 1]) << 32);
+      const uint64_t keyed = data ^ (kLaneKeys[lane] + block_key);
+      accumulators_[lane] += data + (keyed & 0xFFFFFFFF) * (keyed >> 32);
+    }
+
+    if (++block_index_ == kBlocksPerScramble) {
+      for (size_t lane = 0; lane < kLanesCount; ++lane) {
+        uint64_t accumulator = accumulators_[lane];
+        accumulator ^= accumulator >> 47;
+        accumulator ^= kLaneKeys[kLanesCount - 1 - lane];
+        accumulators_[lane] = accumulator * 0x9E3779B1ull;
+      }
+      block_index_ = 0;
+    }
+  }
+
+  uint64_t accumulators_[kLanesCount];
+  uint32_t buffer_[kBlockWordsCount];
+  size_t buffered_count_;
+  uint64_t words_count_;
+  uint64_t block_index_;
+};  // class WordsHasher
+
+const uint64_t WordsHasher::kLaneKeys[WordsHasher::kLanesCount] = {
+    0xBE4BA423396CFEB8ull, 0x1CAD21F72C81017Cull, 0xDB979083E96DD4DEull,
+    0x1F67B3B7A4A44072ull};
+
+// Count the targets of an OpGroupDecorate or OpGroupMemberDecorate, and the
+// live ones among them; ids past the bitset are taken as live
+void CountGroupTargets(const uint32_t *words, size_t words_count,
+                       const std::vector<bool> &live, size_t *targets_count,
+                       size_t *live_count) {
+  const OpcodeHeader header = SplitSpvOpCode(words[0]);
+  const size_t step =
+      (header.opcode == static_cast<uint16_t>(spv::Op::OpGroupMemberDecorate))
+          ? 2
+          : 1;
+  *targets_count = 0;
+  *live_count = 0;
+  for (size_t target = 2; (target + step) <= words_count; target += step) {
+    ++*targets_count;
+    if ((words[target] >= live.size()) || live[words[target]]) {
+      ++*live_count;
+    }
+  }
+}
+
+}  // namespace
+
 OpcodeStream::OpcodeStream(const void *module_stream, size_t binary_size)
-    : module_stream_(), offsets_table_(), original_module_size_(0) {
+    : module_stream_(),
+      borrowed_words_(nullptr),
+      mapping_(),
+      original_module_size_(0),
+      emitted_words_count_(0),
+      id_counter_(),
+      in_place_edits_(false),
+      offsets_table_(),
+      edit_epoch_(0),
+      kept_epochs_() {
   if (!module_stream || !binary_size || ((binary_size % 4) != 0) ||
       ((binary_size / 4) < kSpvIndexInstruction)) {
     throw InvalidParameter("Invalid parameter in ctor of OpcodeStream!");
   }
 
-  // The +1 is because we will append a null-terminator to the stream
   module_stream_.reserve((binary_size / 4));
   module_stream_.insert(
       module_stream_.begin(), static_cast<const uint32_t *>(module_stream),
       static_cast<const uint32_t *>(module_stream) + (binary_size / 4));
   original_module_size_ = module_stream_.size();
 
-  // Reserve enough memory for the worst case scenario, where each instruction
-  // is one word long
-  // The +1 is because we will append a null-terminator to the stream
-  offsets_table_.reserve(module_stream_.size() + 1);
-
   ParseModule();
 }
 
 OpcodeStream::OpcodeStream(const std::vector<uint32_t> &module_stream)
-    : module_stream_(), offsets_table_(), original_module_size_(0) {
+    : module_stream_(),
+      borrowed_words_(nullptr),
+      mapping_(),
+      original_module_size_(0),
+      emitted_words_count_(0),
+      id_counter_(),
+      in_place_edits_(false),
+      offsets_table_(),
+      edit_epoch_(0),
+      kept_epochs_() {
   if (module_stream.size() < kSpvIndexInstruction) {
     throw InvalidParameter(
         "Invalid number of words in the module passed to ctor of "
@@ -91,18 +876,36 @@ OpcodeStream::OpcodeStream(const std::vector<uint32_t> &module_stream)
                         module_stream.end());
   original_module_size_ = module_stream_.size();
 
-  // Reserve enough memory for the worst case scenario, where each instruction
-  // is one word long
-  // The +1 is because we will append a null-terminator to the stream
-  offsets_table_.reserve(module_stream_.size() + 1);
+  ParseModule();
+}
+
+OpcodeStream::OpcodeStream()
+    : module_stream_(kSpvIndexInstruction, 0),
+      borrowed_words_(nullptr),
+      mapping_(),
+      original_module_size_(kSpvIndexInstruction),
+      emitted_words_count_(0),
+      id_counter_(),
+      in_place_edits_(false),
+      offsets_table_(),
+      edit_epoch_(0),
+      kept_epochs_() {
+  module_stream_[kSpvIndexMagicNumber] = spv::MagicNumber;
 
   ParseModule();
 }
 
 OpcodeStream::OpcodeStream(std::vector<uint32_t> &&module_stream)
     : module_stream_(std::move(module_stream)),
+      borrowed_words_(nullptr),
+      mapping_(),
+      original_module_size_(0),
+      emitted_words_count_(0),
+      id_counter_(),
+      in_place_edits_(false),
       offsets_table_(),
-      original_module_size_(0) {
+      edit_epoch_(0),
+      kept_epochs_() {
   if (module_stream_.size() < kSpvIndexInstruction) {
     throw InvalidParameter(
         "Invalid number of words in the module passed to ctor of "
@@ -111,15 +914,116 @@ OpcodeStream::OpcodeStream(std::vector<uint32_t> &&module_stream)
 
   original_module_size_ = module_stream_.size();
 
-  // Reserve enough memory for the worst case scenario, where each instruction
-  // is one word long
-  // The +1 is because we will append a null-terminator to the stream
-  offsets_table_.reserve(module_stream_.size() + 1);
+  ParseModule();
+}
+
+OpcodeStream::OpcodeStream(const uint32_t *words, size_t words_count,
+                           BorrowWords)
+    : module_stream_(),
+      borrowed_words_(words),
+      mapping_(),
+      original_module_size_(words_count),
+      emitted_words_count_(0),
+      id_counter_(),
+      in_place_edits_(false),
+      offsets_table_(),
+      edit_epoch_(0),
+      kept_epochs_() {
+  if (!words || (words_count < kSpvIndexInstruction)) {
+    throw InvalidParameter("Invalid parameter in View() of OpcodeStream!");
+  }
 
   ParseModule();
 }
+
+OpcodeStream::OpcodeStream(WordsStream &&module_stream, OffsetsList &&offsets,
+                           ParsedWords)
+    : module_stream_(std::move(module_stream)),
+      borrowed_words_(nullptr),
+      mapping_(),
+      original_module_size_(module_stream_.size()),
+      emitted_words_count_(module_stream_.size()),
+      id_counter_(),
+      in_place_edits_(false),
+      offsets_table_(std::move(offsets)),
+      edit_epoch_(0),
+      kept_epochs_() {
+  // Append end terminator to table
+  InsertOffsetInTable(original_module_size_);
+
+  id_counter_.next.store(PeekAt(kSpvIndexBound));
+}
+
+OpcodeStream OpcodeStream::View(const uint32_t *words, size_t words_count) {
+  return OpcodeStream(words, words_count, BorrowWords());
+}
+
+OpcodeStream OpcodeStream::View(const void *module_stream,
+                                size_t binary_size) {
+  // The words are read in place, so they must be properly aligned
+  if ((reinterpret_cast<uintptr_t>(module_stream) % alignof(uint32_t)) != 0) {
+    throw InvalidParameter(
+        "Misaligned module passed to View() of OpcodeStream!");
+  }
+
+  if ((binary_size % 4) != 0) {
+    throw InvalidParameter("Invalid parameter in View() of OpcodeStream!");
+  }
+
+  return OpcodeStream(static_cast<const uint32_t *>(module_stream),
+                      binary_size / 4, BorrowWords());
+}
+
+void OpcodeStream::Promote() {
+  if (!borrowed_words_) {
+    return;
+  }
+
+  module_stream_.assign(borrowed_words_,
+                        borrowed_words_ + original_module_size_);
+  borrowed_words_ = nullptr;
+  mapping_.reset();
+}
+
 void OpcodeStream::ParseModule() {
-  const size_t words_count = module_stream_.size();
+  const size_t words_count = original_module_size_;
+
+  // Offsets are stored as 32 bits words
+  if (words_count >= std::numeric_limits<uint32_t>::max()) {
+    std::stringstream msg_stream;
+    msg_stream << "Module with " << words_count << " words is too large";
+    throw InvalidStream(msg_stream.str());
+  }
+
+  // Modules of the opposite endianness are swapped once here, so that the
+  // rest of the stream only deals with native words
+  const uint32_t magic_number = PeekAt(kSpvIndexMagicNumber);
+  if (magic_number != spv::MagicNumber) {
+    if (SwapBytes(magic_number) != spv::MagicNumber) {
+      std::stringstream msg_stream;
+      msg_stream << "Word with index " << kSpvIndexMagicNumber
+                 << " has invalid magic number 0x" << std::hex
+                 << magic_number;
+      throw InvalidStream(msg_stream.str());
+    }
+
+    if (borrowed_words_) {
+      module_stream_.resize(words_count);
+      SwapWords(borrowed_words_, module_stream_.data(), words_count);
+      borrowed_words_ = nullptr;
+      mapping_.reset();
+    } else {
+      SwapWords(module_stream_.data(), module_stream_.data(), words_count);
+    }
+  }
+
+  emitted_words_count_ = words_count;
+  id_counter_.next.store(PeekAt(kSpvIndexBound));
+
+  // Reserve enough memory for a module made of average sized instructions;
+  // the +1 is because we will append a null-terminator to the table
+  offsets_table_.reserve(kSpvIndexInstruction +
+                         (words_count / kAverageInstructionWordCount) + 1);
 
   // Set tokens for theader; these always take the same amount of words
   InsertOffsetInTable(kSpvIndexMagicNumber);
@@ -144,18 +1048,120 @@ void OpcodeStream::ParseModule() {
 
   // Append end terminator to table
   InsertOffsetInTable(words_count);
+}
+
+void OpcodeStream::Load(const uint32_t *words, size_t words_count) {
+  if (!words || (words_count < kSpvIndexInstruction)) {
+    throw InvalidParameter("Invalid parameter in Load() of OpcodeStream!");
+  }
+
+  ClearModule();
+  module_stream_.assign(words, words + words_count);
+  original_module_size_ = module_stream_.size();
+
+  ParseModule();
+}
+
+void OpcodeStream::Load(std::vector<uint32_t> &&words,
+                        std::vector<uint32_t> &&offsets) {
+  if ((words.size() < kSpvIndexInstruction) ||
+      (words.size() >= std::numeric_limits<uint32_t>::max()) ||
+      (offsets.size() < kSpvIndexInstruction)) {
+    throw InvalidParameter("Invalid parameter in Load() of OpcodeStream!");
+  }
+
+  // The offsets must split the words exactly as parsing them would: one
+  // per header word, then each instruction ending where the next one starts
+  // and the last one where the module does
+  if (words[kSpvIndexMagicNumber] == spv::MagicNumber) {
+    for (size_t i = 0; i < kSpvIndexInstruction; ++i) {
+      if (offsets[i] != i) {
+        throw InvalidParameter(
+            "Offsets passed to Load() of OpcodeStream don't split the "
+            "header!");
+      }
+    }
 
-  // Append end terminator to original words stream
-  InsertWordHeaderInOriginalStream({0U, static_cast<uint16_t>(spv::Op::OpNop)});
+    size_t next_offset = kSpvIndexInstruction;
+    for (size_t i = kSpvIndexInstruction; i < offsets.size(); ++i) {
+      const size_t words_count =
+          ((offsets[i] == next_offset) && (next_offset < words.size()))
+              ? SplitSpvOpCode(words[next_offset]).words_count
+              : 0;
+      if ((words_count == 0) ||
+          (words_count > (words.size() - next_offset))) {
+        throw InvalidParameter(
+            "Offsets passed to Load() of OpcodeStream don't split the "
+            "instructions!");
+      }
+      next_offset += words_count;
+    }
+    if (next_offset != words.size()) {
+      throw InvalidParameter(
+          "Offsets passed to Load() of OpcodeStream don't split the "
+          "instructions!");
+    }
+  }
+
+  ClearModule();
+  module_stream_ = std::move(words);
+  original_module_size_ = module_stream_.size();
+
+  // Parsing rejects the invalid magic numbers and swaps the others
+  if (PeekAt(kSpvIndexMagicNumber) != spv::MagicNumber) {
+    ParseModule();
+    return;
+  }
+
+  offsets_table_ = std::move(offsets);
+  emitted_words_count_ = original_module_size_;
+  id_counter_.next.store(PeekAt(kSpvIndexBound));
+
+  // Append end terminator to table
+  InsertOffsetInTable(original_module_size_);
+}
+
+void OpcodeStream::LoadFile(const std::string &path) {
+  ClearModule();
+
+  int fd = OpenFile(path, kOpenRead);
+  try {
+    ReadFile(fd, path, module_stream_);
+  } catch (...) {
+    CloseFile(fd);
+    throw;
+  }
+  CloseFile(fd);
+
+  original_module_size_ = module_stream_.size();
+
+  ParseModule();
 }
 
-void OpcodeStream::InsertWordHeaderInOriginalStream(
-    const OpcodeHeader &header) {
-  module_stream_.push_back(MergeSpvOpCode(header));
+void OpcodeStream::ClearModule() {
+  module_stream_.clear();
+  borrowed_words_ = nullptr;
+  mapping_.reset();
+  original_module_size_ = 0;
+  emitted_words_count_ = 0;
+  offsets_table_.clear();
+  opcode_index_offsets_.clear();
+  opcode_index_.clear();
+  section_offsets_.clear();
+  function_offsets_.clear();
+  id_definitions_.clear();
+  DropIdUses();
+  edit_log_.edits.clear();
+  edit_log_.edits_index.clear();
+  edit_log_.patch_words.clear();
+  edit_log_.patches.clear();
+  edit_log_.removals.clear();
+  kept_epochs_.clear();
+  ++edit_epoch_;
 }
 
 void OpcodeStream::InsertOffsetInTable(size_t offset) {
-  offsets_table_.push_back(OpcodeIterator(offset, module_stream_));
+  offsets_table_.push_back(static_cast<uint32_t>(offset));
 }
 
 size_t OpcodeStream::ParseInstructionWordCount(size_t start_index) {
@@ -166,244 +1172,2188 @@ size_t OpcodeStream::ParseInstructionWordCount(size_t start_index) {
   // Decompose and read the word count
   OpcodeHeader header = SplitSpvOpCode(first_word);
 
-  if (header.words_count < 1U) {
-    std::stringstream msg_stream;
-    msg_stream << "Word with index " << start_index << " has word count of "
-               << header.words_count;
-    std::string msg = msg_stream.str();
-    throw InvalidStream(msg);
+  // The last instruction must end exactly where the module does
+  if ((header.words_count < 1U) ||
+      (header.words_count > (original_module_size_ - start_index))) {
+    ThrowInvalidWordCount(start_index, header.words_count);
   }
 
   return static_cast<size_t>(header.words_count);
 }
 
 uint32_t OpcodeStream::PeekAt(size_t index) const {
-  return module_stream_[index];
+  return (index < original_module_size_) ? data()[index] : kTerminatorWord;
 }
 
-OpcodeStream OpcodeStream::EmitFilteredStream() const {
-  WordsStream new_stream;
-  // The new stream will roughly be as large as the original one
-  new_stream.reserve(module_stream_.size());
+const uint32_t *OpcodeStream::data() const {
+  return borrowed_words_ ? borrowed_words_ : module_stream_.data();
+}
 
-  for (OffsetsList::const_iterator oi = offsets_table_.begin();
-       oi != (offsets_table_.end() - 1); oi++) {
-    if (oi->insert_before_count() > 0) {
-      EmitByType(new_stream, oi->insert_before_offset(),
-                 oi->insert_before_count());
-    }
+bool OpcodeStream::IsTerminator(size_t instruction_index) const {
+  return (instruction_index + 1) >= offsets_table_.size();
+}
 
-    if (!oi->is_removed()) {
-      new_stream.insert(new_stream.end(), module_stream_.begin() + oi->offset(),
-                        module_stream_.begin() + (oi + 1)->offset());
-    } else if (oi->replace_count() > 0) {
-      EmitByType(new_stream, oi->replace_offset(), oi->replace_count());
-    }
+size_t OpcodeStream::GetInstructionWordsCount(size_t instruction_index) const {
+  return offsets_table_[instruction_index + 1] -
+         offsets_table_[instruction_index];
+}
 
-    if (oi->insert_after_count() > 0) {
-      EmitByType(new_stream, oi->insert_after_offset(),
-                 oi->insert_after_count());
-    }
+void OpcodeStream::CheckEditable() const {
+  if (IsView()) {
+    throw InvalidOperation(
+        "Cannot operate on a view of a module, call Promote() first!");
   }
-
-  return OpcodeStream(std::move(new_stream));
 }
 
-std::vector<uint32_t> OpcodeStream::GetWordsStream() const {
-  return std::vector<uint32_t>(module_stream_.begin(),
-                               module_stream_.begin() + original_module_size_);
-}
+void OpcodeStream::AccountEmittedWords(EditLog &log, size_t instruction_index,
+                                       ptrdiff_t words_count) {
+  // Words around the terminator are never emitted
+  if (IsTerminator(instruction_index)) {
+    return;
+  }
 
-void OpcodeStream::EmitByType(WordsStream &new_stream, size_t start_offset,
-                              size_t count) const {
-  new_stream.insert(new_stream.end(), module_stream_.begin() + start_offset,
-                    module_stream_.begin() + start_offset + count);
+  if (IsWorkerLog(log)) {
+    log.emitted_words_delta += words_count;
+  } else {
+    emitted_words_count_ += words_count;
+  }
+}
 
-  // If there isn't a marker after the last word, it means that there
-  // are other parts to output which are appended in the stream of words
-  if (*(module_stream_.begin() + start_offset + count) != kMarker) {
-    // Go through the makers until you get to the last one
-    const uint32_t *current_marker = &module_stream_[start_offset + count];
+OpcodeStream::EditLog::EditLog()
+    : edits(),
+      edits_index(),
+      patch_words(),
+      patches(),
+      removals(),
+      emitted_words_delta(0) {}
+
+OpcodeStream::EditLog &OpcodeStream::GetEditLog(size_t instruction_index) {
+  if (pass_worker_.stream != this) {
+    return edit_log_;
+  }
 
-    while (*current_marker != kMarker) {
-      uint32_t next_index = ((0xFFFF0000 & *current_marker) >> 16U);
-      uint32_t next_count = (0x0000FFFF & *current_marker);
+  if ((instruction_index < pass_worker_.first_instruction) ||
+      (instruction_index >= pass_worker_.end_instruction)) {
+    throw InvalidOperation(
+        "Cannot operate outside of the function given to a function pass!");
+  }
 
-      // Output
-      new_stream.insert(new_stream.end(), module_stream_.begin() + next_index,
-                        module_stream_.begin() + next_index + next_count);
+  return *pass_worker_.log;
+}
 
-      current_marker = &module_stream_[next_index + next_count];
-    }
+void OpcodeStream::CheckOutsidePass() const {
+  if (pass_worker_.stream == this) {
+    throw InvalidOperation("Operation not allowed within a function pass!");
   }
 }
 
-OpcodeStream::iterator OpcodeStream::begin() { return offsets_table_.begin(); }
-
-OpcodeStream::iterator OpcodeStream::end() { return offsets_table_.end(); }
+OpcodeStream::InstructionEdits::InstructionEdits(uint32_t instruction_index)
+    : instruction(instruction_index),
+      insert_before(kNoPatch),
+      insert_after(kNoPatch),
+      replace(kNoPatch),
+      remove(false) {}
 
-OpcodeStream::reverse_iterator OpcodeStream::rbegin() { return offsets_table_.rbegin(); }
+OpcodeStream::InstructionEdits &OpcodeStream::GetEdits(
+    EditLog &log, size_t instruction_index) {
+  uint32_t key = static_cast<uint32_t>(instruction_index);
 
-OpcodeStream::reverse_iterator OpcodeStream::rend() { return offsets_table_.rend(); }
+  EditsIndex::const_iterator ei = log.edits_index.find(key);
+  if (ei != log.edits_index.end()) {
+    return log.edits[ei->second];
+  }
 
-OpcodeStream::const_iterator OpcodeStream::end() const {
-  return offsets_table_.end();
-}
+  log.edits_index.insert(
+      std::make_pair(key, static_cast<uint32_t>(log.edits.size())));
+  log.edits.push_back(InstructionEdits(key));
 
-OpcodeStream::const_iterator OpcodeStream::begin() const {
-  return offsets_table_.begin();
+  return log.edits.back();
 }
 
-OpcodeStream::const_iterator OpcodeStream::cbegin() const {
-  return offsets_table_.cbegin();
-}
+const OpcodeStream::InstructionEdits *OpcodeStream::FindEdits(
+    const EditLog &log, size_t instruction_index) const {
+  EditsIndex::const_iterator ei =
+      log.edits_index.find(static_cast<uint32_t>(instruction_index));
 
-OpcodeStream::const_iterator OpcodeStream::cend() const {
-  return offsets_table_.cend();
+  return (ei != log.edits_index.end()) ? &log.edits[ei->second] : nullptr;
 }
 
-OpcodeStream::const_reverse_iterator OpcodeStream::rbegin() const {
-  return offsets_table_.rbegin();
-}
+bool OpcodeStream::IsRemoved(const EditLog &log,
+                             size_t instruction_index) const {
+  const InstructionEdits *edits = FindEdits(log, instruction_index);
+  const InstructionEdits *stream_edits =
+      IsWorkerLog(log) ? FindEdits(edit_log_, instruction_index) : nullptr;
 
-OpcodeStream::const_reverse_iterator OpcodeStream::crbegin() const {
-  return offsets_table_.crbegin();
+  return (edits && edits->remove) || (stream_edits && stream_edits->remove);
 }
 
-OpcodeStream::const_reverse_iterator OpcodeStream::rend() const {
-  return offsets_table_.rend();
-}
+bool OpcodeStream::IsReplaced(const EditLog &log,
+                              size_t instruction_index) const {
+  const InstructionEdits *edits = FindEdits(log, instruction_index);
+  const InstructionEdits *stream_edits =
+      IsWorkerLog(log) ? FindEdits(edit_log_, instruction_index) : nullptr;
 
-OpcodeStream::const_reverse_iterator OpcodeStream::crend() const {
-  return offsets_table_.crend();
+  return (edits && (edits->replace != kNoPatch)) ||
+         (stream_edits && (stream_edits->replace != kNoPatch));
 }
 
-size_t OpcodeStream::size() const { return offsets_table_.size(); }
+bool OpcodeStream::CanReplaceInPlace(const EditLog &log,
+                                     size_t instruction_index,
+                                     const uint32_t *instructions,
+                                     size_t words_count) const {
+  // The header words and the terminator aren't instructions, and workers
+  // can't touch the words shared with the other workers
+  if (!in_place_edits_ || IsWorkerLog(log) ||
+      (instruction_index < kSpvIndexInstruction) ||
+      IsTerminator(instruction_index) || IsRemoved(log, instruction_index)) {
+    return false;
+  }
 
-OpcodeIterator::OpcodeIterator(size_t offset, std::vector<uint32_t> &words)
-    : offset_(offset),
-      insert_before_offset_(0),
-      insert_before_count_(0),
-      insert_after_offset_(0),
-      insert_after_count_(0),
-      replace_offset_(0),
-      replace_count_(0),
-      remove_(false),
-      words_(words) {}
+  // The opcode and the word count are in the first word; keeping both keeps
+  // the offsets and the indices valid
+  return (words_count == GetInstructionWordsCount(instruction_index)) &&
+         (instructions[0] == PeekAt(offsets_table_[instruction_index]));
+}
 
-spv::Op OpcodeIterator::GetOpcode() const {
-  uint32_t header_word = words_[offset_];
+void OpcodeStream::OverwriteWords(size_t instruction_index, size_t word_index,
+                                  const uint32_t *words, size_t words_count) {
+  // Words of a mapped file are moved in the stream on first direct access
+  Promote();
 
-  return static_cast<spv::Op>(SplitSpvOpCode(header_word).opcode);
-}
+  UndefineIds(instruction_index);
 
-size_t OpcodeIterator::GetWordCount() const {
-  uint32_t header_word = words_[offset_];
+  const size_t offset = offsets_table_[instruction_index];
+  std::copy(words, words + words_count,
+            module_stream_.begin() + offset + word_index);
 
-  return static_cast<size_t>(SplitSpvOpCode(header_word).words_count);
+  // The table picks up the new words once it gets built
+  if (!id_definitions_.empty()) {
+    DefineIds(instruction_index, module_stream_.data() + offset,
+              GetInstructionWordsCount(instruction_index), offset);
+  }
+  DropIdUses();
 }
 
-void OpcodeIterator::InsertBefore(const uint32_t *instructions,
-                                  size_t words_count) {
-  assert(instructions && words_count);
-
-  // Offset before new words are inserted
-  size_t previous_offset = words_.size();
+void OpcodeStream::PushPatch(EditLog &log, const uint32_t *instructions,
+                             size_t words_count, uint32_t *chain_head) {
+  if ((words_count >= std::numeric_limits<uint32_t>::max()) ||
+      (log.patches.size() >= kNoPatch)) {
+    throw InvalidParameter("Too many words inserted in OpcodeStream!");
+  }
 
-  // +1 is for the end marker
-  words_.reserve(previous_offset + words_count + 1);
-  words_.insert(words_.end(), instructions, instructions + words_count);
+  Patch patch = {static_cast<uint64_t>(log.patch_words.size()),
+                 static_cast<uint32_t>(words_count), *chain_head};
 
-  // Add the end marker
-  words_.push_back(kMarker);
+  log.patch_words.insert(log.patch_words.end(), instructions,
+                         instructions + words_count);
 
-  // After the first word of type before has been inserted, always append
-  // in the list and write the marker
-  if (insert_before_count_ != 0) {
-    uint32_t *latest_marker = &words_[words_.size() - 1U];
+  // The new patch becomes the head, so that chains are emitted in LIFO order
+  *chain_head = static_cast<uint32_t>(log.patches.size());
+  log.patches.push_back(patch);
 
-    // Write the marker
-    *latest_marker = ((0xFFFF0000 & (insert_before_offset_ << 16U)) |
-                      (0x0000FFFF & insert_before_count_));
+  // The chains are dropped once when a function pass starts
+  if (!IsWorkerLog(log)) {
+    DropIdUses();
   }
-
-  insert_before_offset_ = previous_offset;
-  insert_before_count_ = words_count;
 }
 
-void OpcodeIterator::InsertAfter(const uint32_t *instructions,
-                                 size_t words_count) {
-  assert(instructions && words_count);
+std::vector<const OpcodeStream::InstructionEdits *>
+OpcodeStream::GetSortedEdits() const {
+  std::vector<const InstructionEdits *> sorted_edits;
+  sorted_edits.reserve(edit_log_.edits.size());
+  for (EditsList::const_iterator ei = edit_log_.edits.begin();
+       ei != edit_log_.edits.end(); ei++) {
+    sorted_edits.push_back(&(*ei));
+  }
+
+  std::sort(sorted_edits.begin(), sorted_edits.end(),
+            [](const InstructionEdits *lhs, const InstructionEdits *rhs) {
+              return lhs->instruction < rhs->instruction;
+            });
+
+  return sorted_edits;
+}
+
+template <typename Sink>
+void OpcodeStream::ForEachEmittedRun(Sink &&sink) const {
+  uint32_t bound = 0;
+  ForEachEmittedRun(&bound, std::forward<Sink>(sink));
+}
+
+template <typename Sink>
+void OpcodeStream::ForEachEmittedRun(uint32_t *bound, Sink &&sink) const {
+  CheckOutsidePass();
+
+  std::vector<const InstructionEdits *> sorted_edits = GetSortedEdits();
+
+  // Instructions which have not been operated on are emitted in runs, from
+  // the end of the previous edited instruction up to the next one
+  const uint32_t *words = data();
+  size_t run_first = 0;
+  const size_t terminator_index = offsets_table_.size() - 1;
+
+  auto flush_run = [&](size_t run_end) {
+    if (run_end > run_first) {
+      EmittedRun run = {words + offsets_table_[run_first],
+                        offsets_table_[run_end] - offsets_table_[run_first],
+                        run_first, run_end};
+      sink(run);
+    }
+    run_first = run_end;
+  };
+
+  // Ids allocated past the bound of the header raise it, unless the bound
+  // word has been operated on; the new bound is emitted as if it replaced it
+  *bound = id_counter_.next.load();
+  bool bound_pending = (*bound > PeekAt(kSpvIndexBound)) &&
+                       !FindEdits(edit_log_, kSpvIndexBound);
+  auto emit_bound = [&]() {
+    flush_run(kSpvIndexBound);
+    EmittedRun run = {bound, 1, 0, 0};
+    sink(run);
+    run_first = kSpvIndexBound + 1;
+    bound_pending = false;
+  };
+
+  for (std::vector<const InstructionEdits *>::const_iterator si =
+           sorted_edits.begin();
+       si != sorted_edits.end(); si++) {
+    const InstructionEdits &edits = **si;
+
+    if (bound_pending && (edits.instruction > kSpvIndexBound)) {
+      emit_bound();
+    }
+
+    // The terminator isn't part of the module
+    if (edits.instruction >= terminator_index) {
+      break;
+    }
+
+    if (edits.insert_before != kNoPatch) {
+      flush_run(edits.instruction);
+      EmitPatches(sink, edits.insert_before);
+    }
+
+    // A kept instruction simply stays part of the current run
+    if (edits.remove) {
+      flush_run(edits.instruction);
+      EmitPatches(sink, edits.replace);
+      run_first = edits.instruction + 1;
+    }
+
+    if (edits.insert_after != kNoPatch) {
+      flush_run(edits.instruction + 1);
+      EmitPatches(sink, edits.insert_after);
+    }
+  }
+
+  if (bound_pending) {
+    emit_bound();
+  }
+
+  flush_run(terminator_index);
+}
+
+template <typename Sink>
+void OpcodeStream::EmitPatches(Sink &sink, uint32_t chain_head) const {
+  for (uint32_t pi = chain_head; pi != kNoPatch;
+       pi = edit_log_.patches[pi].next) {
+    const Patch &patch = edit_log_.patches[pi];
+    EmittedRun run = {edit_log_.patch_words.data() + patch.offset, patch.count,
+                      0, 0};
+    sink(run);
+  }
+}
+
+bool OpcodeStream::ScanInstructions(const uint32_t *words, size_t count,
+                                    size_t offset, OffsetsList &offsets) {
+  size_t word_index = 0;
+  while (word_index < count) {
+    // Header words always take one entry each
+    size_t inst_word_count = 1U;
+    if ((offset + word_index) >= kSpvIndexInstruction) {
+      inst_word_count = SplitSpvOpCode(words[word_index]).words_count;
+    }
+
+    // Instructions must be whole within the words
+    if ((inst_word_count == 0) || ((word_index + inst_word_count) > count)) {
+      return false;
+    }
+
+    offsets.push_back(static_cast<uint32_t>(offset + word_index));
+    word_index += inst_word_count;
+  }
+
+  return true;
+}
+
+template <typename Visitor>
+bool OpcodeStream::ForEachEmittedInstruction(Visitor &&visitor) const {
+  size_t position = 0;
+  bool whole_instructions = true;
+
+  ForEachEmittedRun([&](const EmittedRun &run) {
+    const uint32_t *words = run.words;
+    const uint32_t *end = run.words + run.count;
+    for (; (words < end) && (position < kSpvIndexInstruction); ++words) {
+      ++position;
+    }
+
+    while (whole_instructions && (words < end)) {
+      const size_t words_count = SplitSpvOpCode(*words).words_count;
+      if ((words_count == 0) ||
+          (words_count > static_cast<size_t>(end - words))) {
+        whole_instructions = false;
+        break;
+      }
+
+      visitor(words, words_count);
+      words += words_count;
+    }
+  });
+
+  return whole_instructions;
+}
+
+template <typename Keep>
+OpcodeStream OpcodeStream::EmitKeptInstructions(Keep &&keep) const {
+  WordsStream new_stream;
+  new_stream.reserve(emitted_words_count_);
+
+  OffsetsList new_offsets;
+  new_offsets.reserve(offsets_table_.size() +
+                      (edit_log_.patch_words.size() /
+                       kAverageInstructionWordCount) +
+                      1);
+
+  ForEachEmittedRun([&](const EmittedRun &run) {
+    const uint32_t *words = run.words;
+    const uint32_t *end = run.words + run.count;
+
+    // Header words are always kept and take one entry each
+    for (; (words < end) && (new_stream.size() < kSpvIndexInstruction);
+         ++words) {
+      new_offsets.push_back(static_cast<uint32_t>(new_stream.size()));
+      new_stream.push_back(*words);
+    }
+
+    // Kept instructions are copied in spans, up to the next dropped one.
+    // Inserted words which don't split in whole instructions can't be told
+    // whether to keep, so they throw as they would when parsed
+    const uint32_t *span = words;
+    while (words < end) {
+      const size_t words_count = SplitSpvOpCode(*words).words_count;
+      if ((words_count == 0) ||
+          (words_count > static_cast<size_t>(end - words))) {
+        ThrowInvalidWordCount(new_stream.size() + (words - span),
+                              words_count);
+      }
+
+      if (keep(words, words_count)) {
+        new_offsets.push_back(
+            static_cast<uint32_t>(new_stream.size() + (words - span)));
+      } else {
+        new_stream.insert(new_stream.end(), span, words);
+        span = words + words_count;
+      }
+      words += words_count;
+    }
+    new_stream.insert(new_stream.end(), span, end);
+  });
+
+  if (new_stream.size() < kSpvIndexInstruction) {
+    return OpcodeStream(std::move(new_stream));
+  }
+
+  return OpcodeStream(std::move(new_stream), std::move(new_offsets),
+                      ParsedWords());
+}
+
+OpcodeStream OpcodeStream::EmitFilteredStream() const {
+  WordsStream new_stream;
+  new_stream.reserve(emitted_words_count_);
+
+  // The offsets of the new stream are derived from the current ones, so that
+  // only the inserted words need to be parsed
+  OffsetsList new_offsets;
+  new_offsets.reserve(offsets_table_.size() +
+                      (edit_log_.patch_words.size() /
+                       kAverageInstructionWordCount) +
+                      1);
+  bool offsets_valid = true;
+
+  ForEachEmittedRun([&](const EmittedRun &run) {
+    const size_t new_offset = new_stream.size();
+
+    if (!offsets_valid) {
+      // Nothing to do, the new stream will be parsed from scratch
+    } else if (run.end_instruction > run.first_instruction) {
+      const size_t first_offset = offsets_table_[run.first_instruction];
+
+      // Runs can only move around if they don't contain header words and
+      // don't end up in the header of the new stream
+      if (((run.first_instruction < kSpvIndexInstruction) ||
+           (new_offset < kSpvIndexInstruction)) &&
+          (new_offset != first_offset)) {
+        offsets_valid = false;
+      }
+
+      for (size_t i = run.first_instruction; i < run.end_instruction; ++i) {
+        new_offsets.push_back(static_cast<uint32_t>(
+            new_offset + (offsets_table_[i] - first_offset)));
+      }
+    } else {
+      offsets_valid = ScanInstructions(run.words, run.count, new_offset,
+                                       new_offsets);
+    }
+
+    new_stream.insert(new_stream.end(), run.words, run.words + run.count);
+  });
 
-  // Offset before new words are inserted
-  size_t previous_offset = words_.size();
+  // Fall back to parsing the whole stream if inserted words don't split in
+  // whole instructions, so that errors are reported as they would be
+  if (!offsets_valid || (new_stream.size() < kSpvIndexInstruction)) {
+    return OpcodeStream(std::move(new_stream));
+  }
+
+  return OpcodeStream(std::move(new_stream), std::move(new_offsets),
+                      ParsedWords());
+}
+
+OpcodeStream OpcodeStream::StripDebugInfo() const {
+  static const char kNonSemanticPrefix[] = "NonSemantic.";
+  static const char kDebugPrintfSet[] = "NonSemantic.DebugPrintf";
+  static const char kNonSemanticExtension[] = "SPV_KHR_non_semantic_info";
+
+  // Find the non-semantic instruction sets to drop, and the strings used by
+  // the extended instructions kept; ids which aren't strings are marked too,
+  // which is harmless
+  std::vector<spv::Id> stripped_sets;
+  bool keeps_non_semantic_set = false;
+  std::vector<bool> used_strings(GetIdBound(), false);
+  auto is_stripped_set = [&stripped_sets](spv::Id set) {
+    return std::find(stripped_sets.begin(), stripped_sets.end(), set) !=
+           stripped_sets.end();
+  };
+
+  ForEachEmittedInstruction([&](const uint32_t *words, size_t words_count) {
+    const spv::Op opcode =
+        static_cast<spv::Op>(SplitSpvOpCode(words[0]).opcode);
+
+    if ((opcode == spv::Op::OpExtInstImport) && (words_count > 2)) {
+      if (!MatchLiteralString(words + 2, words_count - 2, kNonSemanticPrefix,
+                              true)) {
+        return;
+      }
+      if (MatchLiteralString(words + 2, words_count - 2, kDebugPrintfSet,
+                             false)) {
+        keeps_non_semantic_set = true;
+      } else {
+        stripped_sets.push_back(words[1]);
+      }
+    } else if ((opcode == spv::Op::OpExtInst) && (words_count > 3) &&
+               !is_stripped_set(words[3])) {
+      for (size_t i = 5; i < words_count; ++i) {
+        if (words[i] < used_strings.size()) {
+          used_strings[words[i]] = true;
+        }
+      }
+    }
+  });
+
+  // The extension is only needed by the non-semantic sets
+  const bool strip_extension =
+      !stripped_sets.empty() && !keeps_non_semantic_set;
+
+  return EmitKeptInstructions([&](const uint32_t *words, size_t words_count) {
+    const spv::Op opcode =
+        static_cast<spv::Op>(SplitSpvOpCode(words[0]).opcode);
+
+    switch (opcode) {
+      case spv::Op::OpString:
+        return (words_count > 1) && (words[1] < used_strings.size()) &&
+               used_strings[words[1]];
+      case spv::Op::OpExtInstImport:
+        return (words_count < 2) || !is_stripped_set(words[1]);
+      case spv::Op::OpExtInst:
+        return (words_count < 4) || !is_stripped_set(words[3]);
+      case spv::Op::OpExtension:
+        return !strip_extension ||
+               !MatchLiteralString(words + 1, words_count - 1,
+                                   kNonSemanticExtension, false);
+      default:
+        return !IsDebugOpcode(opcode);
+    }
+  });
+}
+
+struct OpcodeStream::DependencyGraph final {
+  // Instruction defining an id of the types section, or OpFunction along
+  // with the range of the function body in function_instructions
+  struct Definition final {
+    uint64_t offset;
+    uint32_t first_instruction;
+    uint32_t end_instruction;
+  };  // struct Definition
+
+  // Instructions are referred to by offset, so that the graph stays valid
+  // for copies of the stream and when the stream is promoted
+  std::vector<Definition> definitions;
+  // Instructions of the function bodies, OpFunction excluded
+  std::vector<uint64_t> function_instructions;
+  std::vector<uint64_t> entry_points;
+  std::vector<uint64_t> execution_modes;
+  // Instructions which keep the ids they use alive whatever the entry points
+  std::vector<uint64_t> roots;
+  // Group decorations, which are edges from each of their targets to their
+  // group rather than roots
+  std::vector<uint64_t> group_decorations;
+};  // struct OpcodeStream::DependencyGraph
+
+const OpcodeStream::DependencyGraph &OpcodeStream::GetDependencyGraph()
+    const {
+  if (dependency_graph_) {
+    return *dependency_graph_;
+  }
+
+  std::shared_ptr<DependencyGraph> graph = std::make_shared<DependencyGraph>();
+  const DependencyGraph::Definition no_definition = {kNoDefinition, 0, 0};
+  graph->definitions.assign(GetIdBound(), no_definition);
+
+  // Bodies of functions whose id is past the bound are gathered but never
+  // reached
+  DependencyGraph::Definition unknown_function = no_definition;
+  DependencyGraph::Definition *function = nullptr;
+  const bool whole_instructions = ForEachEmittedInstruction([&](
+      const uint32_t *words, size_t words_count) {
+    const spv::Op opcode =
+        static_cast<spv::Op>(SplitSpvOpCode(words[0]).opcode);
+    const uint64_t offset = GetWordOffset(words);
+    const uint32_t instructions_count =
+        static_cast<uint32_t>(graph->function_instructions.size());
+
+    if (opcode == spv::Op::OpFunction) {
+      function = &unknown_function;
+      if ((words_count > 2) && (words[2] < graph->definitions.size())) {
+        function = &graph->definitions[words[2]];
+      }
+      function->offset = offset;
+      function->first_instruction = instructions_count;
+      function->end_instruction = instructions_count;
+      return;
+    }
+    if (function) {
+      graph->function_instructions.push_back(offset);
+      function->end_instruction = instructions_count + 1;
+      if (opcode == spv::Op::OpFunctionEnd) {
+        function = nullptr;
+      }
+      return;
+    }
+
+    switch (opcode) {
+      case spv::Op::OpEntryPoint:
+        graph->entry_points.push_back(offset);
+        return;
+      case spv::Op::OpExecutionMode:
+        graph->execution_modes.push_back(offset);
+        return;
+      case spv::Op::OpGroupDecorate:
+      case spv::Op::OpGroupMemberDecorate:
+        graph->group_decorations.push_back(offset);
+        return;
+      case spv::Op::OpExtInst:
+        graph->roots.push_back(offset);
+        return;
+      default:
+        break;
+    }
+
+    if (GetOpcodeSection(opcode) == ModuleSection::kTypes) {
+      bool has_result = false;
+      bool has_type = false;
+      GetResultOperands(opcode, &has_result, &has_type);
+      const size_t result_index = has_type ? 2 : 1;
+      if (has_result && (result_index < words_count) &&
+          (words[result_index] < graph->definitions.size())) {
+        graph->definitions[words[result_index]].offset = offset;
+      }
+    }
+  });
+
+  // A graph of part of the module would drop what the rest of it reaches
+  if (!whole_instructions) {
+    throw InvalidStream(
+        "Inserted words don't split in whole instructions, the dependency "
+        "graph can't be built");
+  }
+
+  dependency_graph_ = graph;
+  return *dependency_graph_;
+}
+
+const uint32_t *OpcodeStream::GetWordAt(uint64_t offset) const {
+  if (offset < original_module_size_) {
+    return data() + offset;
+  }
+
+  return edit_log_.patch_words.data() + (offset - original_module_size_);
+}
+
+uint64_t OpcodeStream::GetWordOffset(const uint32_t *word) const {
+  const std::less<const uint32_t *> less;
+  if (!less(word, data()) && less(word, data() + original_module_size_)) {
+    return static_cast<uint64_t>(word - data());
+  }
+
+  return original_module_size_ +
+         static_cast<uint64_t>(word - edit_log_.patch_words.data());
+}
+
+void OpcodeStream::MarkLiveIds(const DependencyGraph &graph,
+                               const std::vector<uint64_t> &roots,
+                               std::vector<bool> &live) const {
+  std::vector<spv::Id> pending;
+  auto mark = [&](spv::Id id) {
+    if ((id < live.size()) && !live[id]) {
+      live[id] = true;
+      pending.push_back(id);
+    }
+  };
+  // The operands of the extended instructions which aren't known to be all
+  // ids are marked as if they were, which only keeps more alive
+  auto mark_operands = [&](const uint32_t *words) {
+    const OpcodeHeader header = SplitSpvOpCode(words[0]);
+    ForEachIdOperand(words, header.words_count, *this,
+                     [&](size_t operand) { mark(words[operand]); });
+    if ((header.opcode == static_cast<uint16_t>(spv::Op::OpExtInst)) &&
+        !HasIdOperandsOnly(words, header.words_count, *this)) {
+      for (size_t operand = 5; operand < header.words_count; ++operand) {
+        mark(words[operand]);
+      }
+    }
+  };
 
-  // +1 is for the end marker
-  words_.reserve(previous_offset + words_count + 1);
-  words_.insert(words_.end(), instructions, instructions + words_count);
+  for (uint64_t root : roots) {
+    mark_operands(GetWordAt(root));
+  }
 
-  // Add the end marker
-  words_.push_back(kMarker);
+  // A group is live as long as one of its targets is, which only happens
+  // once everything the roots reach is known; groups don't reach anything
+  // but their decorations, which are left to the emission
+  MarkLiveDefinitions(graph, pending, mark, mark_operands);
+  for (uint64_t offset : graph.group_decorations) {
+    const uint32_t *words = GetWordAt(offset);
+    size_t targets_count = 0;
+    size_t live_count = 0;
+    CountGroupTargets(words, SplitSpvOpCode(words[0]).words_count, live,
+                      &targets_count, &live_count);
+    if (live_count > 0) {
+      mark(words[1]);
+    }
+  }
+  MarkLiveDefinitions(graph, pending, mark, mark_operands);
+}
 
-  // After the first word of type after has been inserted, always append
-  // in the list and write the marker
-  if (insert_after_count_ != 0) {
-    uint32_t *latest_marker = &words_[words_.size() - 1U];
+template <typename Mark, typename MarkOperands>
+void OpcodeStream::MarkLiveDefinitions(const DependencyGraph &graph,
+                                       std::vector<spv::Id> &pending,
+                                       Mark &&mark,
+                                       MarkOperands &&mark_operands) const {
+  while (!pending.empty()) {
+    const spv::Id id = pending.back();
+    pending.pop_back();
+    if (id >= graph.definitions.size()) {
+      continue;
+    }
 
-    // Write the marker
-    *latest_marker = ((0xFFFF0000 & (insert_after_offset_ << 16U)) |
-                      (0x0000FFFF & insert_after_count_));
+    const DependencyGraph::Definition &definition = graph.definitions[id];
+    if (definition.offset == kNoDefinition) {
+      continue;
+    }
+    mark_operands(GetWordAt(definition.offset));
+
+    // The results of a live function are live too, so that their
+    // decorations are kept
+    for (uint32_t i = definition.first_instruction;
+         i < definition.end_instruction; ++i) {
+      const uint32_t *words = GetWordAt(graph.function_instructions[i]);
+      const OpcodeHeader header = SplitSpvOpCode(words[0]);
+      bool has_result = false;
+      bool has_type = false;
+      GetResultOperands(static_cast<spv::Op>(header.opcode), &has_result,
+                        &has_type);
+      const size_t result_index = has_type ? 2 : 1;
+      if (has_result && (result_index < header.words_count)) {
+        mark(words[result_index]);
+      }
+      mark_operands(words);
+    }
   }
+}
+
+OpcodeStream OpcodeStream::EmitLiveInstructions(
+    const std::vector<bool> &live, const uint32_t *entry_point) const {
+  // Ids past the bound are left alone
+  auto is_live = [&live](spv::Id id) {
+    return (id >= live.size()) || live[id];
+  };
+
+  bool in_function = false;
+  bool function_live = false;
+  bool trim = false;
+  OpcodeStream kept = EmitKeptInstructions([&](const uint32_t *words,
+                                               size_t words_count) {
+    const spv::Op opcode =
+        static_cast<spv::Op>(SplitSpvOpCode(words[0]).opcode);
+
+    if (opcode == spv::Op::OpFunction) {
+      in_function = true;
+      function_live = (words_count < 3) || is_live(words[2]);
+    }
+    if (in_function) {
+      in_function = (opcode != spv::Op::OpFunctionEnd);
+      return function_live;
+    }
+
+    switch (opcode) {
+      case spv::Op::OpEntryPoint:
+        return !entry_point || (words == entry_point);
+      case spv::Op::OpExecutionMode:
+        return !entry_point || (words[1] == entry_point[2]);
+      case spv::Op::OpGroupDecorate:
+      case spv::Op::OpGroupMemberDecorate: {
+        // Kept with its live targets only, which are trimmed below
+        size_t targets_count = 0;
+        size_t live_count = 0;
+        CountGroupTargets(words, words_count, live, &targets_count,
+                          &live_count);
+        if ((live_count == 0) || !is_live(words[1])) {
+          return false;
+        }
+        trim = trim || (live_count < targets_count);
+        return true;
+      }
+      case spv::Op::OpDecorationGroup:
+      case spv::Op::OpName:
+      case spv::Op::OpMemberName:
+      case spv::Op::OpDecorate:
+      case spv::Op::OpMemberDecorate:
+      case spv::Op::OpTypeForwardPointer:
+        return (words_count < 2) || is_live(words[1]);
+      default:
+        break;
+    }
+
+    if (GetOpcodeSection(opcode) != ModuleSection::kTypes) {
+      return true;
+    }
+
+    bool has_result = false;
+    bool has_type = false;
+    GetResultOperands(opcode, &has_result, &has_type);
+    const size_t result_index = has_type ? 2 : 1;
+    return !has_result || (result_index >= words_count) ||
+           is_live(words[result_index]);
+  });
 
-  insert_after_offset_ = previous_offset;
-  insert_after_count_ = words_count;
+  if (!trim) {
+    return kept;
+  }
+
+  // Group decorations with dead targets are replaced by ones with the live
+  // targets only, which is rare enough to go through a second emission
+  std::vector<uint32_t> trimmed;
+  for (spv::Op opcode :
+       {spv::Op::OpGroupDecorate, spv::Op::OpGroupMemberDecorate}) {
+    const size_t step = (opcode == spv::Op::OpGroupMemberDecorate) ? 2 : 1;
+    for (auto &i : kept.Instructions(opcode)) {
+      const uint32_t *words = i.data();
+      const size_t words_count = i.GetWordCount();
+      size_t targets_count = 0;
+      size_t live_count = 0;
+      CountGroupTargets(words, words_count, live, &targets_count,
+                        &live_count);
+      if (live_count == targets_count) {
+        continue;
+      }
+
+      trimmed.assign(words, words + 2);
+      for (size_t target = 2; (target + step) <= words_count;
+           target += step) {
+        if ((words[target] >= live.size()) || live[words[target]]) {
+          trimmed.insert(trimmed.end(), words + target,
+                         words + target + step);
+        }
+      }
+      trimmed[0] = MergeSpvOpCode({static_cast<uint16_t>(trimmed.size()),
+                                   static_cast<uint16_t>(opcode)});
+      i.Replace(trimmed.data(), trimmed.size());
+    }
+  }
+
+  return kept.EmitFilteredStream();
 }
 
-uint32_t *OpcodeIterator::GetLatestMaker(size_t initial_offset,
-                                         size_t initial_count) const {
-  uint32_t *current_marker = &words_[initial_offset + initial_count];
+OpcodeStream OpcodeStream::EliminateDeadCode() const {
+  const DependencyGraph &graph = GetDependencyGraph();
+
+  std::vector<uint64_t> roots(graph.roots);
+  roots.insert(roots.end(), graph.entry_points.begin(),
+               graph.entry_points.end());
+  roots.insert(roots.end(), graph.execution_modes.begin(),
+               graph.execution_modes.end());
 
-  while (*current_marker != kMarker) {
-    uint32_t next_index = ((0xFFFF0000 & *current_marker) >> 16U);
-    uint32_t next_count = (0x0000FFFF & *current_marker);
-    current_marker = &words_[next_index + next_count];
+  std::vector<bool> live(graph.definitions.size(), false);
+  MarkLiveIds(graph, roots, live);
+
+  return EmitLiveInstructions(live, nullptr);
+}
+
+OpcodeStream OpcodeStream::ExtractEntryPoint(const std::string &name,
+                                             spv::ExecutionModel model) const {
+  const DependencyGraph &graph = GetDependencyGraph();
+
+  // OpEntryPoint holds the execution model, the function and the name
+  const uint32_t *entry_point = nullptr;
+  for (uint64_t offset : graph.entry_points) {
+    const uint32_t *words = GetWordAt(offset);
+    const size_t words_count = SplitSpvOpCode(words[0]).words_count;
+    if ((words_count > 3) && (words[1] == static_cast<uint32_t>(model)) &&
+        MatchLiteralString(words + 3, words_count - 3, name.c_str(), false)) {
+      entry_point = words;
+      break;
+    }
   }
+  if (!entry_point) {
+    throw InvalidParameter("Entry point " + name +
+                           " not found in ExtractEntryPoint() of "
+                           "OpcodeStream!");
+  }
+
+  std::vector<uint64_t> roots(graph.roots);
+  roots.push_back(GetWordOffset(entry_point));
+  for (uint64_t offset : graph.execution_modes) {
+    if (GetWordAt(offset)[1] == entry_point[2]) {
+      roots.push_back(offset);
+    }
+  }
+
+  std::vector<bool> live(graph.definitions.size(), false);
+  MarkLiveIds(graph, roots, live);
 
-  return current_marker;
+  return EmitLiveInstructions(live, entry_point);
+}
+
+OpcodeStream OpcodeStream::CompactIds(const CompactIdsOptions &options) const {
+  CheckExtInstOperands("CompactIds()");
+
+  WordsStream new_stream;
+  EmitWords(new_stream);
+
+  // New ids indexed by old id, or 0 for the ids which haven't been numbered
+  std::vector<uint32_t> id_map(GetIdBound(), 0);
+  uint32_t next_id = 1;
+  auto map_id = [&](uint32_t id) -> uint32_t {
+    if (id == 0) {
+      return 0;
+    }
+    if (id >= id_map.size()) {
+      id_map.resize(static_cast<size_t>(id) + 1, 0);
+    }
+    if (id_map[id] == 0) {
+      id_map[id] = next_id++;
+    }
+    return id_map[id];
+  };
+
+  // Number the result ids in order of definition, recording the offsets of
+  // the instructions along the way; header words take one entry each
+  OffsetsList new_offsets;
+  new_offsets.reserve(offsets_table_.size() +
+                      (edit_log_.patch_words.size() /
+                       kAverageInstructionWordCount) +
+                      1);
+  for (size_t i = 0; i < kSpvIndexInstruction; ++i) {
+    new_offsets.push_back(static_cast<uint32_t>(i));
+  }
+  const uint32_t *first_word = new_stream.data();
+  ForEachInstruction(
+      first_word, new_stream.size(),
+      [&](spv::Op opcode, size_t words_count, const uint32_t *operands) {
+        new_offsets.push_back(
+            static_cast<uint32_t>((operands - 1) - first_word));
+
+        bool has_result = false;
+        bool has_type = false;
+        GetResultOperands(opcode, &has_result, &has_type);
+        const size_t result_index = has_type ? 2 : 1;
+        if (has_result && (result_index < words_count)) {
+          map_id(operands[result_index - 1]);
+        }
+        return true;
+      });
+
+  // Runs of names and of decorations, whose order doesn't matter, are
+  // sorted once their ids have been rewritten
+  enum class RunKind { kNone, kNames, kDecorations };
+  RunKind run_kind = RunKind::kNone;
+  size_t run_first = kSpvIndexInstruction;
+  std::vector<uint32_t> scratch;
+  auto flush_run = [&](size_t run_end) {
+    if (options.canonical_order && (run_kind != RunKind::kNone)) {
+      SortTargetingInstructions(new_stream.data(),
+                                new_offsets.data() + run_first,
+                                run_end - run_first, scratch);
+    }
+  };
+
+  // Rewrite the ids, gathering the operands of an instruction before
+  // rewriting them, as the literals of OpSwitch are sized after the type of
+  // its selector, which is looked up by its old id
+  std::vector<size_t> id_operands;
+  for (size_t i = kSpvIndexInstruction; i < new_offsets.size(); ++i) {
+    uint32_t *words = new_stream.data() + new_offsets[i];
+    const OpcodeHeader header = SplitSpvOpCode(words[0]);
+    const spv::Op opcode = static_cast<spv::Op>(header.opcode);
+
+    id_operands.clear();
+    bool has_result = false;
+    bool has_type = false;
+    GetResultOperands(opcode, &has_result, &has_type);
+    const size_t result_index = has_type ? 2 : 1;
+    if (has_result && (result_index < header.words_count)) {
+      id_operands.push_back(result_index);
+    }
+    ForEachIdOperand(words, header.words_count, *this,
+                     [&id_operands](size_t operand) {
+                       id_operands.push_back(operand);
+                     });
+    for (size_t operand : id_operands) {
+      words[operand] = map_id(words[operand]);
+    }
+
+    RunKind kind = RunKind::kNone;
+    switch (opcode) {
+      case spv::Op::OpName:
+      case spv::Op::OpMemberName:
+        kind = RunKind::kNames;
+        break;
+      case spv::Op::OpDecorate:
+      case spv::Op::OpMemberDecorate:
+        kind = RunKind::kDecorations;
+        break;
+      default:
+        break;
+    }
+    if (kind != run_kind) {
+      flush_run(i);
+      run_kind = kind;
+      run_first = i;
+    }
+  }
+  flush_run(new_offsets.size());
+
+  new_stream[kSpvIndexBound] = next_id;
+
+  return OpcodeStream(std::move(new_stream), std::move(new_offsets),
+                      ParsedWords());
+}
+
+EditCheckpoint OpcodeStream::Checkpoint() const {
+  EditCheckpoint checkpoint;
+  checkpoint.stream_ = this;
+  checkpoint.edits_count_ = edit_log_.edits.size();
+  checkpoint.patches_count_ = edit_log_.patches.size();
+  checkpoint.patch_words_count_ = edit_log_.patch_words.size();
+  checkpoint.removals_count_ = edit_log_.removals.size();
+  checkpoint.emitted_words_count_ = emitted_words_count_;
+  checkpoint.id_bound_ = id_counter_.next.load();
+  checkpoint.epoch_ = edit_epoch_;
+
+  return checkpoint;
+}
+
+void OpcodeStream::Rollback(const EditCheckpoint &checkpoint) {
+  CheckOutsidePass();
+
+  // Within an epoch operations are only ever appended, so the checkpoints
+  // of an earlier epoch which can still be rolled back to are the ones up to
+  // where its operations have been kept
+  if (checkpoint.stream_ != this) {
+    throw InvalidOperation("Invalid checkpoint passed to Rollback()!");
+  }
+  size_t kept_index = kept_epochs_.size();
+  if (checkpoint.epoch_ != edit_epoch_) {
+    kept_index = 0;
+    while ((kept_index < kept_epochs_.size()) &&
+           (kept_epochs_[kept_index].epoch_ != checkpoint.epoch_)) {
+      ++kept_index;
+    }
+    if ((kept_index == kept_epochs_.size()) ||
+        !IsCheckpointWithin(checkpoint, kept_epochs_[kept_index])) {
+      throw InvalidOperation("Invalid checkpoint passed to Rollback()!");
+    }
+  }
+
+  // A checkpoint which has been rolled back past refers to more operations
+  // than there are; the words of the patches are appended along with them,
+  // so the patches kept end exactly where the checkpoint says the words do
+  if ((checkpoint.edits_count_ > edit_log_.edits.size()) ||
+      (checkpoint.patches_count_ > edit_log_.patches.size()) ||
+      (checkpoint.removals_count_ > edit_log_.removals.size()) ||
+      (checkpoint.patch_words_count_ > edit_log_.patch_words.size())) {
+    throw InvalidOperation("Invalid checkpoint passed to Rollback()!");
+  }
+  uint64_t patch_words_end = 0;
+  if (checkpoint.patches_count_ > 0) {
+    const Patch &last_patch = edit_log_.patches[checkpoint.patches_count_ - 1];
+    patch_words_end = last_patch.offset + last_patch.count;
+  }
+  if (checkpoint.patch_words_count_ != patch_words_end) {
+    throw InvalidOperation("Invalid checkpoint passed to Rollback()!");
+  }
+
+  // The checkpoints of the epochs after the one of the checkpoint, and the
+  // ones of its epoch taken after it, are rolled back past
+  kept_epochs_.resize(kept_index);
+  kept_epochs_.push_back(checkpoint);
+  ++edit_epoch_;
+
+  DropEdits(checkpoint);
+}
+
+void OpcodeStream::ClearEdits() {
+  EditCheckpoint checkpoint;
+  checkpoint.stream_ = this;
+  checkpoint.emitted_words_count_ = original_module_size_;
+  checkpoint.id_bound_ = PeekAt(kSpvIndexBound);
+
+  kept_epochs_.clear();
+  ++edit_epoch_;
+
+  DropEdits(checkpoint);
+}
+
+bool OpcodeStream::IsCheckpointWithin(const EditCheckpoint &checkpoint,
+                                      const EditCheckpoint &last) {
+  return (checkpoint.edits_count_ <= last.edits_count_) &&
+         (checkpoint.patches_count_ <= last.patches_count_) &&
+         (checkpoint.patch_words_count_ <= last.patch_words_count_) &&
+         (checkpoint.removals_count_ <= last.removals_count_);
+}
+
+void OpcodeStream::DropEdits(const EditCheckpoint &checkpoint) {
+  // Instructions operated on for the first time since the checkpoint lose
+  // their edits altogether
+  for (size_t e = checkpoint.edits_count_; e < edit_log_.edits.size(); ++e) {
+    edit_log_.edits_index.erase(edit_log_.edits[e].instruction);
+  }
+  edit_log_.edits.erase(edit_log_.edits.begin() + checkpoint.edits_count_,
+                        edit_log_.edits.end());
+
+  // The other ones had their removals journaled, and their newer patches
+  // sit at the head of their chains
+  for (size_t r = checkpoint.removals_count_; r < edit_log_.removals.size();
+       ++r) {
+    EditsIndex::const_iterator ei =
+        edit_log_.edits_index.find(edit_log_.removals[r]);
+    if (ei != edit_log_.edits_index.end()) {
+      edit_log_.edits[ei->second].remove = false;
+    }
+  }
+  edit_log_.removals.resize(checkpoint.removals_count_);
+
+  const uint32_t patches_count =
+      static_cast<uint32_t>(checkpoint.patches_count_);
+  for (InstructionEdits &edits : edit_log_.edits) {
+    uint32_t *chains[] = {&edits.insert_before, &edits.replace,
+                          &edits.insert_after};
+    for (uint32_t *chain_head : chains) {
+      while ((*chain_head != kNoPatch) && (*chain_head >= patches_count)) {
+        *chain_head = edit_log_.patches[*chain_head].next;
+      }
+    }
+  }
+  edit_log_.patches.resize(checkpoint.patches_count_);
+  edit_log_.patch_words.resize(checkpoint.patch_words_count_);
+
+  emitted_words_count_ = checkpoint.emitted_words_count_;
+  id_counter_.next.store(checkpoint.id_bound_);
+
+  // The definitions get built again on demand, from the words as they are
+  id_definitions_.clear();
+  DropIdUses();
+}
+
+bool OpcodeStream::NeedsEmission() const {
+  return !edit_log_.edits.empty() ||
+         (id_counter_.next.load() > PeekAt(kSpvIndexBound));
+}
+
+ModuleFingerprint OpcodeStream::Fingerprint(
+    const FingerprintOptions &options) const {
+  WordsHasher hasher;
+  const bool walk_instructions = options.ignore_debug || options.canonical_ids;
+
+  // Canonical ids, indexed by id, assigned in order of first appearance
+  std::vector<uint32_t> canonical_ids;
+  std::vector<uint32_t> scratch;
+  uint32_t next_canonical_id = 1;
+  if (options.canonical_ids) {
+    canonical_ids.resize(id_counter_.next.load(), 0);
+  }
+  auto get_canonical_id = [&](uint32_t id) -> uint32_t {
+    if (id >= canonical_ids.size()) {
+      canonical_ids.resize(id + 1, 0);
+    }
+    if (canonical_ids[id] == 0) {
+      canonical_ids[id] = next_canonical_id++;
+    }
+    return canonical_ids[id];
+  };
+
+  size_t position = 0;
+  ForEachEmittedRun([&](const EmittedRun &run) {
+    const uint32_t *words = run.words;
+    size_t count = run.count;
+
+    for (; (count > 0) && (position < kSpvIndexInstruction);
+         ++words, --count, ++position) {
+      uint32_t word = *words;
+      if (((position == kSpvIndexGeneratorNumber) &&
+           options.ignore_generator) ||
+          ((position == kSpvIndexBound) && options.canonical_ids)) {
+        word = 0;
+      }
+      hasher.Update(&word, 1);
+    }
+    position += count;
+
+    if (!walk_instructions) {
+      hasher.Update(words, count);
+      return;
+    }
+
+    // Words kept as they are get hashed in spans; inserted words which don't
+    // split in whole instructions are hashed as they are
+    const uint32_t *span = words;
+    const uint32_t *end = words + count;
+    for (const uint32_t *instruction = words; instruction < end;) {
+      const OpcodeHeader opcode = SplitSpvOpCode(instruction[0]);
+      const size_t words_count = opcode.words_count;
+      if ((words_count == 0) ||
+          (words_count > static_cast<size_t>(end - instruction))) {
+        break;
+      }
+
+      const spv::Op op = static_cast<spv::Op>(opcode.opcode);
+      if (options.ignore_debug && IsDebugOpcode(op)) {
+        hasher.Update(span, static_cast<size_t>(instruction - span));
+        span = instruction + words_count;
+      } else if (options.canonical_ids) {
+        hasher.Update(span, static_cast<size_t>(instruction - span));
+        scratch.assign(instruction, instruction + words_count);
+
+        bool has_result = false;
+        bool has_type = false;
+        GetResultOperands(op, &has_result, &has_type);
+        const size_t result_index = has_type ? 2 : 1;
+        if (has_result && (result_index < words_count)) {
+          scratch[result_index] = get_canonical_id(scratch[result_index]);
+        }
+        ForEachIdOperand(instruction, words_count, *this,
+                         [&](size_t operand) {
+                           scratch[operand] =
+                               get_canonical_id(instruction[operand]);
+                         });
+
+        hasher.Update(scratch.data(), words_count);
+        span = instruction + words_count;
+      }
+
+      instruction += words_count;
+    }
+    hasher.Update(span, static_cast<size_t>(end - span));
+  });
+
+  return hasher.Finish();
+}
+
+size_t OpcodeStream::GetEmittedWordsCount() const {
+  return emitted_words_count_;
+}
+
+void OpcodeStream::EmitWords(std::vector<uint32_t> &words) const {
+  words.clear();
+  words.reserve(emitted_words_count_);
+
+  ForEachEmittedRun([&words](const EmittedRun &run) {
+    words.insert(words.end(), run.words, run.words + run.count);
+  });
+}
+
+size_t OpcodeStream::EmitInto(uint32_t *dst, size_t capacity) const {
+  if (!dst || (capacity < emitted_words_count_)) {
+    throw InvalidParameter("Invalid parameter in EmitInto() of OpcodeStream!");
+  }
+
+  // The space left is checked for each run rather than trusting the count
+  uint32_t *cursor = dst;
+  const uint32_t *const end = dst + capacity;
+  ForEachEmittedRun([&cursor, end](const EmittedRun &run) {
+    if (run.count > static_cast<size_t>(end - cursor)) {
+      throw std::length_error(
+          "Filtered stream does not fit in the buffer passed to EmitInto()!");
+    }
+    std::memcpy(cursor, run.words, run.count * sizeof(uint32_t));
+    cursor += run.count;
+  });
+
+  return static_cast<size_t>(cursor - dst);
+}
+
+SegmentList OpcodeStream::EmitSegments() const {
+  SegmentList list;
+  std::vector<WordsSegment> &segments = list.segments_;
+
+  ForEachEmittedRun(list.bound_.get(), [&segments](const EmittedRun &run) {
+    // Merge with the previous segment if they are contiguous in memory
+    if (!segments.empty() &&
+        ((segments.back().words + segments.back().count) == run.words)) {
+      segments.back().count += run.count;
+    } else {
+      segments.push_back({run.words, run.count});
+    }
+  });
+
+  return list;
+}
+
+void OpcodeStream::EmitTo(int fd) const {
+  // The writer batches the runs, so the bound must outlive the walk
+  FileWriter writer(fd);
+  uint32_t bound = 0;
+
+  ForEachEmittedRun(&bound, [&writer](const EmittedRun &run) {
+    writer.Write(run.words, run.count);
+  });
+
+  writer.Flush();
+}
+
+void OpcodeStream::EmitToFile(const std::string &path) const {
+  int fd = OpenFile(path, kOpenWrite);
+
+  try {
+    EmitTo(fd);
+  } catch (...) {
+    CloseFile(fd);
+    throw;
+  }
+
+  if (CloseFile(fd) != 0) {
+    ThrowFileError("Could not write", path);
+  }
+}
+
+OpcodeStream OpcodeStream::FromFile(const std::string &path) {
+  int fd = OpenFile(path, kOpenRead);
+
+  size_t binary_size = 0;
+  std::shared_ptr<const void> mapping;
+  try {
+    mapping = MapFile(fd, path, &binary_size);
+  } catch (...) {
+    CloseFile(fd);
+    throw;
+  }
+
+  // The mapping stays valid after the file is closed
+  CloseFile(fd);
+
+  if (((binary_size % 4) != 0) || ((binary_size / 4) < kSpvIndexInstruction)) {
+    throw InvalidStream("File " + path + " does not contain a valid module");
+  }
+
+  // Modules of the opposite endianness are swapped into words owned by the
+  // stream, so their mapping is released here rather than kept around
+  OpcodeStream stream(static_cast<const uint32_t *>(mapping.get()),
+                      binary_size / 4, BorrowWords());
+  if (stream.borrowed_words_) {
+    stream.mapping_ = std::move(mapping);
+  }
+
+  return stream;
+}
+
+std::vector<uint32_t> OpcodeStream::GetWordsStream() const {
+  return std::vector<uint32_t>(data(), data() + original_module_size_);
+}
+
+OpcodeStream::iterator OpcodeStream::begin() { return iterator(this, 0); }
+
+OpcodeStream::iterator OpcodeStream::end() { return iterator(this, size()); }
+
+OpcodeStream::reverse_iterator OpcodeStream::rbegin() {
+  return reverse_iterator(this, size() - 1);
+}
+
+// The reverse end sits one before the first instruction
+OpcodeStream::reverse_iterator OpcodeStream::rend() {
+  return reverse_iterator(this, static_cast<size_t>(-1));
+}
+
+OpcodeStream::const_iterator OpcodeStream::end() const {
+  return const_iterator(const_cast<OpcodeStream *>(this), size());
+}
+
+OpcodeStream::const_iterator OpcodeStream::begin() const {
+  return const_iterator(const_cast<OpcodeStream *>(this), 0);
+}
+
+OpcodeStream::const_iterator OpcodeStream::cbegin() const { return begin(); }
+
+OpcodeStream::const_iterator OpcodeStream::cend() const { return end(); }
+
+OpcodeStream::const_reverse_iterator OpcodeStream::rbegin() const {
+  return const_reverse_iterator(const_cast<OpcodeStream *>(this), size() - 1);
+}
+
+OpcodeStream::const_reverse_iterator OpcodeStream::crbegin() const {
+  return rbegin();
+}
+
+OpcodeStream::const_reverse_iterator OpcodeStream::rend() const {
+  return const_reverse_iterator(const_cast<OpcodeStream *>(this),
+                                static_cast<size_t>(-1));
+}
+
+OpcodeStream::const_reverse_iterator OpcodeStream::crend() const {
+  return rend();
+}
+
+size_t OpcodeStream::size() const { return offsets_table_.size(); }
+
+spv::Id OpcodeStream::AllocateId() { return AllocateIds(1); }
+
+spv::Id OpcodeStream::AllocateIds(size_t count) {
+  assert(count);
+  CheckEditable();
+
+  uint32_t first = id_counter_.next.load();
+  do {
+    if (count > (std::numeric_limits<uint32_t>::max() - first)) {
+      throw InvalidOperation("Too many ids allocated in OpcodeStream!");
+    }
+  } while (!id_counter_.next.compare_exchange_weak(
+      first, first + static_cast<uint32_t>(count)));
+
+  return first;
+}
+
+IdBlock OpcodeStream::ReserveIds(size_t count) {
+  return IdBlock(AllocateIds(count), count);
+}
+
+spv::Id OpcodeStream::GetIdBound() const { return id_counter_.next.load(); }
+
+OpcodeStream::range OpcodeStream::Instructions(spv::Op opcode) {
+  size_t first = 0;
+  size_t end = 0;
+  GetOpcodeBucket(opcode, &first, &end);
+
+  return range(this, first, end, opcode_index_.data());
+}
+
+OpcodeStream::const_range OpcodeStream::Instructions(spv::Op opcode) const {
+  size_t first = 0;
+  size_t end = 0;
+  GetOpcodeBucket(opcode, &first, &end);
+
+  return const_range(const_cast<OpcodeStream *>(this), first, end,
+                     opcode_index_.data());
+}
+
+void OpcodeStream::GetOpcodeBucket(spv::Op opcode, size_t *first,
+                                   size_t *end) const {
+  BuildOpcodeIndex();
+
+  size_t bucket = static_cast<size_t>(opcode);
+  if ((bucket + 1) < opcode_index_offsets_.size()) {
+    *first = opcode_index_offsets_[bucket];
+    *end = opcode_index_offsets_[bucket + 1];
+  } else {
+    *first = 0;
+    *end = 0;
+  }
+}
+
+void OpcodeStream::BuildOpcodeIndex() const {
+  if (!opcode_index_offsets_.empty()) {
+    return;
+  }
+
+  const uint32_t *words = data();
+  const size_t terminator_index = offsets_table_.size() - 1;
+
+  // Count the instructions of each opcode
+  OffsetsList bucket_cursors(kOpcodeIndexInitialBuckets, 0);
+  for (size_t i = kSpvIndexInstruction; i < terminator_index; ++i) {
+    size_t opcode = SplitSpvOpCode(words[offsets_table_[i]]).opcode;
+    if (opcode >= bucket_cursors.size()) {
+      bucket_cursors.resize(opcode + 1, 0);
+    }
+    ++bucket_cursors[opcode];
+  }
+
+  // Turn the counts into the start of each bucket
+  opcode_index_offsets_.assign(bucket_cursors.size() + 1, 0);
+  for (size_t opcode = 0; opcode < bucket_cursors.size(); ++opcode) {
+    opcode_index_offsets_[opcode + 1] =
+        opcode_index_offsets_[opcode] + bucket_cursors[opcode];
+    bucket_cursors[opcode] = opcode_index_offsets_[opcode];
+  }
+
+  // Fill the buckets, which keeps each of them in module order
+  opcode_index_.resize(opcode_index_offsets_.back());
+  for (size_t i = kSpvIndexInstruction; i < terminator_index; ++i) {
+    size_t opcode = SplitSpvOpCode(words[offsets_table_[i]]).opcode;
+    opcode_index_[bucket_cursors[opcode]++] = static_cast<uint32_t>(i);
+  }
+}
+
+OpcodeStream::range OpcodeStream::Section(ModuleSection section) {
+  BuildSectionIndex();
+
+  const size_t s = static_cast<size_t>(section);
+  return range(this, section_offsets_[s], section_offsets_[s + 1]);
+}
+
+OpcodeStream::const_range OpcodeStream::Section(ModuleSection section) const {
+  BuildSectionIndex();
+
+  const size_t s = static_cast<size_t>(section);
+  return const_range(const_cast<OpcodeStream *>(this), section_offsets_[s],
+                     section_offsets_[s + 1]);
+}
+
+std::vector<OpcodeStream::range> OpcodeStream::Functions() {
+  BuildSectionIndex();
+
+  std::vector<range> functions;
+  functions.reserve(function_offsets_.size() / 2);
+  for (size_t f = 0; f < function_offsets_.size(); f += 2) {
+    functions.push_back(
+        range(this, function_offsets_[f], function_offsets_[f + 1]));
+  }
+
+  return functions;
+}
+
+std::vector<OpcodeStream::const_range> OpcodeStream::Functions() const {
+  BuildSectionIndex();
+
+  std::vector<const_range> functions;
+  functions.reserve(function_offsets_.size() / 2);
+  for (size_t f = 0; f < function_offsets_.size(); f += 2) {
+    functions.push_back(const_range(const_cast<OpcodeStream *>(this),
+                                    function_offsets_[f],
+                                    function_offsets_[f + 1]));
+  }
+
+  return functions;
+}
+
+void OpcodeStream::RunFunctionPass(const FunctionPass &pass,
+                                   size_t threads_count) {
+  CheckEditable();
+  CheckOutsidePass();
+
+  // The workers only read the indices, so they are built up front; the
+  // def-use chains would be dropped by the operations anyway
+  BuildOpcodeIndex();
+  BuildSectionIndex();
+  BuildIdDefinitions();
+  DropIdUses();
+
+  std::vector<range> functions = Functions();
+  if (threads_count == 0) {
+    threads_count = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  threads_count = std::max<size_t>(std::min(threads_count, functions.size()),
+                                   1);
+
+  std::vector<EditLog> logs(threads_count);
+  std::vector<std::exception_ptr> errors(functions.size());
+  std::atomic<size_t> next_function(0);
+  std::atomic<bool> failed(false);
+
+  // A pass run on another stream from within a pass has the thread which
+  // calls it as a worker, so the worker of the enclosing pass is saved and
+  // put back once it is over
+  struct WorkerScope final {
+    WorkerScope() : previous(pass_worker_) {}
+    ~WorkerScope() { pass_worker_ = previous; }
+
+    const PassWorker previous;
+  };  // struct WorkerScope
+
+  auto work = [&](size_t worker_index) {
+    const WorkerScope scope;
+    pass_worker_.stream = this;
+    pass_worker_.log = &logs[worker_index];
+
+    while (!failed.load(std::memory_order_relaxed)) {
+      const size_t f = next_function.fetch_add(1);
+      if (f >= functions.size()) {
+        break;
+      }
+
+      pass_worker_.first_instruction = function_offsets_[f * 2];
+      pass_worker_.end_instruction = function_offsets_[(f * 2) + 1];
+      try {
+        pass(f, functions[f]);
+      } catch (...) {
+        errors[f] = std::current_exception();
+        failed.store(true, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  // The calling thread is one of the workers
+  std::vector<std::thread> threads;
+  threads.reserve(threads_count - 1);
+  for (size_t t = 1; t < threads_count; ++t) {
+    threads.emplace_back(work, t);
+  }
+  work(0);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  for (const std::exception_ptr &error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  MergeEditLogs(logs);
+}
+
+void OpcodeStream::MergeEditLogs(const std::vector<EditLog> &logs) {
+  // Functions don't overlap, so each instruction has edits in one log at most
+  typedef std::pair<const InstructionEdits *, const EditLog *> LoggedEdits;
+  std::vector<LoggedEdits> edits;
+  for (const EditLog &log : logs) {
+    for (const InstructionEdits &log_edits : log.edits) {
+      edits.push_back(std::make_pair(&log_edits, &log));
+    }
+    emitted_words_count_ += log.emitted_words_delta;
+  }
+
+  std::sort(edits.begin(), edits.end(),
+            [](const LoggedEdits &lhs, const LoggedEdits &rhs) {
+              return lhs.first->instruction < rhs.first->instruction;
+            });
+
+  for (size_t e = 0; e < edits.size(); ++e) {
+    const InstructionEdits &log_edits = *edits[e].first;
+    const EditLog &log = *edits[e].second;
+    const size_t instruction_index = log_edits.instruction;
+
+    InstructionEdits &stream_edits = GetEdits(edit_log_, instruction_index);
+    if (log_edits.remove) {
+      stream_edits.remove = true;
+      edit_log_.removals.push_back(log_edits.instruction);
+      UndefineIds(instruction_index);
+    }
+
+    MergeChain(log, log_edits.insert_before, instruction_index,
+               &stream_edits.insert_before);
+    MergeChain(log, log_edits.replace, instruction_index,
+               &stream_edits.replace);
+    MergeChain(log, log_edits.insert_after, instruction_index,
+               &stream_edits.insert_after);
+  }
+
+  DropIdUses();
+}
+
+void OpcodeStream::MergeChain(const EditLog &log, uint32_t chain_head,
+                              size_t instruction_index,
+                              uint32_t *stream_chain_head) {
+  if (chain_head == kNoPatch) {
+    return;
+  }
+
+  // Chains are linked from the most recent patch, which must end up on top
+  std::vector<uint32_t> chain;
+  for (uint32_t pi = chain_head; pi != kNoPatch; pi = log.patches[pi].next) {
+    chain.push_back(pi);
+  }
+
+  for (std::vector<uint32_t>::const_reverse_iterator pi = chain.rbegin();
+       pi != chain.rend(); ++pi) {
+    const Patch &patch = log.patches[*pi];
+    PushPatch(edit_log_, log.patch_words.data() + patch.offset, patch.count,
+              stream_chain_head);
+    DefineInsertedIds(edit_log_, instruction_index);
+  }
+}
+
+void OpcodeStream::BuildSectionIndex() const {
+  if (!section_offsets_.empty()) {
+    return;
+  }
+
+  const size_t sections_count = static_cast<size_t>(ModuleSection::kCount);
+  const size_t terminator_index = offsets_table_.size() - 1;
+  const uint32_t *words = data();
+
+  // Sections only move forward, so that the sections an instruction skips
+  // over are empty and start where it is; the ones after the last
+  // instruction start at the terminator
+  section_offsets_.assign(sections_count + 1,
+                          static_cast<uint32_t>(terminator_index));
+  size_t current_section = 0;
+  section_offsets_[0] = static_cast<uint32_t>(kSpvIndexInstruction);
+
+  // Extended instructions before the first OpFunction, such as the
+  // non-semantic ones, are at global scope and stay among the types
+  const size_t types_section = static_cast<size_t>(ModuleSection::kTypes);
+  bool seen_function = false;
+
+  size_t function_begin = terminator_index;
+  for (size_t i = kSpvIndexInstruction; i < terminator_index; ++i) {
+    const spv::Op opcode = static_cast<spv::Op>(
+        SplitSpvOpCode(words[offsets_table_[i]]).opcode);
+
+    size_t section = static_cast<size_t>(GetOpcodeSection(opcode));
+    if ((opcode == spv::Op::OpExtInst) && !seen_function) {
+      section = types_section;
+    }
+    for (; current_section < section; ++current_section) {
+      section_offsets_[current_section + 1] = static_cast<uint32_t>(i);
+    }
+
+    if (opcode == spv::Op::OpFunction) {
+      function_begin = i;
+      seen_function = true;
+    } else if ((opcode == spv::Op::OpFunctionEnd) &&
+               (function_begin < terminator_index)) {
+      function_offsets_.push_back(static_cast<uint32_t>(function_begin));
+      function_offsets_.push_back(static_cast<uint32_t>(i + 1));
+      function_begin = terminator_index;
+    }
+  }
+}
+
+OpcodeStream::iterator OpcodeStream::FindDefinition(spv::Id id) {
+  const IdDefinition *definition = FindIdDefinition(id);
+
+  return definition ? iterator(this, definition->instruction) : end();
+}
+
+OpcodeStream::const_iterator OpcodeStream::FindDefinition(spv::Id id) const {
+  const IdDefinition *definition = FindIdDefinition(id);
+
+  return definition
+             ? const_iterator(const_cast<OpcodeStream *>(this),
+                              definition->instruction)
+             : end();
+}
+
+const uint32_t *OpcodeStream::GetDefinitionWords(spv::Id id) const {
+  const IdDefinition *definition = FindIdDefinition(id);
+  if (!definition) {
+    return nullptr;
+  }
+
+  return (definition->offset < original_module_size_)
+             ? (data() + definition->offset)
+             : (edit_log_.patch_words.data() +
+                (definition->offset - original_module_size_));
+}
+
+spv::Id OpcodeStream::GetResultType(spv::Id id) const {
+  const IdDefinition *definition = FindIdDefinition(id);
+
+  return definition ? definition->type : 0;
+}
+
+const OpcodeStream::IdDefinition *OpcodeStream::FindIdDefinition(
+    spv::Id id) const {
+  BuildIdDefinitions();
+
+  if ((id >= id_definitions_.size()) ||
+      (id_definitions_[id].instruction == kNoDefinition)) {
+    return nullptr;
+  }
+
+  return &id_definitions_[id];
+}
+
+void OpcodeStream::BuildIdDefinitions() const {
+  if (!id_definitions_.empty()) {
+    return;
+  }
+
+  const IdDefinition no_definition = {kNoDefinition, 0, 0};
+  id_definitions_.assign(std::max<size_t>(PeekAt(kSpvIndexBound), 1),
+                         no_definition);
+
+  const uint32_t *words = data();
+  const size_t terminator_index = offsets_table_.size() - 1;
+  for (size_t i = kSpvIndexInstruction; i < terminator_index; ++i) {
+    DefineIds(i, words + offsets_table_[i], GetInstructionWordsCount(i),
+              offsets_table_[i]);
+  }
+
+  // Operations applied before the table has been built
+  for (const InstructionEdits &edits : edit_log_.edits) {
+    if (edits.remove) {
+      UndefineIds(edits.instruction);
+    }
+  }
+
+  ForEachInsertedPatch([this](size_t instruction_index, const Patch &patch) {
+    DefineIds(instruction_index, edit_log_.patch_words.data() + patch.offset,
+              patch.count, original_module_size_ + patch.offset);
+  });
+}
+
+template <typename Visitor>
+void OpcodeStream::ForEachInsertedPatch(Visitor &&visitor) const {
+  for (const InstructionEdits *edits : GetSortedEdits()) {
+    // Words around the header are header words, and the ones around the
+    // terminator are never emitted
+    if ((edits->instruction < kSpvIndexInstruction) ||
+        IsTerminator(edits->instruction)) {
+      continue;
+    }
+
+    const uint32_t chains[] = {edits->insert_before, edits->replace,
+                               edits->insert_after};
+    for (uint32_t patch_index : chains) {
+      for (; patch_index != kNoPatch;
+           patch_index = edit_log_.patches[patch_index].next) {
+        visitor(static_cast<size_t>(edits->instruction),
+                edit_log_.patches[patch_index]);
+      }
+    }
+  }
+}
+
+void OpcodeStream::DefineIds(size_t instruction_index, const uint32_t *words,
+                             size_t words_count, uint64_t offset) const {
+  size_t word_index = 0;
+  while (word_index < words_count) {
+    OpcodeHeader header = SplitSpvOpCode(words[word_index]);
+    // Inserted words which don't split in whole instructions define nothing
+    if ((header.words_count == 0) ||
+        ((word_index + header.words_count) > words_count)) {
+      return;
+    }
+
+    bool has_result = false;
+    bool has_type = false;
+    GetResultOperands(static_cast<spv::Op>(header.opcode), &has_result,
+                      &has_type);
+
+    const size_t result_index = has_type ? 2 : 1;
+    if (has_result && (result_index < header.words_count)) {
+      spv::Id id = words[word_index + result_index];
+      if (id >= id_definitions_.size()) {
+        const IdDefinition no_definition = {kNoDefinition, 0, 0};
+        id_definitions_.resize(static_cast<size_t>(id) + 1, no_definition);
+      }
+
+      IdDefinition &definition = id_definitions_[id];
+      definition.instruction = static_cast<uint32_t>(instruction_index);
+      definition.type = has_type ? words[word_index + 1] : 0;
+      definition.offset = offset + word_index;
+    }
+
+    word_index += header.words_count;
+  }
+}
+
+void OpcodeStream::DefineInsertedIds(const EditLog &log,
+                                     size_t instruction_index) {
+  // The table picks up the inserted words once it gets built, and the words
+  // of a worker log once they are merged
+  if (IsWorkerLog(log) || id_definitions_.empty() ||
+      (instruction_index < kSpvIndexInstruction) ||
+      IsTerminator(instruction_index)) {
+    return;
+  }
+
+  const Patch &patch = edit_log_.patches.back();
+  DefineIds(instruction_index, edit_log_.patch_words.data() + patch.offset,
+            patch.count, original_module_size_ + patch.offset);
+}
+
+void OpcodeStream::UndefineIds(size_t instruction_index) const {
+  if (id_definitions_.empty() || (instruction_index < kSpvIndexInstruction) ||
+      IsTerminator(instruction_index)) {
+    return;
+  }
+
+  const size_t offset = offsets_table_[instruction_index];
+  OpcodeHeader header = SplitSpvOpCode(PeekAt(offset));
+
+  bool has_result = false;
+  bool has_type = false;
+  GetResultOperands(static_cast<spv::Op>(header.opcode), &has_result,
+                    &has_type);
+
+  const size_t result_index = has_type ? 2 : 1;
+  if (!has_result || (result_index >= header.words_count)) {
+    return;
+  }
+
+  // Only drop the definition if it still comes from this instruction
+  spv::Id id = PeekAt(offset + result_index);
+  if ((id < id_definitions_.size()) &&
+      (id_definitions_[id].offset == offset)) {
+    id_definitions_[id].instruction = kNoDefinition;
+  }
+}
+
+IdUseRange OpcodeStream::GetUses(spv::Id id) const {
+  CheckOutsidePass();
+  BuildIdUses();
+
+  if ((static_cast<size_t>(id) + 1) >= id_use_offsets_.size()) {
+    return {nullptr, nullptr};
+  }
+
+  return {id_uses_.data() + id_use_offsets_[id],
+          id_uses_.data() + id_use_offsets_[id + 1]};
+}
+
+void OpcodeStream::ReplaceAllUsesWith(spv::Id old_id, spv::Id new_id) {
+  CheckEditable();
+  CheckOutsidePass();
+  CheckExtInstOperands("ReplaceAllUsesWith()");
+  Promote();
+
+  for (const IdUse &use : GetUses(old_id)) {
+    *GetWordAt(use.offset) = new_id;
+  }
+
+  // Result types are uses as well
+  for (IdDefinition &definition : id_definitions_) {
+    if (definition.type == old_id) {
+      definition.type = new_id;
+    }
+  }
+
+  DropIdUses();
+}
+
+void OpcodeStream::RemapIds(const std::vector<spv::Id> &id_map) {
+  CheckEditable();
+  CheckOutsidePass();
+  CheckExtInstOperands("RemapIds()");
+  Promote();
+  BuildIdUses();
+  BuildIdDefinitions();
+
+  const size_t ids_count =
+      std::min(id_map.size(), id_use_offsets_.size() - 1);
+  for (size_t id = 0; id < ids_count; ++id) {
+    if (id_map[id] == 0) {
+      continue;
+    }
+
+    for (size_t u = id_use_offsets_[id]; u < id_use_offsets_[id + 1]; ++u) {
+      *GetWordAt(id_uses_[u].offset) = id_map[id];
+    }
+  }
+
+  // Result ids sit after the result type, if any; the definitions move to
+  // their new ids along with them
+  IdDefinitionsList old_definitions;
+  old_definitions.swap(id_definitions_);
+  const IdDefinition no_definition = {kNoDefinition, 0, 0};
+  id_definitions_.assign(old_definitions.size(), no_definition);
+
+  for (size_t id = 0; id < old_definitions.size(); ++id) {
+    IdDefinition definition = old_definitions[id];
+    if (definition.instruction == kNoDefinition) {
+      continue;
+    }
+
+    spv::Id new_id = static_cast<spv::Id>(id);
+    if ((id < id_map.size()) && (id_map[id] != 0)) {
+      new_id = id_map[id];
+
+      uint32_t *words = GetWordAt(definition.offset);
+      bool has_result = false;
+      bool has_type = false;
+      GetResultOperands(static_cast<spv::Op>(SplitSpvOpCode(words[0]).opcode),
+                        &has_result, &has_type);
+      words[has_type ? 2 : 1] = new_id;
+    }
+
+    if ((definition.type < id_map.size()) && (id_map[definition.type] != 0)) {
+      definition.type = id_map[definition.type];
+    }
+
+    if (new_id >= id_definitions_.size()) {
+      id_definitions_.resize(static_cast<size_t>(new_id) + 1, no_definition);
+    }
+    id_definitions_[new_id] = definition;
+  }
+
+  DropIdUses();
+}
+
+void OpcodeStream::CheckExtInstOperands(const char *operation) const {
+  ForEachEmittedInstruction([operation, this](const uint32_t *words,
+                                              size_t words_count) {
+    if ((SplitSpvOpCode(words[0]).opcode ==
+         static_cast<uint16_t>(spv::Op::OpExtInst)) &&
+        !HasIdOperandsOnly(words, words_count, *this)) {
+      std::stringstream msg_stream;
+      msg_stream << "Extended instruction " << words[4]
+                 << " of a set whose operands aren't all ids can't have its "
+                    "ids rewritten by "
+                 << operation;
+      throw InvalidStream(msg_stream.str());
+    }
+  });
+}
+
+void OpcodeStream::BuildIdUses() const {
+  if (!id_use_offsets_.empty()) {
+    return;
+  }
+
+  // Count the uses of each id
+  OffsetsList bucket_cursors(std::max<size_t>(PeekAt(kSpvIndexBound), 1), 0);
+  ForEachIdUse([&bucket_cursors](spv::Id id, const IdUse &) {
+    if (id >= bucket_cursors.size()) {
+      bucket_cursors.resize(static_cast<size_t>(id) + 1, 0);
+    }
+    ++bucket_cursors[id];
+  });
+
+  // Turn the counts into the start of each bucket
+  id_use_offsets_.assign(bucket_cursors.size() + 1, 0);
+  for (size_t id = 0; id < bucket_cursors.size(); ++id) {
+    id_use_offsets_[id + 1] = id_use_offsets_[id] + bucket_cursors[id];
+    bucket_cursors[id] = id_use_offsets_[id];
+  }
+
+  // Fill the buckets, which keeps the uses in the order they are visited
+  id_uses_.resize(id_use_offsets_.back());
+  ForEachIdUse([this, &bucket_cursors](spv::Id id, const IdUse &use) {
+    id_uses_[bucket_cursors[id]++] = use;
+  });
+}
+
+void OpcodeStream::DropIdUses() {
+  id_use_offsets_.clear();
+  id_uses_.clear();
+  dependency_graph_.reset();
+}
+
+template <typename Visitor>
+void OpcodeStream::ForEachIdUse(Visitor &&visitor) const {
+  // Visit the id operands of the whole instructions in words
+  auto visit_words = [&](size_t instruction_index, const uint32_t *words,
+                         size_t words_count, uint64_t offset) {
+    size_t word_index = 0;
+    while (word_index < words_count) {
+      const size_t inst_word_count =
+          SplitSpvOpCode(words[word_index]).words_count;
+      if ((inst_word_count == 0) ||
+          ((word_index + inst_word_count) > words_count)) {
+        return;
+      }
+
+      const uint32_t *inst_words = words + word_index;
+      const uint64_t inst_offset = offset + word_index;
+      ForEachIdOperand(inst_words, inst_word_count, *this,
+                       [&](size_t operand) {
+                         IdUse use = {
+                             static_cast<uint32_t>(instruction_index),
+                             static_cast<uint32_t>(operand),
+                             inst_offset + operand};
+                         visitor(static_cast<spv::Id>(inst_words[operand]),
+                                 use);
+                       });
+
+      word_index += inst_word_count;
+    }
+  };
+
+  const uint32_t *words = data();
+  const size_t terminator_index = offsets_table_.size() - 1;
+  for (size_t i = kSpvIndexInstruction; i < terminator_index; ++i) {
+    if (!edit_log_.edits.empty()) {
+      const InstructionEdits *edits = FindEdits(edit_log_, i);
+      if (edits && edits->remove) {
+        continue;
+      }
+    }
+
+    visit_words(i, words + offsets_table_[i], GetInstructionWordsCount(i),
+                offsets_table_[i]);
+  }
+
+  ForEachInsertedPatch([&](size_t instruction_index, const Patch &patch) {
+    visit_words(instruction_index, edit_log_.patch_words.data() + patch.offset,
+                patch.count, original_module_size_ + patch.offset);
+  });
+}
+
+uint32_t *OpcodeStream::GetWordAt(uint64_t offset) {
+  if (offset < original_module_size_) {
+    return &module_stream_[static_cast<size_t>(offset)];
+  }
+
+  return &edit_log_.patch_words[static_cast<size_t>(
+      offset - original_module_size_)];
+}
+
+OpcodeIterator::OpcodeIterator(size_t, std::vector<uint32_t> &)
+    : stream_(nullptr), index_(0) {
+  throw InvalidOperation(
+      "Handles can only be obtained from an OpcodeStream or its iterators!");
+}
+
+spv::Op OpcodeIterator::GetOpcode() const {
+  uint32_t header_word = GetFirstWord();
+
+  return static_cast<spv::Op>(SplitSpvOpCode(header_word).opcode);
+}
+
+size_t OpcodeIterator::GetWordCount() const {
+  uint32_t header_word = GetFirstWord();
+
+  return static_cast<size_t>(SplitSpvOpCode(header_word).words_count);
+}
+
+size_t OpcodeIterator::offset() const {
+  return stream_->offsets_table_[index_];
+}
+
+uint32_t OpcodeIterator::GetWord(size_t word_index) const {
+  return stream_->PeekAt(offset() + word_index);
+}
+
+const uint32_t *OpcodeIterator::data() const {
+  return stream_->data() + offset();
+}
+
+std::vector<uint32_t> &OpcodeIterator::GetWords() {
+  stream_->CheckEditable();
+  stream_->CheckOutsidePass();
+
+  // Words of a mapped file are moved in the stream on first direct access
+  stream_->Promote();
+
+  return stream_->module_stream_;
+}
+
+void OpcodeIterator::SetWord(size_t word_index, uint32_t word) {
+  stream_->CheckEditable();
+  stream_->CheckOutsidePass();
+
+  if ((index_ < kSpvIndexInstruction) || stream_->IsTerminator(index_) ||
+      (word_index == 0) || (word_index >= GetWordCount())) {
+    throw InvalidParameter("Invalid word passed to SetWord()!");
+  }
+
+  stream_->OverwriteWords(index_, word_index, &word, 1);
+}
+
+void OpcodeIterator::InsertBefore(const uint32_t *instructions,
+                                  size_t words_count) {
+  assert(instructions && words_count);
+  stream_->CheckEditable();
+
+  OpcodeStream::EditLog &log = stream_->GetEditLog(index_);
+  OpcodeStream::InstructionEdits &edits = stream_->GetEdits(log, index_);
+  stream_->PushPatch(log, instructions, words_count, &edits.insert_before);
+  stream_->AccountEmittedWords(log, index_, words_count);
+  stream_->DefineInsertedIds(log, index_);
+}
+
+void OpcodeIterator::InsertAfter(const uint32_t *instructions,
+                                 size_t words_count) {
+  assert(instructions && words_count);
+  stream_->CheckEditable();
+
+  OpcodeStream::EditLog &log = stream_->GetEditLog(index_);
+  OpcodeStream::InstructionEdits &edits = stream_->GetEdits(log, index_);
+  stream_->PushPatch(log, instructions, words_count, &edits.insert_after);
+  stream_->AccountEmittedWords(log, index_, words_count);
+  stream_->DefineInsertedIds(log, index_);
+}
+
+void OpcodeIterator::InsertBefore(const InstructionBuilder &instruction) {
+  InsertBefore(instruction.data(), instruction.size());
+}
+
+void OpcodeIterator::InsertAfter(const InstructionBuilder &instruction) {
+  InsertAfter(instruction.data(), instruction.size());
+}
+
+void OpcodeIterator::Replace(const InstructionBuilder &instruction) {
+  Replace(instruction.data(), instruction.size());
 }
 
 void OpcodeIterator::Remove() {
-  if (remove_) {
+  stream_->CheckEditable();
+
+  OpcodeStream::EditLog &log = stream_->GetEditLog(index_);
+  if (stream_->IsRemoved(log, index_)) {
     throw InvalidOperation("Called Remove() more than once!");
   }
 
-  remove_ = true;
+  stream_->GetEdits(log, index_).remove = true;
+  log.removals.push_back(static_cast<uint32_t>(index_));
+  stream_->AccountEmittedWords(
+      log, index_,
+      -static_cast<ptrdiff_t>(stream_->GetInstructionWordsCount(index_)));
+
+  // Workers leave the definitions alone until their log gets merged
+  if (!stream_->IsWorkerLog(log)) {
+    stream_->UndefineIds(index_);
+    stream_->DropIdUses();
+  }
 }
 
 void OpcodeIterator::Replace(const uint32_t *instructions, size_t words_count) {
   assert(instructions && words_count);
+  stream_->CheckEditable();
 
-  if (replace_count() > 0) {
+  OpcodeStream::EditLog &log = stream_->GetEditLog(index_);
+  if (stream_->IsReplaced(log, index_)) {
     throw InvalidOperation("Called Replace() more than once!");
   }
 
+  if (stream_->CanReplaceInPlace(log, index_, instructions, words_count)) {
+    stream_->OverwriteWords(index_, 0, instructions, words_count);
+    return;
+  }
+
   // Since we are replacing, remove the old instruction
   Remove();
 
-  // Offset before new words are inserted
-  size_t previous_offset = words_.size();
-
-  // +1 is for the end marker
-  words_.reserve(previous_offset + words_count + 1);
-  words_.insert(words_.end(), instructions, instructions + words_count);
-
-  // Add the end marker
-  words_.push_back(kMarker);
-
-  replace_offset_ = previous_offset;
-  replace_count_ = words_count;
+  OpcodeStream::InstructionEdits &edits = stream_->GetEdits(log, index_);
+  stream_->PushPatch(log, instructions, words_count, &edits.replace);
+  stream_->AccountEmittedWords(log, index_, words_count);
+  stream_->DefineInsertedIds(log, index_);
 }
 
-uint32_t OpcodeIterator::GetFirstWord() const { return words_[offset_]; }
+uint32_t OpcodeIterator::GetFirstWord() const {
+  return stream_->PeekAt(offset());
+}
 
 }  // namespace sut
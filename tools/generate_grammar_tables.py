@@ -0,0 +1,258 @@
+#!/usr/bin/env python
+
+#  MIT License
+
+#  Copyright (c) 2017 Alberto Taiuti
+
+#  Permission is hereby granted, free of charge, to any person obtaining a copy
+#  of this software and associated documentation files (the "Software"), to deal
+#  in the Software without restriction, including without limitation the rights
+#  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+#  copies of the Software, and to permit persons to whom the Software is
+#  furnished to do so, subject to the following conditions:
+
+#  The above copyright notice and this permission notice shall be included in all
+#  copies or substantial portions of the Software.
+
+#  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+#  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+#  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+#  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+#  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+#  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+#  SOFTWARE.
+
+"""Generate the operand grammar tables of sut from spirv.core.grammar.json.
+
+Usage: generate_grammar_tables.py <spirv.core.grammar.json> <output header>
+
+For each opcode the tables hold whether it has a result id and a result type
+id, followed by the kinds of its operands up to the last one which can hold
+an id, packed in a single 32 bits word.
+"""
+
+from __future__ import print_function
+
+import json
+import sys
+
+# Must match the constants emitted in the header below
+OPERAND_KINDS = [
+    'kEnd',
+    'kId',
+    'kLiteral',
+    'kLiteralString',
+    'kIds',
+    'kImageOperands',
+    'kIdLiteralPairs',
+    'kLiteralIdPairs',
+    'kSpecConstantOp',
+]
+OPERAND_KIND_BITS = 4
+FIRST_OPERAND_SHIFT = 4
+MAX_OPERANDS = (32 - FIRST_OPERAND_SHIFT) // OPERAND_KIND_BITS
+
+# Opcodes below this are stored in a flat table, the others in a short list
+CORE_OPCODES_LIMIT = 4096
+
+ID_KINDS = ('IdRef', 'IdScope', 'IdMemorySemantics')
+
+
+def get_operand_kind(kind, quantifier):
+    """Map an operand of the grammar to the kind of the tables."""
+    if kind in ID_KINDS:
+        return 'kIds' if quantifier == '*' else 'kId'
+    if kind == 'PairIdRefIdRef':
+        return 'kIds'
+    if kind == 'PairIdRefLiteralInteger':
+        return 'kIdLiteralPairs'
+    if kind == 'PairLiteralIntegerIdRef':
+        return 'kLiteralIdPairs'
+    if kind == 'LiteralString':
+        return 'kLiteralString'
+    if kind == 'LiteralSpecConstantOpInteger':
+        return 'kSpecConstantOp'
+    if kind == 'ImageOperands':
+        return 'kImageOperands'
+    # Enumerants with parameters are always the last operand, so their
+    # parameters are trailing literals
+    return 'kLiteral'
+
+
+def encode_instruction(instruction):
+    """Return the packed grammar word of an instruction."""
+    word = 0
+    operands = []
+    for operand in instruction.get('operands', []):
+        kind = operand['kind']
+        if kind == 'IdResultType':
+            word |= 2
+        elif kind == 'IdResult':
+            word |= 1
+        else:
+            operands.append(get_operand_kind(kind,
+                                             operand.get('quantifier', '')))
+
+    # Trailing literals hold no ids, so the tables can stop before them;
+    # otherwise trailing ids are ids up to the end of the instruction
+    if operands and operands[-1] in ('kLiteral', 'kLiteralString'):
+        while operands and operands[-1] in ('kLiteral', 'kLiteralString'):
+            operands.pop()
+    elif operands and operands[-1] in ('kId', 'kIds'):
+        while operands and operands[-1] in ('kId', 'kIds'):
+            operands.pop()
+        operands.append('kIds')
+
+    if len(operands) > MAX_OPERANDS:
+        raise ValueError('Too many operands for ' + instruction['opname'])
+
+    for index, kind in enumerate(operands):
+        word |= OPERAND_KINDS.index(kind) << (FIRST_OPERAND_SHIFT +
+                                              index * OPERAND_KIND_BITS)
+
+    return word
+
+
+def generate(grammar):
+    """Return the content of the header for a grammar."""
+    instructions = sorted(grammar['instructions'],
+                          key=lambda instruction: instruction['opcode'])
+    core = [i for i in instructions if i['opcode'] < CORE_OPCODES_LIMIT]
+    extensions = [i for i in instructions
+                  if i['opcode'] >= CORE_OPCODES_LIMIT]
+
+    core_count = core[-1]['opcode'] + 1
+    core_words = ['0x00000000'] * core_count
+    core_names = ['unused'] * core_count
+    for instruction in core:
+        core_words[instruction['opcode']] = '0x%08X' % encode_instruction(
+            instruction)
+        core_names[instruction['opcode']] = instruction['opname']
+
+    lines = []
+    lines.append('// Generated by tools/generate_grammar_tables.py from '
+                 'spirv.core.grammar.json')
+    lines.append('// version %d.%d revision %d; do not edit' %
+                 (grammar['major_version'], grammar['minor_version'],
+                  grammar['revision']))
+    lines.append('')
+    lines.append('#ifndef SPV_GRAMMAR_TABLES_H')
+    lines.append('#define SPV_GRAMMAR_TABLES_H')
+    lines.append('')
+    lines.append('#include <cstdint>')
+    lines.append('')
+    lines.append('namespace sut {')
+    lines.append('namespace grammar {')
+    lines.append('')
+    lines.append('// Kinds of the operands following the result type and the '
+                 'result')
+    lines.append('enum OperandKind : uint32_t {')
+    comments = [
+        'No more operands holding ids, the rest are literals',
+        'Single id',
+        'Single literal word, enumerant or mask',
+        'Nul terminated literal string',
+        'Ids up to the end of the instruction',
+        'Image operands mask followed by ids up to the end',
+        'Pairs of an id and a literal word up to the end',
+        'Pairs of a literal as wide as the selector and an id up to the end',
+        'Opcode followed by the operands of that opcode',
+    ]
+    for index, kind in enumerate(OPERAND_KINDS):
+        lines.append('  // ' + comments[index])
+        lines.append('  %s = %d,' % (kind, index))
+    lines.append('};')
+    lines.append('')
+    lines.append('constexpr uint32_t kHasResult = 0x1;')
+    lines.append('constexpr uint32_t kHasResultType = 0x2;')
+    lines.append('constexpr uint32_t kOperandKindBits = %d;' %
+                 OPERAND_KIND_BITS)
+    lines.append('constexpr uint32_t kOperandKindMask = 0x%X;' %
+                 ((1 << OPERAND_KIND_BITS) - 1))
+    lines.append('constexpr uint32_t kFirstOperandShift = %d;' %
+                 FIRST_OPERAND_SHIFT)
+    lines.append('')
+    lines.append('// Grammar words of the opcodes from 0 to %d' %
+                 (core_count - 1))
+    lines.append('constexpr uint32_t kCoreOpcodesCount = %d;' % core_count)
+    lines.append('constexpr uint32_t kCoreOpcodes[kCoreOpcodesCount] = {')
+    for opcode in range(core_count):
+        lines.append('    %s,  // %s' % (core_words[opcode],
+                                         core_names[opcode]))
+    lines.append('};')
+    lines.append('')
+    lines.append('// Grammar words of the opcodes of the extensions, sorted '
+                 'by opcode')
+    lines.append('struct ExtensionOpcode {')
+    lines.append('  uint32_t opcode;')
+    lines.append('  uint32_t grammar;')
+    lines.append('};')
+    lines.append('constexpr uint32_t kExtensionOpcodesCount = %d;' %
+                 len(extensions))
+    lines.append('constexpr ExtensionOpcode '
+                 'kExtensionOpcodes[kExtensionOpcodesCount] = {')
+    for instruction in extensions:
+        lines.append('    {%d, 0x%08X},  // %s' %
+                     (instruction['opcode'], encode_instruction(instruction),
+                      instruction['opname']))
+    lines.append('};')
+    lines.append('')
+    lines.append('constexpr uint32_t FindExtensionOpcode(uint32_t opcode, '
+                 'uint32_t index) {')
+    lines.append('  return (index >= kExtensionOpcodesCount)')
+    lines.append('             ? 0')
+    lines.append('             : (kExtensionOpcodes[index].opcode == opcode)')
+    lines.append('                   ? kExtensionOpcodes[index].grammar')
+    lines.append('                   : FindExtensionOpcode(opcode, '
+                 'index + 1);')
+    lines.append('}')
+    lines.append('')
+    lines.append('// Grammar word of an opcode; unknown opcodes have neither '
+                 'results nor ids')
+    lines.append('constexpr uint32_t GetOpcodeGrammar(uint32_t opcode) {')
+    lines.append('  return (opcode < kCoreOpcodesCount) ? '
+                 'kCoreOpcodes[opcode]')
+    lines.append('                                      : '
+                 'FindExtensionOpcode(opcode, 0);')
+    lines.append('}')
+    lines.append('')
+    lines.append('constexpr bool HasResult(uint32_t grammar) {')
+    lines.append('  return (grammar & kHasResult) != 0;')
+    lines.append('}')
+    lines.append('')
+    lines.append('constexpr bool HasResultType(uint32_t grammar) {')
+    lines.append('  return (grammar & kHasResultType) != 0;')
+    lines.append('}')
+    lines.append('')
+    lines.append('// Kinds of the operands, the first one in the lowest bits')
+    lines.append('constexpr uint32_t GetOperandKinds(uint32_t grammar) {')
+    lines.append('  return grammar >> kFirstOperandShift;')
+    lines.append('}')
+    lines.append('')
+    lines.append('}  // namespace grammar')
+    lines.append('}  // namespace sut')
+    lines.append('')
+    lines.append('#endif')
+    lines.append('')
+
+    return '\n'.join(lines)
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__, file=sys.stderr)
+        return 1
+
+    with open(sys.argv[1]) as grammar_file:
+        grammar = json.load(grammar_file)
+
+    content = generate(grammar)
+
+    with open(sys.argv[2], 'w') as header_file:
+        header_file.write(content)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
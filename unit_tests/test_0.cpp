@@ -23,11 +23,19 @@
 */
 
 #include <spv_utils.h>
+#include <spv_batch.h>
+#include <spv_codec.h>
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <catch.hpp>
 #include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
 
 #define STR_EXPAND(str) #str
 #define STR(str) STR_EXPAND(str)
@@ -154,6 +162,1292 @@ TEST_CASE("spv utils is tested with correct spir-v binary",
               ((size / 4) + (longer_instruction.size() * 2)));
     }
 
+    SECTION("Emitting without operations reproduces the original module") {
+      sut::OpcodeStream stream(data, size);
+
+      sut::OpcodeStream new_stream = stream.EmitFilteredStream();
+
+      REQUIRE(new_stream.GetWordsStream() == stream.GetWordsStream());
+      REQUIRE(new_stream.size() == stream.size());
+    }
+
+    SECTION("Operations are emitted in place of the right instruction") {
+      sut::OpcodeStream stream(data, size);
+      size_t capability_offset = 0;
+      for (auto &i : stream) {
+        if (i.GetOpcode() == spv::Op::OpCapability) {
+          capability_offset = i.offset();
+          i.InsertBefore(longer_instruction.data(), longer_instruction.size());
+          i.InsertBefore(longer_instruction_2.data(),
+                         longer_instruction_2.size());
+          i.InsertAfter(&instruction_0, 1U);
+        }
+      }
+
+      std::vector<uint32_t> old_module = stream.GetWordsStream();
+      std::vector<uint32_t> new_module =
+          stream.EmitFilteredStream().GetWordsStream();
+
+      std::vector<uint32_t> expected_module(
+          old_module.begin(), old_module.begin() + capability_offset);
+      expected_module.insert(expected_module.end(),
+                             longer_instruction_2.begin(),
+                             longer_instruction_2.end());
+      expected_module.insert(expected_module.end(), longer_instruction.begin(),
+                             longer_instruction.end());
+      expected_module.insert(expected_module.end(),
+                             old_module.begin() + capability_offset,
+                             old_module.begin() + capability_offset + 2);
+      expected_module.push_back(instruction_0);
+      expected_module.insert(expected_module.end(),
+                             old_module.begin() + capability_offset + 2,
+                             old_module.end());
+
+      REQUIRE(new_module == expected_module);
+    }
+
+    SECTION("Segments of the filtered stream concatenate to its words") {
+      sut::OpcodeStream stream(data, size);
+      for (auto &i : stream) {
+        if (i.GetOpcode() == spv::Op::OpCapability) {
+          i.InsertAfter(longer_instruction.data(), longer_instruction.size());
+        }
+      }
+
+      sut::SegmentList segments = stream.EmitSegments();
+      std::vector<uint32_t> concatenated_module;
+      for (const sut::WordsSegment &segment : segments) {
+        concatenated_module.insert(concatenated_module.end(), segment.words,
+                                   segment.words + segment.count);
+      }
+
+      // The untouched instructions before and after the insertion are merged
+      REQUIRE(segments.size() == 3);
+      REQUIRE(segments[0].words == stream.data());
+      REQUIRE(concatenated_module ==
+              stream.EmitFilteredStream().GetWordsStream());
+    }
+
+    SECTION("A raised bound belongs to the segments it is emitted in") {
+      sut::OpcodeStream stream(data, size);
+      stream.AllocateIds(10);
+      const std::vector<uint32_t> expected =
+          stream.EmitFilteredStream().GetWordsStream();
+
+      // Segments outlive a move of the stream and later emissions
+      sut::SegmentList segments = stream.EmitSegments();
+      sut::OpcodeStream moved(std::move(stream));
+      moved.AllocateIds(10);
+      std::vector<uint32_t> words;
+      moved.EmitWords(words);
+      REQUIRE(words[3] == (expected[3] + 10));
+
+      std::vector<uint32_t> concatenated_module;
+      for (const sut::WordsSegment &segment : segments) {
+        concatenated_module.insert(concatenated_module.end(), segment.words,
+                                   segment.words + segment.count);
+      }
+      REQUIRE(concatenated_module == expected);
+
+      // Concurrent emissions of the same stream don't share the bound
+      std::vector<uint32_t> first;
+      std::vector<uint32_t> second;
+      std::thread thread([&]() {
+        for (int r = 0; r < 100; ++r) {
+          moved.EmitWords(first);
+        }
+      });
+      for (int r = 0; r < 100; ++r) {
+        moved.EmitWords(second);
+      }
+      thread.join();
+      REQUIRE(first == words);
+      REQUIRE(second == words);
+    }
+
+    SECTION("Emitting words only matches the filtered stream") {
+      sut::OpcodeStream stream(data, size);
+      for (auto &i : stream) {
+        if (i.GetOpcode() == spv::Op::OpCapability) {
+          i.InsertBefore(longer_instruction.data(), longer_instruction.size());
+          i.Replace(longer_instruction_2.data(), longer_instruction_2.size());
+        } else if (i.GetOpcode() == spv::Op::OpName) {
+          i.Remove();
+        }
+      }
+
+      sut::OpcodeStream new_stream = stream.EmitFilteredStream();
+      std::vector<uint32_t> new_module = new_stream.GetWordsStream();
+      REQUIRE(stream.GetEmittedWordsCount() == new_module.size());
+
+      std::vector<uint32_t> emitted_words;
+      stream.EmitWords(emitted_words);
+      REQUIRE(emitted_words == new_module);
+
+      std::vector<uint32_t> buffer(new_module.size());
+      REQUIRE(stream.EmitInto(buffer.data(), buffer.size()) ==
+              new_module.size());
+      REQUIRE(buffer == new_module);
+      REQUIRE_THROWS_AS(stream.EmitInto(buffer.data(), buffer.size() - 1),
+                        sut::InvalidParameter);
+
+      // The offsets derived while emitting match the ones of a fresh parse
+      sut::OpcodeStream parsed_stream(new_module);
+      REQUIRE(new_stream.size() == parsed_stream.size());
+      sut::OpcodeStream::const_iterator pi = parsed_stream.cbegin();
+      for (sut::OpcodeStream::const_iterator ni = new_stream.cbegin();
+           ni != new_stream.cend(); ni++, pi++) {
+        REQUIRE(ni->offset() == pi->offset());
+      }
+    }
+
+    SECTION("Reverse iteration visits the instructions in reverse order") {
+      sut::OpcodeStream stream(data, size);
+      std::vector<size_t> forward_offsets;
+      for (auto &i : stream) {
+        forward_offsets.push_back(i.offset());
+      }
+
+      std::vector<size_t> reverse_offsets;
+      for (sut::OpcodeStream::const_reverse_iterator rit = stream.crbegin();
+           rit != stream.crend(); rit++) {
+        reverse_offsets.push_back(rit->offset());
+      }
+
+      REQUIRE(forward_offsets.size() == stream.size());
+      REQUIRE(std::equal(forward_offsets.begin(), forward_offsets.end(),
+                         reverse_offsets.rbegin()));
+    }
+
+    SECTION("Iterators jump to any instruction in constant time") {
+      sut::OpcodeStream stream(data, size);
+      std::vector<size_t> offsets;
+      for (auto &i : stream) {
+        offsets.push_back(i.offset());
+      }
+
+      const sut::OpcodeStream::iterator first = stream.begin();
+      REQUIRE(static_cast<size_t>(std::distance(first, stream.end())) ==
+              stream.size());
+      REQUIRE(static_cast<size_t>(stream.crend() - stream.crbegin()) ==
+              stream.size());
+      for (size_t n = 0; n < offsets.size(); n += 7) {
+        const ptrdiff_t step = static_cast<ptrdiff_t>(n);
+        REQUIRE(first[step].offset() == offsets[n]);
+        REQUIRE((first + step)->offset() == offsets[n]);
+        REQUIRE((step + first)->offset() == offsets[n]);
+        REQUIRE((stream.end() - (step + 1))->offset() ==
+                offsets[offsets.size() - 1 - n]);
+        REQUIRE(stream.crbegin()[step].offset() ==
+                offsets[offsets.size() - 1 - n]);
+        REQUIRE(((first + step) - first) == step);
+      }
+      REQUIRE(first < stream.cend());
+      REQUIRE(stream.end() > first);
+      REQUIRE(first <= stream.cbegin());
+      REQUIRE(stream.crbegin() < stream.crend());
+
+      sut::OpcodeStream::range loads = stream.Instructions(spv::Op::OpLoad);
+      auto last_load = loads.begin();
+      last_load += static_cast<ptrdiff_t>(loads.size() - 1);
+      REQUIRE(last_load->index() == loads.rbegin()->index());
+      REQUIRE(static_cast<size_t>(loads.end() - loads.begin()) ==
+              loads.size());
+      REQUIRE(loads.rbegin()[0].index() == last_load->index());
+    }
+
+    SECTION("Instructions of an opcode are listed in module order") {
+      const sut::OpcodeStream stream(data, size);
+      const spv::Op opcodes[] = {spv::Op::OpDecorate, spv::Op::OpVariable,
+                                 spv::Op::OpLoad, spv::Op::OpReturn};
+      for (spv::Op opcode : opcodes) {
+        std::vector<size_t> expected_indices;
+        for (auto &i : stream) {
+          if ((i.index() >= sut::kSpvHeaderWordsCount) &&
+              (i.GetOpcode() == opcode)) {
+            expected_indices.push_back(i.index());
+          }
+        }
+
+        sut::OpcodeStream::const_range instructions =
+            stream.Instructions(opcode);
+        std::vector<size_t> indices;
+        for (auto &i : instructions) {
+          REQUIRE(i.GetOpcode() == opcode);
+          indices.push_back(i.index());
+        }
+        std::vector<size_t> reverse_indices;
+        for (auto rit = instructions.rbegin(); rit != instructions.rend();
+             rit++) {
+          reverse_indices.push_back(rit->index());
+        }
+
+        REQUIRE(!expected_indices.empty());
+        REQUIRE(instructions.size() == expected_indices.size());
+        REQUIRE(indices == expected_indices);
+        REQUIRE(std::equal(indices.begin(), indices.end(),
+                           reverse_indices.rbegin()));
+      }
+    }
+
+    SECTION("An opcode absent from the module has no instructions") {
+      sut::OpcodeStream stream(data, size);
+      REQUIRE(stream.Instructions(spv::Op::OpKill).empty());
+      REQUIRE(stream.Instructions(spv::Op::OpSubgroupReadInvocationKHR)
+                  .empty());
+      REQUIRE(stream.Instructions(spv::Op::OpKill).begin() ==
+              stream.Instructions(spv::Op::OpKill).end());
+    }
+
+    SECTION("Result ids map to the instruction which defines them") {
+      const sut::OpcodeStream stream(data, size);
+      size_t variables_count = 0;
+      for (auto &i : stream.Instructions(spv::Op::OpVariable)) {
+        spv::Id id = i.GetWord(2);
+        REQUIRE(stream.FindDefinition(id)->index() == i.index());
+        REQUIRE(stream.GetResultType(id) == i.GetWord(1));
+        REQUIRE(stream.GetDefinitionWords(id) == i.data());
+        ++variables_count;
+      }
+      REQUIRE(variables_count > 0);
+
+      for (auto &i : stream.Instructions(spv::Op::OpTypePointer)) {
+        REQUIRE(stream.FindDefinition(i.GetWord(1))->index() == i.index());
+        REQUIRE(stream.GetResultType(i.GetWord(1)) == 0);
+      }
+
+      const spv::Id bound = stream.data()[3];
+      REQUIRE(stream.FindDefinition(0) == stream.end());
+      REQUIRE(stream.FindDefinition(bound) == stream.end());
+      REQUIRE(stream.GetDefinitionWords(bound) == nullptr);
+    }
+
+    SECTION("Result ids defined by the operations are kept track of") {
+      sut::OpcodeStream stream(data, size);
+      const spv::Id bound = stream.data()[3];
+
+      sut::OpcodeStream::range variables =
+          stream.Instructions(spv::Op::OpVariable);
+      REQUIRE(variables.size() > 1);
+      auto first_variable = variables.begin();
+      auto second_variable = std::next(first_variable);
+      const spv::Id type_id = first_variable->GetWord(1);
+      const spv::Id removed_id = second_variable->GetWord(2);
+
+      // Insert a definition before building the table, and one after it
+      std::array<uint32_t, 4U> before = {
+          sut::MergeSpvOpCode({4U, static_cast<uint16_t>(spv::Op::OpVariable)}),
+          type_id, bound, first_variable->GetWord(3)};
+      first_variable->InsertBefore(before.data(), before.size());
+      REQUIRE(stream.FindDefinition(bound)->index() ==
+              first_variable->index());
+
+      std::array<uint32_t, 4U> after = before;
+      after[2] = bound + 1;
+      first_variable->InsertAfter(after.data(), after.size());
+      second_variable->Replace(&instruction_0, 1);
+
+      REQUIRE(stream.FindDefinition(bound + 1)->index() ==
+              first_variable->index());
+      REQUIRE(stream.GetResultType(bound + 1) == type_id);
+      REQUIRE(std::equal(after.begin(), after.end(),
+                         stream.GetDefinitionWords(bound + 1)));
+      REQUIRE(stream.FindDefinition(removed_id) == stream.end());
+
+      // The filtered stream defines the same ids from its own words
+      sut::OpcodeStream filtered = stream.EmitFilteredStream();
+      REQUIRE(filtered.GetResultType(bound) == type_id);
+      REQUIRE(filtered.GetResultType(bound + 1) == type_id);
+      REQUIRE(filtered.FindDefinition(removed_id) == filtered.end());
+    }
+
+    SECTION("Uses of an id point at operand words holding it") {
+      const sut::OpcodeStream stream(data, size);
+      for (auto &i : stream.Instructions(spv::Op::OpLoad)) {
+        const spv::Id type_id = i.GetWord(1);
+        const spv::Id pointer_id = i.GetWord(3);
+
+        sut::IdUseRange uses = stream.GetUses(pointer_id);
+        size_t load_uses_count = std::count_if(
+            uses.begin(), uses.end(), [&](const sut::IdUse &use) {
+              return (use.instruction == i.index()) && (use.word_index == 3);
+            });
+        sut::IdUseRange type_uses = stream.GetUses(type_id);
+        bool type_used = std::any_of(type_uses.begin(), type_uses.end(),
+                                     [&](const sut::IdUse &use) {
+                                       return use.instruction == i.index();
+                                     });
+        REQUIRE(load_uses_count == 1);
+        REQUIRE(type_used);
+
+        for (const sut::IdUse &use : uses) {
+          REQUIRE(stream.data()[use.offset] == pointer_id);
+        }
+      }
+
+      // Result ids are definitions, not uses
+      for (auto &i : stream.Instructions(spv::Op::OpLoad)) {
+        REQUIRE(stream.GetUses(i.GetWord(2)).size() > 0);
+        for (const sut::IdUse &use : stream.GetUses(i.GetWord(2))) {
+          REQUIRE(use.instruction != i.index());
+        }
+      }
+      REQUIRE(stream.GetUses(stream.data()[3] + 10).empty());
+    }
+
+    SECTION("Literal strings are skipped when looking for uses") {
+      const sut::OpcodeStream stream(data, size);
+      auto entry_point = stream.Instructions(spv::Op::OpEntryPoint).begin();
+
+      // OpEntryPoint model id "name" interface ids...
+      size_t interface_index = 3;
+      while ((entry_point->GetWord(interface_index) & 0xFF000000) != 0) {
+        ++interface_index;
+      }
+      ++interface_index;
+      REQUIRE(interface_index < entry_point->GetWordCount());
+
+      for (size_t w = 2; w < entry_point->GetWordCount(); ++w) {
+        const bool is_id = (w == 2) || (w >= interface_index);
+        sut::IdUseRange uses = stream.GetUses(entry_point->GetWord(w));
+        size_t entry_point_uses = std::count_if(
+            uses.begin(), uses.end(), [&](const sut::IdUse &use) {
+              return (use.instruction == entry_point->index()) &&
+                     (use.word_index == w);
+            });
+        REQUIRE(entry_point_uses == (is_id ? 1 : 0));
+      }
+    }
+
+    SECTION("Replacing all the uses of an id rewrites its operands only") {
+      sut::OpcodeStream stream(data, size);
+      const spv::Id bound = stream.data()[3];
+
+      auto load = stream.Instructions(spv::Op::OpLoad).begin();
+      const spv::Id pointer_id = load->GetWord(3);
+      const size_t uses_count = stream.GetUses(pointer_id).size();
+
+      // Uses by inserted words are rewritten as well
+      std::array<uint32_t, 4U> copy = {load->GetWord(0), load->GetWord(1),
+                                       bound, pointer_id};
+      load->InsertAfter(copy.data(), copy.size());
+      REQUIRE(stream.GetUses(pointer_id).size() == (uses_count + 1));
+
+      stream.ReplaceAllUsesWith(pointer_id, bound + 1);
+      REQUIRE(stream.GetUses(pointer_id).empty());
+      REQUIRE(stream.GetUses(bound + 1).size() == (uses_count + 1));
+
+      sut::OpcodeStream filtered = stream.EmitFilteredStream();
+      REQUIRE(filtered.GetUses(pointer_id).empty());
+      REQUIRE(filtered.GetUses(bound + 1).size() == (uses_count + 1));
+      REQUIRE(filtered.FindDefinition(pointer_id) != filtered.end());
+    }
+
+    SECTION("Remapping ids renames their definitions and uses") {
+      sut::OpcodeStream stream(data, size);
+      const sut::OpcodeStream original(data, size);
+
+      sut::OpcodeStream::range variables =
+          stream.Instructions(spv::Op::OpVariable);
+      REQUIRE(variables.size() > 1);
+      const spv::Id id_a = variables.begin()->GetWord(2);
+      const spv::Id id_b = std::next(variables.begin())->GetWord(2);
+
+      // Swap the two ids
+      std::vector<spv::Id> id_map(id_b + 1, 0);
+      id_map[id_a] = id_b;
+      id_map[id_b] = id_a;
+      stream.RemapIds(id_map);
+
+      REQUIRE(stream.FindDefinition(id_b)->index() ==
+              original.FindDefinition(id_a)->index());
+      REQUIRE(stream.GetResultType(id_b) == original.GetResultType(id_a));
+
+      sut::OpcodeStream filtered = stream.EmitFilteredStream();
+      REQUIRE(filtered.GetUses(id_a).size() == original.GetUses(id_b).size());
+      REQUIRE(filtered.GetUses(id_b).size() == original.GetUses(id_a).size());
+      REQUIRE(filtered.FindDefinition(id_a)->index() ==
+              original.FindDefinition(id_b)->index());
+      for (const sut::IdUse &use : filtered.GetUses(id_a)) {
+        REQUIRE(original.data()[use.offset] == id_b);
+      }
+    }
+
+    SECTION("Operands of extended instructions of other sets are left alone") {
+      sut::OpcodeStream stream(data, size);
+      const spv::Id set = stream.AllocateId();
+      const spv::Id result = stream.AllocateId();
+      const spv::Id void_type =
+          stream.Instructions(spv::Op::OpTypeVoid).begin()->GetWord(1);
+      const spv::Id variable =
+          stream.Instructions(spv::Op::OpVariable).begin()->GetWord(2);
+      const size_t uses_count = stream.GetUses(variable).size();
+
+      sut::InstructionBuilder builder(spv::Op::OpExtInstImport);
+      builder.AddId(set).AddString("OpenCL.DebugInfo.100");
+      stream.Instructions(spv::Op::OpExtInstImport).begin()->InsertAfter(
+          builder);
+      // DebugTypeBasic, whose last operand is the literal Encoding, here
+      // equal to the id of a variable
+      builder.Reset(spv::Op::OpExtInst);
+      builder.AddId(void_type).AddId(result).AddId(set).AddLiteral(2).AddId(
+          void_type).AddId(void_type).AddLiteral(variable);
+      stream.Instructions(spv::Op::OpLoad).begin()->InsertBefore(builder);
+
+      REQUIRE(stream.GetUses(variable).size() == uses_count);
+      REQUIRE(stream.GetUses(set).size() == 1);
+
+      std::vector<spv::Id> id_map(variable + 1, 0);
+      id_map[variable] = result + 1;
+      REQUIRE_THROWS_AS(stream.RemapIds(id_map), sut::InvalidStream);
+      REQUIRE_THROWS_AS(stream.ReplaceAllUsesWith(variable, result + 1),
+                        sut::InvalidStream);
+      REQUIRE(stream.GetUses(variable).size() == uses_count);
+    }
+
+    SECTION("Sections split the instructions in the logical layout") {
+      const sut::OpcodeStream stream(data, size);
+
+      // Sections follow each other and cover every instruction
+      size_t next_index = sut::kSpvHeaderWordsCount;
+      for (size_t s = 0; s < static_cast<size_t>(sut::ModuleSection::kCount);
+           ++s) {
+        for (auto &i : stream.Section(static_cast<sut::ModuleSection>(s))) {
+          REQUIRE(i.index() == next_index);
+          ++next_index;
+        }
+      }
+      REQUIRE(next_index == (stream.size() - 1));
+
+      sut::OpcodeStream::const_range capabilities =
+          stream.Section(sut::ModuleSection::kCapabilities);
+      REQUIRE(!capabilities.empty());
+      for (auto &i : capabilities) {
+        REQUIRE(i.GetOpcode() == spv::Op::OpCapability);
+      }
+
+      sut::OpcodeStream::const_range annotations =
+          stream.Section(sut::ModuleSection::kAnnotations);
+      REQUIRE(annotations.size() ==
+              (stream.Instructions(spv::Op::OpDecorate).size() +
+               stream.Instructions(spv::Op::OpMemberDecorate).size()));
+      REQUIRE(stream.Section(sut::ModuleSection::kExtensions).empty());
+      REQUIRE(stream.Section(sut::ModuleSection::kMemoryModel).size() == 1);
+
+      // A non-semantic instruction at global scope between the types doesn't
+      // end them
+      sut::OpcodeStream non_semantic(data, size);
+      const spv::Id set = non_semantic.AllocateId();
+      const spv::Id void_type =
+          non_semantic.Instructions(spv::Op::OpTypeVoid).begin()->GetWord(1);
+      sut::InstructionBuilder builder(spv::Op::OpExtInstImport);
+      builder.AddId(set).AddString("NonSemantic.Test");
+      non_semantic.Instructions(spv::Op::OpExtInstImport).begin()->InsertAfter(
+          builder);
+      builder.Reset(spv::Op::OpExtInst);
+      builder.AddId(void_type).AddId(non_semantic.AllocateId()).AddId(set)
+          .AddLiteral(1);
+      non_semantic.Instructions(spv::Op::OpTypeVoid).begin()->InsertAfter(
+          builder);
+
+      const sut::OpcodeStream filtered = non_semantic.EmitFilteredStream();
+      const size_t types_count =
+          stream.Section(sut::ModuleSection::kTypes).size();
+      sut::OpcodeStream::const_range types =
+          filtered.Section(sut::ModuleSection::kTypes);
+      REQUIRE(types.size() == (types_count + 1));
+      REQUIRE(std::prev(types.end())->index() ==
+              (filtered.Instructions(spv::Op::OpFunction).begin()->index() -
+               1));
+      REQUIRE(filtered.Section(sut::ModuleSection::kFunctions).begin()
+                  ->GetOpcode() == spv::Op::OpFunction);
+    }
+
+    SECTION("Functions span from their OpFunction to their OpFunctionEnd") {
+      const sut::OpcodeStream stream(data, size);
+      std::vector<sut::OpcodeStream::const_range> functions =
+          stream.Functions();
+
+      REQUIRE(!functions.empty());
+      REQUIRE(functions.size() ==
+              stream.Instructions(spv::Op::OpFunction).size());
+      for (const sut::OpcodeStream::const_range &function : functions) {
+        REQUIRE(function.begin()->GetOpcode() == spv::Op::OpFunction);
+        REQUIRE(function.rbegin()->GetOpcode() == spv::Op::OpFunctionEnd);
+      }
+      REQUIRE(functions.back().rbegin()->index() == (stream.size() - 2));
+    }
+
+    SECTION("Allocating ids raises the bound of the emitted stream") {
+      sut::OpcodeStream stream(data, size);
+      const spv::Id bound = stream.data()[3];
+      REQUIRE(stream.GetIdBound() == bound);
+
+      REQUIRE(stream.AllocateId() == bound);
+      REQUIRE(stream.AllocateIds(3) == (bound + 1));
+      sut::IdBlock block = stream.ReserveIds(2);
+      REQUIRE(stream.GetIdBound() == (bound + 6));
+      REQUIRE(stream.data()[3] == bound);
+
+      REQUIRE(block.size() == 2);
+      REQUIRE(block.Allocate() == (bound + 4));
+      REQUIRE(block.Allocate() == (bound + 5));
+      REQUIRE(block.empty());
+      REQUIRE(block.Allocate() == 0);
+
+      std::vector<uint32_t> words;
+      stream.EmitWords(words);
+      REQUIRE(words.size() == stream.words_count());
+      REQUIRE(words[3] == (bound + 6));
+      words[3] = bound;
+      REQUIRE(words == stream.GetWordsStream());
+
+      sut::OpcodeStream filtered = stream.EmitFilteredStream();
+      REQUIRE(filtered.GetIdBound() == (bound + 6));
+      REQUIRE(filtered.size() == stream.size());
+    }
+
+    SECTION("Replacing the bound directly overrides the allocated ids") {
+      sut::OpcodeStream stream(data, size);
+      const uint32_t new_bound = stream.data()[3] + 100;
+      stream.AllocateIds(10);
+
+      auto bound_it = stream.begin();
+      std::advance(bound_it, 3);
+      bound_it->Replace(&new_bound, 1);
+
+      REQUIRE(stream.EmitFilteredStream().data()[3] == new_bound);
+    }
+
+    SECTION("Ids allocated concurrently are all different") {
+      sut::OpcodeStream stream(data, size);
+      const spv::Id bound = stream.data()[3];
+      const size_t kThreadsCount = 4;
+      const size_t kIdsPerThread = 1000;
+
+      std::vector<std::vector<spv::Id>> thread_ids(kThreadsCount);
+      std::vector<std::thread> threads;
+      for (size_t t = 0; t < kThreadsCount; ++t) {
+        threads.push_back(std::thread([&stream, &thread_ids, t]() {
+          for (size_t i = 0; i < kIdsPerThread; ++i) {
+            thread_ids[t].push_back(stream.AllocateId());
+          }
+        }));
+      }
+      for (std::thread &thread : threads) {
+        thread.join();
+      }
+
+      std::vector<spv::Id> ids;
+      for (const std::vector<spv::Id> &t : thread_ids) {
+        ids.insert(ids.end(), t.begin(), t.end());
+      }
+      std::sort(ids.begin(), ids.end());
+      REQUIRE(std::unique(ids.begin(), ids.end()) == ids.end());
+      REQUIRE(ids.front() == bound);
+      REQUIRE(stream.GetIdBound() == (bound + kThreadsCount * kIdsPerThread));
+    }
+
+    SECTION("Built instructions are inserted like raw words") {
+      sut::OpcodeStream built_stream(data, size);
+      sut::OpcodeStream raw_stream(data, size);
+
+      auto built_it = built_stream.Instructions(spv::Op::OpLoad).begin();
+      auto raw_it = raw_stream.Instructions(spv::Op::OpLoad).begin();
+
+      sut::InstructionBuilder negate(spv::Op::OpFNegate);
+      negate.AddId(built_it->GetWord(1)).AddId(100).AddId(built_it->GetWord(2));
+      built_it->InsertAfter(negate);
+      built_it->Replace(sut::InstructionBuilder(spv::Op::OpNop));
+
+      std::array<uint32_t, 4U> raw_negate = {
+          sut::MergeSpvOpCode({4U, static_cast<uint16_t>(spv::Op::OpFNegate)}),
+          raw_it->GetWord(1), 100, raw_it->GetWord(2)};
+      raw_it->InsertAfter(raw_negate.data(), raw_negate.size());
+      raw_it->Replace(&instruction_0, 1);
+
+      REQUIRE(negate.size() == raw_negate.size());
+      REQUIRE(built_stream.EmitFilteredStream().GetWordsStream() ==
+              raw_stream.EmitFilteredStream().GetWordsStream());
+    }
+
+    SECTION("A view parses the same instructions without copying them") {
+      sut::OpcodeStream stream(data, size);
+      sut::OpcodeStream view = sut::OpcodeStream::View(data, size);
+
+      REQUIRE(view.IsView());
+      REQUIRE(view.data() == reinterpret_cast<const uint32_t *>(data));
+      REQUIRE(view.size() == stream.size());
+      REQUIRE(view.GetWordsStream() == stream.GetWordsStream());
+
+      sut::OpcodeStream::const_iterator si = stream.cbegin();
+      for (sut::OpcodeStream::const_iterator vi = view.cbegin();
+           vi != view.cend(); vi++, si++) {
+        REQUIRE(vi->offset() == si->offset());
+        REQUIRE(vi->GetFirstWord() == si->GetFirstWord());
+      }
+    }
+
+    SECTION("Rolling back drops the operations since a checkpoint") {
+      sut::OpcodeStream stream(data, size);
+      sut::OpcodeStream expected(data, size);
+
+      // Operations both streams get, followed by the ones rolled back, which
+      // partly touch the same instructions
+      auto apply_base = [&](sut::OpcodeStream &s) {
+        for (auto &i : s.Instructions(spv::Op::OpLoad)) {
+          i.InsertBefore(&instruction_0, 1);
+        }
+        s.Instructions(spv::Op::OpStore).begin()->Remove();
+        s.AllocateId();
+      };
+      apply_base(stream);
+      apply_base(expected);
+      const std::vector<uint32_t> expected_words =
+          expected.EmitFilteredStream().GetWordsStream();
+
+      sut::EditCheckpoint checkpoint = stream.Checkpoint();
+      for (size_t variant = 0; variant < 3; ++variant) {
+        const spv::Id id = stream.AllocateIds(2);
+        for (auto &i : stream.Instructions(spv::Op::OpLoad)) {
+          i.InsertBefore(longer_instruction.data(), longer_instruction.size());
+          i.Remove();
+        }
+        for (auto &i : stream.Instructions(spv::Op::OpVariable)) {
+          i.InsertAfter(&instruction_1, 1);
+        }
+
+        sut::EditCheckpoint nested = stream.Checkpoint();
+        const uint32_t undef[] = {
+            sut::MergeSpvOpCode({3U, static_cast<uint16_t>(spv::Op::OpUndef)}),
+            stream.Instructions(spv::Op::OpTypeFloat).begin()->GetWord(1), id};
+        stream.Instructions(spv::Op::OpReturn).begin()->InsertBefore(undef, 3);
+        REQUIRE(stream.FindDefinition(id) != stream.end());
+        stream.Rollback(nested);
+        REQUIRE(stream.FindDefinition(id) == stream.end());
+
+        stream.Rollback(checkpoint);
+        REQUIRE(stream.GetEmittedWordsCount() == expected_words.size());
+        REQUIRE(stream.GetIdBound() == expected.GetIdBound());
+        REQUIRE(stream.EmitFilteredStream().GetWordsStream() ==
+                expected_words);
+
+        // The nested checkpoint has been rolled back past
+        if (variant == 0) {
+          stream.Instructions(spv::Op::OpLoad).begin()->Remove();
+          REQUIRE_THROWS_AS(stream.Rollback(nested), sut::InvalidOperation);
+          stream.Rollback(checkpoint);
+        }
+      }
+
+      stream.ClearEdits();
+      REQUIRE_FALSE(stream.NeedsEmission());
+      REQUIRE(stream.EmitFilteredStream().GetWordsStream() ==
+              stream.GetWordsStream());
+      REQUIRE_THROWS_AS(stream.Rollback(expected.Checkpoint()),
+                        sut::InvalidOperation);
+
+      // A stale checkpoint whose operations were replaced by as many others
+      // of a different size doesn't match the inserted words
+      const uint32_t nops[] = {
+          sut::MergeSpvOpCode({1U, static_cast<uint16_t>(spv::Op::OpNop)}),
+          sut::MergeSpvOpCode({1U, static_cast<uint16_t>(spv::Op::OpNop)}),
+          sut::MergeSpvOpCode({1U, static_cast<uint16_t>(spv::Op::OpNop)})};
+      auto load = stream.Instructions(spv::Op::OpLoad).begin();
+      load->InsertBefore(nops, 2);
+      const sut::EditCheckpoint stale = stream.Checkpoint();
+      stream.ClearEdits();
+      load->InsertBefore(nops, 3);
+      const std::vector<uint32_t> words =
+          stream.EmitFilteredStream().GetWordsStream();
+      REQUIRE_THROWS_AS(stream.Rollback(stale), sut::InvalidOperation);
+      REQUIRE(stream.EmitFilteredStream().GetWordsStream() == words);
+    }
+
+    SECTION("Checkpoints cleared past throw once operations grow back") {
+      sut::OpcodeStream stream(data, size);
+      auto longer = stream.end();
+      auto shorter = stream.end();
+      for (auto i = stream.begin(); i != stream.end(); ++i) {
+        if (i->index() < sut::kSpvHeaderWordsCount) {
+          continue;
+        }
+        if ((longer == stream.end()) && (i->GetWordCount() == 9)) {
+          longer = i;
+        } else if ((shorter == stream.end()) && (i->GetWordCount() == 1)) {
+          shorter = i;
+        }
+      }
+      REQUIRE(longer != stream.end());
+      REQUIRE(shorter != stream.end());
+
+      longer->Remove();
+      const sut::EditCheckpoint checkpoint = stream.Checkpoint();
+      stream.ClearEdits();
+      shorter->Remove();
+      REQUIRE_THROWS_AS(stream.Rollback(checkpoint), sut::InvalidOperation);
+
+      std::vector<uint32_t> words(stream.GetEmittedWordsCount());
+      stream.EmitInto(words.data(), words.size());
+      REQUIRE(words == stream.EmitFilteredStream().GetWordsStream());
+      REQUIRE(words.size() == (stream.words_count() - 1));
+    }
+
+    SECTION("Same-size replacements are applied in place when enabled") {
+      sut::OpcodeStream recorded(data, size);
+      sut::OpcodeStream in_place(data, size);
+      in_place.SetInPlaceEdits(true);
+      REQUIRE_FALSE(recorded.GetInPlaceEdits());
+
+      // Bump the literal of every decoration, which keeps their size
+      for (sut::OpcodeStream *s : {&recorded, &in_place}) {
+        for (auto &i : s->Instructions(spv::Op::OpDecorate)) {
+          std::vector<uint32_t> words(i.data(), i.data() + i.GetWordCount());
+          words.back() += 1;
+          i.Replace(words.data(), words.size());
+        }
+      }
+
+      REQUIRE(recorded.NeedsEmission());
+      REQUIRE_FALSE(in_place.NeedsEmission());
+      REQUIRE(in_place.GetWordsStream() ==
+              recorded.EmitFilteredStream().GetWordsStream());
+
+      // In-place replacements can be repeated, unlike the recorded ones
+      auto decoration = in_place.Instructions(spv::Op::OpDecorate).begin();
+      const uint32_t last_word = decoration->GetWord(
+          decoration->GetWordCount() - 1);
+      decoration->SetWord(decoration->GetWordCount() - 1, last_word + 1);
+      REQUIRE(decoration->GetWord(decoration->GetWordCount() - 1) ==
+              (last_word + 1));
+      REQUIRE_THROWS_AS(decoration->SetWord(0, 0), sut::InvalidParameter);
+      REQUIRE_THROWS_AS(decoration->SetWord(decoration->GetWordCount(), 0),
+                        sut::InvalidParameter);
+
+      // Replacements of a different size are recorded as before
+      decoration->Replace(longer_instruction.data(), longer_instruction.size());
+      REQUIRE(in_place.NeedsEmission());
+      REQUIRE(in_place.GetEmittedWordsCount() ==
+              (in_place.words_count() + longer_instruction.size() -
+               decoration->GetWordCount()));
+    }
+
+    SECTION("Words set in place keep the definitions up to date") {
+      sut::OpcodeStream stream(data, size);
+      auto variable = stream.Instructions(spv::Op::OpVariable).begin();
+      const spv::Id old_id = variable->GetWord(2);
+      const spv::Id new_id = stream.AllocateId();
+      REQUIRE(stream.FindDefinition(old_id)->index() == variable->index());
+
+      variable->SetWord(2, new_id);
+      REQUIRE(stream.FindDefinition(new_id)->index() == variable->index());
+      REQUIRE(stream.FindDefinition(old_id) == stream.end());
+      REQUIRE(stream.data()[variable->offset() + 2] == new_id);
+    }
+
+    SECTION("Modules are validated before being parsed") {
+      std::vector<uint32_t> words = sut::OpcodeStream(data, size)
+                                        .GetWordsStream();
+
+      std::vector<uint32_t> bad_magic(words);
+      bad_magic[0] = 0xDEADBEEF;
+      REQUIRE_THROWS_AS((sut::OpcodeStream(bad_magic)), sut::InvalidStream);
+
+      // The last instruction runs past the end of the module
+      std::vector<uint32_t> truncated(words);
+      truncated.push_back(sut::MergeSpvOpCode(
+          {3U, static_cast<uint16_t>(spv::Op::OpNop)}));
+      REQUIRE_THROWS_AS((sut::OpcodeStream(truncated)), sut::InvalidStream);
+      REQUIRE_THROWS_AS(
+          sut::OpcodeStream::View(truncated.data(), truncated.size()),
+          sut::InvalidStream);
+    }
+
+    SECTION("Modules of the opposite endianness are swapped when parsed") {
+      const sut::OpcodeStream stream(data, size);
+      std::vector<uint32_t> swapped = stream.GetWordsStream();
+      for (uint32_t &word : swapped) {
+        word = ((word & 0x000000FFU) << 24U) | ((word & 0x0000FF00U) << 8U) |
+               ((word & 0x00FF0000U) >> 8U) | ((word & 0xFF000000U) >> 24U);
+      }
+
+      sut::OpcodeStream swapped_stream(swapped);
+      REQUIRE(swapped_stream.size() == stream.size());
+      REQUIRE(swapped_stream.GetWordsStream() == stream.GetWordsStream());
+
+      // Views can't swap the words of the caller, so they copy them
+      sut::OpcodeStream view =
+          sut::OpcodeStream::View(swapped.data(), swapped.size());
+      REQUIRE_FALSE(view.IsView());
+      REQUIRE(view.GetWordsStream() == stream.GetWordsStream());
+      REQUIRE(swapped[0] != spv::MagicNumber);
+    }
+
+    SECTION("Fingerprints skip the parts of the module left out") {
+      sut::OpcodeStream stream(data, size);
+      const sut::OpcodeStream original(data, size);
+      const sut::ModuleFingerprint plain = original.Fingerprint();
+      REQUIRE(plain == sut::OpcodeStream(data, size).Fingerprint());
+
+      sut::FingerprintOptions ignore_debug;
+      ignore_debug.ignore_debug = true;
+      sut::FingerprintOptions ignore_generator;
+      ignore_generator.ignore_generator = true;
+      sut::FingerprintOptions canonical_ids;
+      canonical_ids.canonical_ids = true;
+
+      // Pending operations hash the same as the stream they emit
+      sut::InstructionBuilder name(spv::Op::OpName);
+      name.AddId(1).AddString("renamed");
+      stream.Instructions(spv::Op::OpName).begin()->InsertAfter(name.data(),
+                                                                name.size());
+      const sut::OpcodeStream filtered = stream.EmitFilteredStream();
+      REQUIRE(stream.Fingerprint() == filtered.Fingerprint());
+      REQUIRE(stream.Fingerprint(canonical_ids) ==
+              filtered.Fingerprint(canonical_ids));
+      REQUIRE(stream.Fingerprint() != plain);
+      REQUIRE(stream.Fingerprint(ignore_debug) ==
+              original.Fingerprint(ignore_debug));
+
+      std::vector<uint32_t> words = original.GetWordsStream();
+      words[2] += 1;
+      const sut::OpcodeStream generator(words);
+      REQUIRE(generator.Fingerprint() != plain);
+      REQUIRE(generator.Fingerprint(ignore_generator) ==
+              original.Fingerprint(ignore_generator));
+
+      // Swapping two ids only changes the numbering
+      sut::OpcodeStream remapped(data, size);
+      sut::OpcodeStream::range variables =
+          remapped.Instructions(spv::Op::OpVariable);
+      const spv::Id id_a = variables.begin()->GetWord(2);
+      const spv::Id id_b = std::next(variables.begin())->GetWord(2);
+      std::vector<spv::Id> id_map(id_b + 1, 0);
+      id_map[id_a] = id_b;
+      id_map[id_b] = id_a;
+      remapped.RemapIds(id_map);
+      REQUIRE(remapped.Fingerprint() != plain);
+      REQUIRE(remapped.Fingerprint(canonical_ids) ==
+              original.Fingerprint(canonical_ids));
+    }
+
+    SECTION("Stripping debug info drops the same as removing it") {
+      sut::OpcodeStream removed(data, size);
+      for (auto &i : removed) {
+        const spv::Op opcode = i.GetOpcode();
+        if ((opcode == spv::Op::OpSource) || (opcode == spv::Op::OpName) ||
+            (opcode == spv::Op::OpMemberName)) {
+          i.Remove();
+        }
+      }
+      const std::vector<uint32_t> expected =
+          removed.EmitFilteredStream().GetWordsStream();
+
+      const sut::OpcodeStream original(data, size);
+      const sut::OpcodeStream stripped = original.StripDebugInfo();
+      REQUIRE(stripped.GetWordsStream() == expected);
+      REQUIRE(stripped.words_count() < original.words_count());
+      REQUIRE(stripped.Section(sut::ModuleSection::kDebug).empty());
+      REQUIRE(stripped.StripDebugInfo().GetWordsStream() == expected);
+
+      // Non-semantic instructions go along with their set, the extension
+      // and the strings only they use, unless the set is DebugPrintf
+      for (const char *set_name :
+           {"NonSemantic.Test", "NonSemantic.DebugPrintf"}) {
+        sut::OpcodeStream stream(data, size);
+        const spv::Id set = stream.AllocateId();
+        const spv::Id string = stream.AllocateId();
+        const spv::Id result = stream.AllocateId();
+        const spv::Id void_type =
+            stream.Instructions(spv::Op::OpTypeVoid).begin()->GetWord(1);
+
+        sut::InstructionBuilder builder(spv::Op::OpExtension);
+        builder.AddString("SPV_KHR_non_semantic_info");
+        auto import = stream.Instructions(spv::Op::OpExtInstImport).begin();
+        import->InsertBefore(builder);
+        builder.Reset(spv::Op::OpExtInstImport);
+        builder.AddId(set).AddString(set_name);
+        import->InsertAfter(builder);
+        builder.Reset(spv::Op::OpString);
+        builder.AddId(string).AddString("%d");
+        stream.Instructions(spv::Op::OpName).begin()->InsertBefore(builder);
+        builder.Reset(spv::Op::OpExtInst);
+        builder.AddId(void_type).AddId(result).AddId(set).AddLiteral(1).AddId(
+            string);
+        stream.Instructions(spv::Op::OpLoad).begin()->InsertBefore(builder);
+
+        const sut::OpcodeStream stream_stripped = stream.StripDebugInfo();
+        const std::vector<uint32_t> words = stream_stripped.GetWordsStream();
+        if (std::string(set_name) == "NonSemantic.Test") {
+          REQUIRE(words.size() == expected.size());
+          REQUIRE(std::equal(words.begin() + 5, words.end(),
+                             expected.begin() + 5));
+        } else {
+          REQUIRE(words.size() == (expected.size() + 8 + 8 + 3 + 6));
+          REQUIRE(stream_stripped.Instructions(spv::Op::OpString).size() ==
+                  1);
+          REQUIRE(stream_stripped.Instructions(spv::Op::OpExtension).size() ==
+                  1);
+        }
+      }
+
+      // Inserted words which don't split in whole instructions throw
+      sut::OpcodeStream partial(data, size);
+      const uint32_t partial_name =
+          (3U << 16) | static_cast<uint32_t>(spv::Op::OpName);
+      partial.Instructions(spv::Op::OpLoad).begin()->InsertAfter(
+          &partial_name, 1U);
+      REQUIRE_THROWS_AS(partial.StripDebugInfo(), sut::InvalidStream);
+    }
+
+    SECTION("Dead code elimination drops what entry points can't reach") {
+      const sut::OpcodeStream original(data, size);
+      const std::vector<uint32_t> expected =
+          original.EliminateDeadCode().GetWordsStream();
+      const sut::OpcodeStream pruned_twice =
+          sut::OpcodeStream(expected).EliminateDeadCode();
+      REQUIRE(pruned_twice.GetWordsStream() == expected);
+
+      // Add an unused type and constant, and an unused function calling a
+      // function made of the same instructions, all with names and
+      // decorations
+      sut::OpcodeStream stream(data, size);
+      const spv::Id int_type = stream.AllocateId();
+      const spv::Id constant = stream.AllocateId();
+      const spv::Id caller = stream.AllocateId();
+      const spv::Id callee = stream.AllocateId();
+      auto main_function = stream.Instructions(spv::Op::OpFunction).begin();
+      const spv::Id void_type = main_function->GetWord(1);
+      const spv::Id function_type = main_function->GetWord(4);
+
+      sut::InstructionBuilder builder(spv::Op::OpTypeInt);
+      builder.AddId(int_type).AddLiteral(32).AddLiteral(0);
+      main_function->InsertBefore(builder);
+      builder.Reset(spv::Op::OpConstant);
+      builder.AddId(int_type).AddId(constant).AddLiteral(7);
+      main_function->InsertBefore(builder);
+      builder.Reset(spv::Op::OpName);
+      builder.AddId(caller).AddString("unused");
+      stream.Instructions(spv::Op::OpName).begin()->InsertAfter(builder);
+      builder.Reset(spv::Op::OpDecorate);
+      builder.AddId(constant).AddLiteral(
+          static_cast<uint32_t>(spv::Decoration::SpecId)).AddLiteral(3);
+      stream.Instructions(spv::Op::OpDecorate).begin()->InsertBefore(builder);
+
+      std::vector<uint32_t> functions;
+      for (spv::Id function : {callee, caller}) {
+        builder.Reset(spv::Op::OpFunction);
+        builder.AddId(void_type).AddId(function).AddLiteral(0).AddId(
+            function_type);
+        functions.insert(functions.end(), builder.data(),
+                         builder.data() + builder.size());
+        builder.Reset(spv::Op::OpLabel);
+        builder.AddId(stream.AllocateId());
+        functions.insert(functions.end(), builder.data(),
+                         builder.data() + builder.size());
+        if (function == caller) {
+          builder.Reset(spv::Op::OpFunctionCall);
+          builder.AddId(void_type).AddId(stream.AllocateId()).AddId(callee);
+          functions.insert(functions.end(), builder.data(),
+                           builder.data() + builder.size());
+        }
+        for (spv::Op opcode : {spv::Op::OpReturn, spv::Op::OpFunctionEnd}) {
+          functions.push_back(
+              sut::MergeSpvOpCode({1U, static_cast<uint16_t>(opcode)}));
+        }
+      }
+      stream.Instructions(spv::Op::OpFunctionEnd).rbegin()->InsertAfter(
+          functions.data(), functions.size());
+
+      const std::vector<uint32_t> pruned =
+          stream.EliminateDeadCode().GetWordsStream();
+      REQUIRE(pruned.size() == expected.size());
+      REQUIRE(std::equal(pruned.begin() + 5, pruned.end(),
+                         expected.begin() + 5));
+
+      // The same function is kept once the entry point calls it
+      builder.Reset(spv::Op::OpFunctionCall);
+      builder.AddId(void_type).AddId(stream.AllocateId()).AddId(caller);
+      stream.Instructions(spv::Op::OpReturn).begin()->InsertBefore(builder);
+      const sut::OpcodeStream called = stream.EliminateDeadCode();
+      REQUIRE(called.Instructions(spv::Op::OpFunction).size() == 3);
+      REQUIRE(called.Instructions(spv::Op::OpConstant).size() ==
+              original.Instructions(spv::Op::OpConstant).size());
+      REQUIRE(called.Instructions(spv::Op::OpName).size() ==
+              (original.EliminateDeadCode()
+                   .Instructions(spv::Op::OpName)
+                   .size() +
+               1));
+
+      // Group decorations lose their dead targets, and are dropped along with
+      // their group once none is left
+      for (bool live_target : {true, false}) {
+        sut::OpcodeStream grouped(data, size);
+        const spv::Id dead_type = grouped.AllocateId();
+        const spv::Id group = grouped.AllocateId();
+        builder.Reset(spv::Op::OpTypeInt);
+        builder.AddId(dead_type).AddLiteral(32).AddLiteral(0);
+        grouped.Instructions(spv::Op::OpFunction).begin()->InsertBefore(
+            builder);
+
+        std::vector<uint32_t> decorations;
+        builder.Reset(spv::Op::OpDecorationGroup);
+        builder.AddId(group);
+        decorations.insert(decorations.end(), builder.data(),
+                           builder.data() + builder.size());
+        builder.Reset(spv::Op::OpDecorate);
+        builder.AddId(group).AddLiteral(
+            static_cast<uint32_t>(spv::Decoration::RelaxedPrecision));
+        decorations.insert(decorations.end(), builder.data(),
+                           builder.data() + builder.size());
+        builder.Reset(spv::Op::OpGroupDecorate);
+        builder.AddId(group);
+        if (live_target) {
+          builder.AddId(void_type);
+        }
+        builder.AddId(dead_type);
+        decorations.insert(decorations.end(), builder.data(),
+                           builder.data() + builder.size());
+        grouped.Instructions(spv::Op::OpDecorate).begin()->InsertBefore(
+            decorations.data(), decorations.size());
+
+        const sut::OpcodeStream kept = grouped.EliminateDeadCode();
+        size_t group_decorations_count = 0;
+        for (auto &i : kept.Instructions(spv::Op::OpDecorate)) {
+          group_decorations_count += (i.GetWord(1) == group) ? 1 : 0;
+        }
+        const auto group_decorate =
+            kept.Instructions(spv::Op::OpGroupDecorate);
+        if (live_target) {
+          REQUIRE(kept.Instructions(spv::Op::OpDecorationGroup).size() == 1);
+          REQUIRE(group_decorations_count == 1);
+          REQUIRE(group_decorate.size() == 1);
+          REQUIRE(group_decorate.begin()->GetWordCount() == 3);
+          REQUIRE(group_decorate.begin()->GetWord(1) == group);
+          REQUIRE(group_decorate.begin()->GetWord(2) == void_type);
+        } else {
+          REQUIRE(kept.Instructions(spv::Op::OpDecorationGroup).size() == 0);
+          REQUIRE(group_decorations_count == 0);
+          REQUIRE(group_decorate.size() == 0);
+          const std::vector<uint32_t> words = kept.GetWordsStream();
+          REQUIRE(words.size() == expected.size());
+          REQUIRE(std::equal(words.begin() + 5, words.end(),
+                             expected.begin() + 5));
+        }
+      }
+
+      // Inserted words which don't split in whole instructions throw
+      sut::OpcodeStream partial(data, size);
+      const uint32_t partial_name =
+          (3U << 16) | static_cast<uint32_t>(spv::Op::OpName);
+      partial.Instructions(spv::Op::OpLoad).begin()->InsertAfter(
+          &partial_name, 1U);
+      REQUIRE_THROWS_AS(partial.EliminateDeadCode(), sut::InvalidStream);
+      REQUIRE_THROWS_AS(
+          partial.ExtractEntryPoint("main", spv::ExecutionModel::Fragment),
+          sut::InvalidStream);
+    }
+
+    SECTION("Entry points are extracted with what they reach only") {
+      const sut::OpcodeStream original(data, size);
+      const std::vector<uint32_t> expected =
+          original.EliminateDeadCode().GetWordsStream();
+
+      // Add a second entry point with an empty function
+      sut::OpcodeStream stream(data, size);
+      const spv::Id second = stream.AllocateId();
+      auto main_function = stream.Instructions(spv::Op::OpFunction).begin();
+      std::vector<uint32_t> function;
+      sut::InstructionBuilder builder(spv::Op::OpFunction);
+      builder.AddId(main_function->GetWord(1))
+          .AddId(second)
+          .AddLiteral(0)
+          .AddId(main_function->GetWord(4));
+      function.insert(function.end(), builder.data(),
+                      builder.data() + builder.size());
+      builder.Reset(spv::Op::OpLabel);
+      builder.AddId(stream.AllocateId());
+      function.insert(function.end(), builder.data(),
+                      builder.data() + builder.size());
+      for (spv::Op opcode : {spv::Op::OpReturn, spv::Op::OpFunctionEnd}) {
+        function.push_back(
+            sut::MergeSpvOpCode({1U, static_cast<uint16_t>(opcode)}));
+      }
+      stream.Instructions(spv::Op::OpFunctionEnd).rbegin()->InsertAfter(
+          function.data(), function.size());
+
+      builder.Reset(spv::Op::OpEntryPoint);
+      builder.AddLiteral(static_cast<uint32_t>(spv::ExecutionModel::Fragment))
+          .AddId(second)
+          .AddString("second");
+      stream.Instructions(spv::Op::OpEntryPoint).begin()->InsertAfter(builder);
+      builder.Reset(spv::Op::OpExecutionMode);
+      builder.AddId(second).AddLiteral(
+          static_cast<uint32_t>(spv::ExecutionMode::OriginUpperLeft));
+      auto execution_mode =
+          stream.Instructions(spv::Op::OpExecutionMode).begin();
+      execution_mode->InsertAfter(builder);
+
+      const std::vector<uint32_t> main_words =
+          stream.ExtractEntryPoint("main", spv::ExecutionModel::Fragment)
+              .GetWordsStream();
+      REQUIRE(main_words.size() == expected.size());
+      REQUIRE(std::equal(main_words.begin() + 5, main_words.end(),
+                         expected.begin() + 5));
+
+      const sut::OpcodeStream second_stream =
+          stream.ExtractEntryPoint("second", spv::ExecutionModel::Fragment);
+      REQUIRE(second_stream.Instructions(spv::Op::OpEntryPoint).size() == 1);
+      REQUIRE(second_stream.Instructions(spv::Op::OpEntryPoint)
+                  .begin()
+                  ->GetWord(2) == second);
+      REQUIRE(second_stream.Instructions(spv::Op::OpExecutionMode).size() ==
+              1);
+      REQUIRE(second_stream.Instructions(spv::Op::OpFunction).size() == 1);
+      REQUIRE(second_stream.Instructions(spv::Op::OpVariable).empty());
+
+      REQUIRE_THROWS_AS(
+          stream.ExtractEntryPoint("second", spv::ExecutionModel::Vertex),
+          sut::InvalidParameter);
+      REQUIRE_THROWS_AS(
+          stream.ExtractEntryPoint("mai", spv::ExecutionModel::Fragment),
+          sut::InvalidParameter);
+
+      // Operating on the stream drops the cached analysis
+      execution_mode->Remove();
+      REQUIRE(stream.ExtractEntryPoint("second", spv::ExecutionModel::Fragment)
+                  .Instructions(spv::Op::OpExecutionMode)
+                  .size() == 1);
+      REQUIRE(stream.ExtractEntryPoint("main", spv::ExecutionModel::Fragment)
+                  .Instructions(spv::Op::OpExecutionMode)
+                  .empty());
+    }
+
+    SECTION("Compacting renumbers the ids densely in definition order") {
+      const sut::OpcodeStream original(data, size);
+      const sut::OpcodeStream compacted = original.CompactIds();
+      const std::vector<uint32_t> expected = compacted.GetWordsStream();
+      REQUIRE(expected.size() == original.words_count());
+      REQUIRE(compacted.CompactIds().GetWordsStream() == expected);
+
+      sut::FingerprintOptions canonical_ids;
+      canonical_ids.canonical_ids = true;
+      REQUIRE(compacted.Fingerprint(canonical_ids) ==
+              original.Fingerprint(canonical_ids));
+
+      // Every id below the bound is defined, in order
+      size_t previous_index = 0;
+      for (spv::Id id = 1; id < compacted.GetIdBound(); ++id) {
+        auto definition = compacted.FindDefinition(id);
+        REQUIRE(definition != compacted.end());
+        REQUIRE(definition->index() > previous_index);
+        previous_index = definition->index();
+      }
+      REQUIRE(compacted.GetIdBound() <= original.GetIdBound());
+
+      // Sparse ids and an inflated bound compact to the same words
+      sut::OpcodeStream sparse(data, size);
+      std::vector<spv::Id> id_map(sparse.GetIdBound(), 0);
+      for (size_t id = 1; id < id_map.size(); ++id) {
+        id_map[id] = static_cast<spv::Id>(3 * id + 1000);
+      }
+      sparse.RemapIds(id_map);
+      sparse.AllocateIds(5000);
+      REQUIRE(sparse.GetIdBound() > 5000);
+      REQUIRE(sparse.CompactIds().GetWordsStream() == expected);
+
+      // Names and decorations in another order only match in canonical order
+      sut::OpcodeStream reordered(data, size);
+      auto name = reordered.Instructions(spv::Op::OpName).begin();
+      reordered.Instructions(spv::Op::OpName).rbegin()->InsertAfter(
+          name->data(), name->GetWordCount());
+      name->Remove();
+      auto decoration = reordered.Instructions(spv::Op::OpDecorate).rbegin();
+      reordered.Instructions(spv::Op::OpDecorate).begin()->InsertBefore(
+          decoration->data(), decoration->GetWordCount());
+      decoration->Remove();
+      REQUIRE(reordered.CompactIds().GetWordsStream() != expected);
+
+      sut::CompactIdsOptions canonical_order;
+      canonical_order.canonical_order = true;
+      const std::vector<uint32_t> canonical =
+          original.CompactIds(canonical_order).GetWordsStream();
+      REQUIRE(canonical.size() == expected.size());
+      REQUIRE(reordered.CompactIds(canonical_order).GetWordsStream() ==
+              canonical);
+      REQUIRE(sparse.CompactIds(canonical_order).GetWordsStream() ==
+              canonical);
+
+      // Extended instructions mixing ids and literals can't be renumbered
+      sut::OpcodeStream debug_info(data, size);
+      const spv::Id set = debug_info.AllocateId();
+      const spv::Id void_type =
+          debug_info.Instructions(spv::Op::OpTypeVoid).begin()->GetWord(1);
+      sut::InstructionBuilder builder(spv::Op::OpExtInstImport);
+      builder.AddId(set).AddString("OpenCL.DebugInfo.100");
+      debug_info.Instructions(spv::Op::OpExtInstImport).begin()->InsertAfter(
+          builder);
+      builder.Reset(spv::Op::OpExtInst);
+      builder.AddId(void_type).AddId(debug_info.AllocateId()).AddId(set)
+          .AddLiteral(2).AddId(void_type).AddId(void_type).AddLiteral(1);
+      debug_info.Instructions(spv::Op::OpLoad).begin()->InsertBefore(builder);
+      REQUIRE_THROWS_AS(debug_info.CompactIds(), sut::InvalidStream);
+    }
+
+    SECTION("Operating on a view throws until it is promoted") {
+      sut::OpcodeStream view = sut::OpcodeStream::View(data, size);
+      for (auto &i : view) {
+        if (i.GetOpcode() == spv::Op::OpCapability) {
+          REQUIRE_THROWS_AS(i.Remove(), sut::InvalidOperation);
+          REQUIRE_THROWS_AS(
+              i.InsertAfter(longer_instruction.data(),
+                            longer_instruction.size()),
+              sut::InvalidOperation);
+          REQUIRE_THROWS_AS(i.GetWords(), sut::InvalidOperation);
+        }
+      }
+
+      view.Promote();
+      REQUIRE_FALSE(view.IsView());
+      for (auto &i : view) {
+        if (i.GetOpcode() == spv::Op::OpCapability) {
+          i.InsertAfter(longer_instruction.data(), longer_instruction.size());
+        }
+      }
+
+      std::vector<uint32_t> new_module =
+          view.EmitFilteredStream().GetWordsStream();
+      REQUIRE(new_module.size() == ((size / 4) + longer_instruction.size()));
+    }
+
+    SECTION("A mapped file can be operated on and emitted to a file") {
+      sut::OpcodeStream stream = sut::OpcodeStream::FromFile(
+          STR(SPV_ASSETS_FOLDER) "/test.frag.spv");
+      REQUIRE_FALSE(stream.IsView());
+      REQUIRE(stream.words_count() == static_cast<size_t>(size / 4));
+      REQUIRE(std::equal(stream.data(), stream.data() + stream.words_count(),
+                         reinterpret_cast<const uint32_t *>(data)));
+
+      for (auto &i : stream) {
+        if (i.GetOpcode() == spv::Op::OpCapability) {
+          i.InsertBefore(longer_instruction.data(), longer_instruction.size());
+          i.Replace(longer_instruction_2.data(), longer_instruction_2.size());
+        }
+      }
+
+      stream.EmitToFile("test_0_emitted.spv");
+      std::vector<uint32_t> emitted_module =
+          sut::OpcodeStream::FromFile("test_0_emitted.spv").GetWordsStream();
+      std::remove("test_0_emitted.spv");
+
+      REQUIRE(emitted_module == stream.EmitFilteredStream().GetWordsStream());
+    }
+
+    SECTION("Mapping a file which does not exist throws") {
+      REQUIRE_THROWS_AS(sut::OpcodeStream::FromFile("does_not_exist.spv"),
+                        sut::FileError);
+    }
+
     SECTION("Removing more than once throws") {
       sut::OpcodeStream stream(data, size);
       for (auto &i : stream) {
@@ -199,3 +1493,710 @@ TEST_CASE("spv utils is tested with correct spir-v binary",
     }
   }
 }
+
+TEST_CASE("spv utils is tested with a large spir-v binary",
+          "[spv-utils-large-spvbin]") {
+  // Read spv binary module from a file
+  std::ifstream spv_file(STR(SPV_ASSETS_FOLDER) "/test.frag.spv",
+                         std::ios::binary | std::ios::ate | std::ios::in);
+  REQUIRE(spv_file.is_open() == true);
+  std::streampos size = spv_file.tellg();
+  CHECK(size > 0);
+
+  std::vector<uint32_t> sample_module(static_cast<size_t>(size) / 4);
+  spv_file.seekg(0, std::ios::beg);
+  spv_file.read(reinterpret_cast<char *>(sample_module.data()), size);
+  spv_file.close();
+
+  // Build a module larger than 1M words by repeating the instructions of the
+  // sample module after its header
+  const size_t kHeaderSize = 5;
+  std::vector<uint32_t> module(sample_module.begin(),
+                               sample_module.begin() + kHeaderSize);
+  while (module.size() <= (1U << 20U)) {
+    module.insert(module.end(), sample_module.begin() + kHeaderSize,
+                  sample_module.end());
+  }
+
+  SECTION("Chained insertions on instructions far in the module are emitted") {
+    const uint32_t kInsertionsCount = 1000;
+    const uint32_t nop_header =
+        sut::MergeSpvOpCode({2U, static_cast<uint16_t>(spv::Op::OpNop)});
+
+    sut::OpcodeStream stream(module);
+    sut::OpcodeStream::reverse_iterator last = stream.rbegin();
+    // Skip the terminator
+    last++;
+    const size_t last_offset = last->offset();
+    REQUIRE(last_offset > 0xFFFF);
+
+    for (uint32_t n = 0; n < kInsertionsCount; ++n) {
+      std::array<uint32_t, 2U> before = {nop_header, n};
+      std::array<uint32_t, 2U> after = {nop_header, kInsertionsCount + n};
+      last->InsertBefore(before.data(), before.size());
+      last->InsertAfter(after.data(), after.size());
+    }
+
+    sut::OpcodeStream new_stream = stream.EmitFilteredStream();
+    std::vector<uint32_t> new_module = new_stream.GetWordsStream();
+
+    REQUIRE(new_module.size() == (module.size() + (kInsertionsCount * 4)));
+    REQUIRE(new_stream.size() == (stream.size() + (kInsertionsCount * 2)));
+    REQUIRE(std::equal(module.begin(), module.begin() + last_offset,
+                       new_module.begin()));
+
+    // Insertions are emitted in LIFO order around the instruction
+    size_t word_index = last_offset;
+    for (uint32_t n = kInsertionsCount; n > 0; --n) {
+      REQUIRE(new_module[word_index] == nop_header);
+      REQUIRE(new_module[word_index + 1] == (n - 1));
+      word_index += 2;
+    }
+
+    const size_t last_word_count = last->GetWordCount();
+    REQUIRE(std::equal(module.begin() + last_offset,
+                       module.begin() + last_offset + last_word_count,
+                       new_module.begin() + word_index));
+    word_index += last_word_count;
+
+    for (uint32_t n = kInsertionsCount; n > 0; --n) {
+      REQUIRE(new_module[word_index] == nop_header);
+      REQUIRE(new_module[word_index + 1] == (kInsertionsCount + n - 1));
+      word_index += 2;
+    }
+
+    REQUIRE(word_index == new_module.size());
+  }
+}
+
+TEST_CASE("spv utils visits the instructions of a spir-v binary in place",
+          "[spv-utils-visitor]") {
+  // Read spv binary module from a file
+  std::ifstream spv_file(STR(SPV_ASSETS_FOLDER) "/test.frag.spv",
+                         std::ios::binary | std::ios::ate | std::ios::in);
+  REQUIRE(spv_file.is_open() == true);
+  std::streampos size = spv_file.tellg();
+  CHECK(size > 0);
+
+  std::vector<uint32_t> module(static_cast<size_t>(size) / 4);
+  spv_file.seekg(0, std::ios::beg);
+  spv_file.read(reinterpret_cast<char *>(module.data()), size);
+  spv_file.close();
+
+  // Expected instructions, from the stream without the header entries and
+  // the terminator
+  sut::OpcodeStream stream(module);
+  std::vector<size_t> expected_offsets;
+  for (auto &i : stream) {
+    if ((i.index() >= sut::kSpvHeaderWordsCount) &&
+        (i.index() < (stream.size() - 1))) {
+      expected_offsets.push_back(i.offset());
+    }
+  }
+
+  SECTION("Every instruction is visited in order") {
+    std::vector<size_t> offsets;
+    bool completed = sut::ForEachInstruction(
+        module.data(), module.size(),
+        [&](spv::Op opcode, size_t words_count, const uint32_t *operands) {
+          size_t offset = static_cast<size_t>(operands - module.data()) - 1;
+          CHECK(static_cast<spv::Op>(module[offset] & 0xFFFF) == opcode);
+          CHECK((module[offset] >> 16) == words_count);
+          offsets.push_back(offset);
+          return true;
+        });
+
+    REQUIRE(completed);
+    REQUIRE(offsets == expected_offsets);
+  }
+
+  SECTION("The visitor can stop the walk early") {
+    size_t visited_count = 0;
+    bool completed = sut::ForEachInstruction(
+        module.data(), module.size(),
+        [&](spv::Op opcode, size_t, const uint32_t *) {
+          ++visited_count;
+          return opcode != spv::Op::OpEntryPoint;
+        });
+
+    REQUIRE_FALSE(completed);
+    REQUIRE(visited_count == 4);
+  }
+
+  // Size of the module truncated in the middle of its OpEntryPoint
+  const size_t truncated_size = expected_offsets[3] + 2;
+
+  SECTION("A truncated module throws") {
+    REQUIRE_THROWS_AS(
+        sut::ForEachInstruction(
+            module.data(), truncated_size,
+            [](spv::Op, size_t, const uint32_t *) { return true; }),
+        sut::InvalidStream);
+  }
+
+  SECTION("Chunks of any size produce the same instructions") {
+    const size_t chunk_sizes[] = {1, 3, 4, 7, 64, 1000};
+    const unsigned char *bytes =
+        reinterpret_cast<const unsigned char *>(module.data());
+    const size_t bytes_count = module.size() * sizeof(uint32_t);
+
+    for (size_t chunk_size : chunk_sizes) {
+      std::vector<size_t> offsets;
+      size_t offset = sut::kSpvHeaderWordsCount;
+      auto parser = sut::MakeChunkedInstructionParser(
+          [&](spv::Op opcode, size_t words_count, const uint32_t *operands) {
+            CHECK(static_cast<spv::Op>(module[offset] & 0xFFFF) == opcode);
+            CHECK(std::equal(operands, operands + words_count - 1,
+                             module.begin() + offset + 1));
+            offsets.push_back(offset);
+            offset += words_count;
+            return true;
+          });
+
+      for (size_t byte_index = 0; byte_index < bytes_count;
+           byte_index += chunk_size) {
+        parser.Feed(bytes + byte_index,
+                    std::min(chunk_size, bytes_count - byte_index));
+      }
+      parser.Finish();
+
+      REQUIRE(parser.HasHeader());
+      REQUIRE(std::equal(parser.header(),
+                         parser.header() + sut::kSpvHeaderWordsCount,
+                         module.begin()));
+      REQUIRE(offsets == expected_offsets);
+    }
+  }
+
+  SECTION("A module ending in the middle of an instruction throws") {
+    auto parser = sut::MakeChunkedInstructionParser(
+        [](spv::Op, size_t, const uint32_t *) { return true; });
+    parser.Feed(module.data(), truncated_size * sizeof(uint32_t));
+
+    REQUIRE_THROWS_AS(parser.Finish(), sut::InvalidStream);
+  }
+}
+
+TEST_CASE("spv utils builds instructions without allocating",
+          "[spv-utils-instruction-builder]") {
+  SECTION("Strings are nul terminated and padded to whole words") {
+    sut::InstructionBuilder name(spv::Op::OpName);
+    name.AddId(4).AddString("main");
+
+    REQUIRE(name.size() == 4);
+    REQUIRE(sut::SplitSpvOpCode(name.data()[0]).words_count == 4);
+    REQUIRE(sut::SplitSpvOpCode(name.data()[0]).opcode ==
+            static_cast<uint16_t>(spv::Op::OpName));
+    REQUIRE(name.data()[2] == 0x6E69616D);
+    REQUIRE(name.data()[3] == 0);
+
+    name.Reset(spv::Op::OpString);
+    name.AddId(1).AddString("abcdefg");
+    REQUIRE(name.size() == 4);
+    REQUIRE(name.data()[3] == 0x00676665);
+  }
+
+  SECTION("Long instructions spill past the inline storage") {
+    const std::string long_name(sut::InstructionBuilder::kInlineWordsCount * 8,
+                                'x');
+    sut::InstructionBuilder entry_point(spv::Op::OpEntryPoint);
+    entry_point.AddLiteral(static_cast<uint32_t>(spv::ExecutionModel::Vertex))
+        .AddId(4)
+        .AddString(long_name);
+    for (spv::Id id = 10; id < 20; ++id) {
+      entry_point.AddId(id);
+    }
+
+    const size_t string_words_count = (long_name.size() / 4) + 1;
+    REQUIRE(entry_point.size() == (3 + string_words_count + 10));
+    REQUIRE(sut::SplitSpvOpCode(entry_point.data()[0]).words_count ==
+            entry_point.size());
+    REQUIRE(entry_point.data()[2] == 4);
+    REQUIRE(entry_point.data()[3] == 0x78787878);
+    REQUIRE(entry_point.data()[entry_point.size() - 1] == 19);
+  }
+}
+
+TEST_CASE("spv utils processes batches of modules on a pool of threads",
+          "[spv-utils-batch]") {
+  std::ifstream spv_file(STR(SPV_ASSETS_FOLDER) "/test.frag.spv",
+                         std::ios::binary | std::ios::ate | std::ios::in);
+  REQUIRE(spv_file.is_open() == true);
+  std::vector<uint32_t> module(static_cast<size_t>(spv_file.tellg()) / 4);
+  spv_file.seekg(0, std::ios::beg);
+  spv_file.read(reinterpret_cast<char *>(module.data()), module.size() * 4);
+  spv_file.close();
+
+  // Every other input is broken, and the others get one OpNop per index
+  std::vector<sut::BatchInput> inputs;
+  for (size_t i = 0; i < 64; ++i) {
+    inputs.push_back((i % 2) == 0
+                         ? sut::BatchInput::Words(module.data(), module.size())
+                         : sut::BatchInput::Words(module.data(), 2));
+  }
+  inputs.push_back(
+      sut::BatchInput::File(STR(SPV_ASSETS_FOLDER) "/test.frag.spv"));
+
+  const sut::BatchProcessor::Transform transform =
+      [](size_t index, sut::OpcodeStream &stream) {
+        const uint32_t nop = sut::MergeSpvOpCode(
+            {1U, static_cast<uint16_t>(spv::Op::OpNop)});
+        for (size_t i = 0; i < index; ++i) {
+          stream.begin()->InsertBefore(&nop, 1);
+        }
+      };
+
+  std::vector<std::vector<uint32_t>> expected(inputs.size());
+  for (size_t i = 0; i < inputs.size(); i += 2) {
+    sut::OpcodeStream stream(module);
+    transform(i, stream);
+    stream.EmitWords(expected[i]);
+  }
+
+  sut::BatchProcessor processor(4);
+  REQUIRE(processor.threads_count() == 4);
+
+  SECTION("Unordered runs deliver every result once") {
+    std::mutex mutex;
+    std::vector<size_t> delivered(inputs.size(), 0);
+    std::vector<std::vector<uint32_t>> outputs(inputs.size());
+    std::vector<bool> failed(inputs.size(), false);
+
+    processor.Run(inputs, transform, [&](const sut::BatchResult &result) {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++delivered[result.index];
+      outputs[result.index].assign(result.words,
+                                   result.words + result.words_count);
+      failed[result.index] = static_cast<bool>(result.error);
+    });
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      REQUIRE(delivered[i] == 1);
+      REQUIRE(failed[i] == ((i % 2) != 0));
+      REQUIRE(outputs[i] == expected[i]);
+    }
+  }
+
+  SECTION("Ordered runs deliver the results in order") {
+    for (size_t run = 0; run < 2; ++run) {
+      std::vector<size_t> order;
+      std::vector<std::vector<uint32_t>> outputs(inputs.size());
+      processor.RunOrdered(inputs, transform,
+                           [&](const sut::BatchResult &result) {
+                             order.push_back(result.index);
+                             outputs[result.index].assign(
+                                 result.words,
+                                 result.words + result.words_count);
+                           });
+
+      REQUIRE(order.size() == inputs.size());
+      for (size_t i = 0; i < order.size(); ++i) {
+        REQUIRE(order[i] == i);
+        REQUIRE(outputs[i] == expected[i]);
+      }
+    }
+  }
+
+  SECTION("Running while a batch is in flight throws and leaves it alone") {
+    std::mutex mutex;
+    std::vector<size_t> delivered(inputs.size(), 0);
+    size_t rejected = 0;
+    const std::vector<sut::BatchInput> other_inputs(8, inputs[0]);
+
+    processor.Run(inputs, transform, [&](const sut::BatchResult &result) {
+      bool threw = false;
+      if ((result.index % 8) == 0) {
+        try {
+          processor.Run(other_inputs, transform,
+                        [](const sut::BatchResult &) {});
+        } catch (const sut::InvalidOperation &) {
+          threw = true;
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      ++delivered[result.index];
+      rejected += threw ? 1 : 0;
+    });
+
+    REQUIRE(rejected == ((inputs.size() + 7) / 8));
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      REQUIRE(delivered[i] == 1);
+    }
+  }
+
+  SECTION("Exceptions thrown by the sink are rethrown") {
+    const sut::BatchProcessor::Sink sink = [](const sut::BatchResult &result) {
+      if (result.index == 10) {
+        throw std::runtime_error("sink");
+      }
+    };
+
+    REQUIRE_THROWS_AS(processor.Run(inputs, transform, sink),
+                      std::runtime_error);
+    REQUIRE_THROWS_AS(processor.RunOrdered(inputs, transform, sink),
+                      std::runtime_error);
+  }
+}
+
+TEST_CASE("spv utils runs passes over the functions in parallel",
+          "[spv-utils-function-pass]") {
+  std::ifstream spv_file(STR(SPV_ASSETS_FOLDER) "/test.frag.spv",
+                         std::ios::binary | std::ios::ate | std::ios::in);
+  REQUIRE(spv_file.is_open() == true);
+  std::vector<uint32_t> sample(static_cast<size_t>(spv_file.tellg()) / 4);
+  spv_file.seekg(0, std::ios::beg);
+  spv_file.read(reinterpret_cast<char *>(sample.data()), sample.size() * 4);
+  spv_file.close();
+
+  // Repeat the functions of the sample module, so that there are plenty of
+  // them to share among the threads
+  const sut::OpcodeStream sample_stream(sample);
+  const size_t functions_offset =
+      sample_stream.Section(sut::ModuleSection::kFunctions).begin()->offset();
+  std::vector<uint32_t> module(sample.begin(),
+                               sample.begin() + functions_offset);
+  for (size_t f = 0; f < 32; ++f) {
+    module.insert(module.end(), sample.begin() + functions_offset,
+                  sample.end());
+  }
+
+  const uint32_t nop =
+      sut::MergeSpvOpCode({1U, static_cast<uint16_t>(spv::Op::OpNop)});
+  const uint32_t double_nop[] = {nop, nop};
+
+  // Every function gets edited differently, depending on its index
+  const sut::OpcodeStream::FunctionPass pass =
+      [&](size_t function_index, sut::OpcodeStream::range function) {
+        for (auto &i : function) {
+          if (i.GetOpcode() == spv::Op::OpLoad) {
+            i.InsertBefore(&nop, 1);
+            i.InsertAfter(double_nop, 1 + (function_index % 2));
+          } else if ((i.GetOpcode() == spv::Op::OpStore) &&
+                     ((function_index % 3) == 0)) {
+            i.Replace(double_nop, 2);
+          } else if (i.GetOpcode() == spv::Op::OpLabel) {
+            i.InsertAfter(&nop, 1);
+          }
+        }
+      };
+
+  auto run_serially = [&](sut::OpcodeStream &stream) {
+    std::vector<sut::OpcodeStream::range> functions = stream.Functions();
+    for (size_t f = 0; f < functions.size(); ++f) {
+      pass(f, functions[f]);
+    }
+  };
+
+  SECTION("The output is the same as the one of a serial run") {
+    sut::OpcodeStream serial(module);
+    run_serially(serial);
+    std::vector<uint32_t> expected;
+    serial.EmitWords(expected);
+    REQUIRE(expected.size() > module.size());
+
+    for (size_t threads_count = 1; threads_count <= 8; threads_count *= 2) {
+      sut::OpcodeStream stream(module);
+      stream.RunFunctionPass(pass, threads_count);
+
+      std::vector<uint32_t> words;
+      stream.EmitWords(words);
+      REQUIRE(words == expected);
+      REQUIRE(stream.GetEmittedWordsCount() == expected.size());
+    }
+  }
+
+  SECTION("Operations of a pass go on top of the ones made before it") {
+    sut::OpcodeStream serial(module);
+    sut::OpcodeStream stream(module);
+    for (sut::OpcodeStream *s : {&serial, &stream}) {
+      for (auto &i : s->Instructions(spv::Op::OpLoad)) {
+        i.InsertBefore(double_nop, 2);
+      }
+    }
+
+    run_serially(serial);
+    stream.RunFunctionPass(pass, 4);
+
+    REQUIRE(stream.EmitFilteredStream().GetWordsStream() ==
+            serial.EmitFilteredStream().GetWordsStream());
+  }
+
+  SECTION("Definitions inserted by a pass are found once it is over") {
+    sut::OpcodeStream stream(module);
+    const spv::Id id = stream.AllocateId();
+    const spv::Id type = stream.Instructions(spv::Op::OpTypeFloat)
+                             .begin()
+                             ->GetWord(1);
+
+    stream.RunFunctionPass(
+        [&](size_t function_index, sut::OpcodeStream::range function) {
+          if (function_index == 5) {
+            const uint32_t undef[] = {
+                sut::MergeSpvOpCode(
+                    {3U, static_cast<uint16_t>(spv::Op::OpUndef)}),
+                type, id};
+            function.rbegin()->InsertBefore(undef, 3);
+          }
+        },
+        4);
+
+    REQUIRE(stream.FindDefinition(id)->index() ==
+            (stream.Functions()[5].rbegin()->index()));
+    REQUIRE(stream.GetResultType(id) == type);
+  }
+
+  SECTION("Operating outside of the function throws and drops the pass") {
+    sut::OpcodeStream stream(module);
+    const size_t words_count = stream.GetEmittedWordsCount();
+
+    REQUIRE_THROWS_AS(
+        stream.RunFunctionPass(
+            [&](size_t function_index, sut::OpcodeStream::range function) {
+              function.begin()->InsertBefore(&nop, 1);
+              if (function_index == 7) {
+                stream.begin()->InsertBefore(&nop, 1);
+              }
+            },
+            4),
+        sut::InvalidOperation);
+
+    REQUIRE(stream.GetEmittedWordsCount() == words_count);
+    REQUIRE(stream.EmitFilteredStream().GetWordsStream() == module);
+  }
+
+  SECTION("A pass on another stream within a pass leaves it running") {
+    sut::OpcodeStream serial(module);
+    run_serially(serial);
+    std::vector<uint32_t> expected;
+    serial.EmitWords(expected);
+
+    sut::OpcodeStream stream(module);
+    std::atomic<size_t> outside_throws(0);
+    stream.RunFunctionPass(
+        [&](size_t function_index, sut::OpcodeStream::range function) {
+          sut::OpcodeStream other(sample);
+          other.RunFunctionPass(pass, 1);
+
+          // Still within the pass on the stream once the other one is over
+          try {
+            stream.begin()->InsertBefore(&nop, 1);
+          } catch (const sut::InvalidOperation &) {
+            ++outside_throws;
+          }
+          pass(function_index, function);
+        },
+        4);
+
+    REQUIRE(outside_throws == stream.Functions().size());
+    REQUIRE(stream.EmitFilteredStream().GetWordsStream() == expected);
+  }
+}
+
+TEST_CASE("spv utils encodes modules compactly and decodes them exactly",
+          "[spv-utils-codec]") {
+  std::ifstream spv_file(STR(SPV_ASSETS_FOLDER) "/test.frag.spv",
+                         std::ios::binary | std::ios::ate | std::ios::in);
+  REQUIRE(spv_file.is_open() == true);
+  std::vector<uint32_t> module(static_cast<size_t>(spv_file.tellg()) / 4);
+  spv_file.seekg(0, std::ios::beg);
+  spv_file.read(reinterpret_cast<char *>(module.data()), module.size() * 4);
+  spv_file.close();
+
+  std::vector<uint8_t> encoded;
+  sut::EncodeModule(module.data(), module.size(), encoded);
+
+  SECTION("Modules round-trip to the exact words") {
+    REQUIRE(encoded.size() < (module.size() * sizeof(uint32_t) / 2));
+
+    sut::ModuleDecoder decoder(encoded.data(), encoded.size());
+    REQUIRE(decoder.words_count() == module.size());
+    std::vector<uint32_t> decoded(decoder.words_count());
+    decoder.DecodeInto(decoded.data());
+    REQUIRE(decoded == module);
+  }
+
+  SECTION("Instructions are visited as they are decoded") {
+    std::vector<uint32_t> expected;
+    sut::ForEachInstruction(
+        module.data(), module.size(),
+        [&expected](spv::Op, size_t words_count, const uint32_t *operands) {
+          expected.insert(expected.end(), operands - 1,
+                          operands + words_count - 1);
+          return true;
+        });
+
+    std::vector<uint32_t> visited;
+    const bool completed = sut::ForEachEncodedInstruction(
+        encoded.data(), encoded.size(),
+        [&visited](spv::Op opcode, size_t words_count,
+                   const uint32_t *operands) {
+          REQUIRE(static_cast<uint16_t>(opcode) ==
+                  sut::SplitSpvOpCode(operands[-1]).opcode);
+          visited.insert(visited.end(), operands - 1,
+                         operands + words_count - 1);
+          return true;
+        });
+    REQUIRE(completed);
+    REQUIRE(visited == expected);
+
+    size_t visited_count = 0;
+    const bool stopped = !sut::ForEachEncodedInstruction(
+        encoded.data(), encoded.size(),
+        [&visited_count](spv::Op, size_t, const uint32_t *) {
+          return ++visited_count < 3;
+        });
+    REQUIRE(stopped);
+    REQUIRE(visited_count == 3);
+  }
+
+  SECTION("Modules are decoded straight into a stream") {
+    const sut::OpcodeStream expected(module);
+    sut::OpcodeStream stream = sut::DecodeModule(encoded.data(), encoded.size());
+    REQUIRE(stream.GetWordsStream() == module);
+    REQUIRE(stream.size() == expected.size());
+    REQUIRE(stream.GetIdBound() == expected.GetIdBound());
+    auto expected_it = expected.begin();
+    for (const auto &i : stream) {
+      REQUIRE(i.offset() == expected_it->offset());
+      ++expected_it;
+    }
+    auto variable = stream.Instructions(spv::Op::OpVariable).begin();
+    REQUIRE(stream.FindDefinition(variable->GetWord(2))->index() ==
+            variable->index());
+
+    // The stream can be operated on and reused for another module
+    variable->Remove();
+    REQUIRE(stream.GetEmittedWordsCount() ==
+            (module.size() - variable->GetWordCount()));
+    const std::vector<uint32_t> compacted =
+        expected.CompactIds().GetWordsStream();
+    std::vector<uint8_t> compacted_encoded;
+    sut::EncodeModule(compacted.data(), compacted.size(), compacted_encoded);
+    REQUIRE(compacted_encoded.size() <= encoded.size());
+    sut::ModuleDecoder(compacted_encoded.data(), compacted_encoded.size())
+        .DecodeInto(stream);
+    REQUIRE(stream.GetWordsStream() == compacted);
+    REQUIRE_FALSE(stream.NeedsEmission());
+
+    // Split words which don't cover the header are refused
+    REQUIRE_THROWS_AS(
+        stream.Load(std::vector<uint32_t>(module.begin(), module.begin() + 3),
+                    std::vector<uint32_t>({0, 1, 2})),
+        sut::InvalidParameter);
+
+    // So are offsets which don't follow the word counts of the instructions
+    std::vector<uint32_t> offsets;
+    for (const auto &i : expected) {
+      if (i.offset() < module.size()) {
+        offsets.push_back(static_cast<uint32_t>(i.offset()));
+      }
+    }
+    stream.Load(std::vector<uint32_t>(module), std::vector<uint32_t>(offsets));
+    REQUIRE(stream.GetWordsStream() == module);
+    std::vector<uint32_t> past_end(offsets);
+    past_end.back() = static_cast<uint32_t>(module.size() + 10);
+    REQUIRE_THROWS_AS(stream.Load(std::vector<uint32_t>(module),
+                                  std::move(past_end)),
+                      sut::InvalidParameter);
+    std::vector<uint32_t> skewed(offsets);
+    ++skewed[sut::kSpvHeaderWordsCount + 1];
+    REQUIRE_THROWS_AS(stream.Load(std::vector<uint32_t>(module),
+                                  std::move(skewed)),
+                      sut::InvalidParameter);
+    std::vector<uint32_t> missing(offsets.begin(), offsets.end() - 1);
+    REQUIRE_THROWS_AS(stream.Load(std::vector<uint32_t>(module),
+                                  std::move(missing)),
+                      sut::InvalidParameter);
+  }
+
+  SECTION("Modules of the opposite endianness round-trip as they are") {
+    std::vector<uint32_t> swapped(module);
+    for (uint32_t &word : swapped) {
+      word = ((word & 0x000000FFU) << 24U) | ((word & 0x0000FF00U) << 8U) |
+             ((word & 0x00FF0000U) >> 8U) | ((word & 0xFF000000U) >> 24U);
+    }
+    sut::EncodeModule(swapped.data(), swapped.size(), encoded);
+
+    sut::ModuleDecoder decoder(encoded.data(), encoded.size());
+    std::vector<uint32_t> decoded(decoder.words_count());
+    decoder.DecodeInto(decoded.data());
+    REQUIRE(decoded == swapped);
+
+    // Streams and visitors are given native words
+    REQUIRE(sut::DecodeModule(encoded.data(), encoded.size())
+                .GetWordsStream() == module);
+    size_t visited_count = 0;
+    sut::ForEachEncodedInstruction(
+        encoded.data(), encoded.size(),
+        [&](spv::Op, size_t words_count, const uint32_t *operands) {
+          REQUIRE(std::equal(operands - 1, operands + words_count - 1,
+                             module.begin() + visited_count + 5));
+          visited_count += words_count;
+          return true;
+        });
+    REQUIRE(visited_count == (module.size() - 5));
+  }
+
+  SECTION("Words which don't follow the grammar round-trip too") {
+    std::mt19937 generator(7);
+    std::vector<uint32_t> words(module.begin(), module.begin() + 5);
+    for (size_t i = 0; i < 2000; ++i) {
+      const uint32_t opcode = generator() % 400;
+      const uint32_t words_count = 1 + (generator() % 40);
+      words.push_back(sut::MergeSpvOpCode(
+          {static_cast<uint16_t>(words_count), static_cast<uint16_t>(opcode)}));
+      for (uint32_t w = 1; w < words_count; ++w) {
+        words.push_back(generator() >> (generator() % 32));
+      }
+    }
+    sut::EncodeModule(words.data(), words.size(), encoded);
+
+    sut::ModuleDecoder decoder(encoded.data(), encoded.size());
+    std::vector<uint32_t> decoded(decoder.words_count());
+    decoder.DecodeInto(decoded.data());
+    REQUIRE(decoded == words);
+  }
+
+  SECTION("Corrupt encoded modules throw") {
+    std::vector<uint8_t> corrupt(encoded.begin(), encoded.end() - 1);
+    REQUIRE_THROWS_AS(sut::DecodeModule(corrupt.data(), corrupt.size()),
+                      sut::InvalidStream);
+
+    corrupt.assign(encoded.begin(), encoded.end());
+    corrupt.push_back(0);
+    REQUIRE_THROWS_AS(sut::DecodeModule(corrupt.data(), corrupt.size()),
+                      sut::InvalidStream);
+
+    corrupt.assign(encoded.begin(), encoded.end());
+    corrupt[0] ^= 0xFF;
+    REQUIRE_THROWS_AS(sut::ModuleDecoder(corrupt.data(), corrupt.size()),
+                      sut::InvalidStream);
+
+    // A word count larger than the data is rejected before decoding; the
+    // count is the varint following the tag
+    size_t count_end = 4;
+    while (encoded[count_end] >= 0x80) {
+      ++count_end;
+    }
+    corrupt.assign(encoded.begin(), encoded.begin() + 4);
+    corrupt.insert(corrupt.end(), {0xFF, 0xFF, 0xFF, 0x0F});
+    corrupt.insert(corrupt.end(), encoded.begin() + count_end + 1,
+                   encoded.end());
+    REQUIRE_THROWS_AS(sut::ModuleDecoder(corrupt.data(), corrupt.size()),
+                      sut::InvalidStream);
+
+    sut::ModuleDecoder decoder(encoded.data(), encoded.size());
+    size_t words_count = 0;
+    REQUIRE(decoder.NextInstruction(&words_count) != nullptr);
+    sut::OpcodeStream stream;
+    REQUIRE_THROWS_AS(decoder.DecodeInto(stream), sut::InvalidOperation);
+
+    std::vector<uint32_t> invalid(module);
+    invalid[5] = sut::MergeSpvOpCode(
+        {0U, static_cast<uint16_t>(spv::Op::OpCapability)});
+    REQUIRE_THROWS_AS(
+        sut::EncodeModule(invalid.data(), invalid.size(), encoded),
+        sut::InvalidStream);
+  }
+}